@@ -34,6 +34,7 @@
 
 #include "alias.h"
 #include "config.h"
+#include "lib/hashmap.h"
 #include "swupd.h"
 
 #define MODE_RW_O (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
@@ -624,8 +625,7 @@ enum swupd_code remove_bundles(char **bundles)
 			goto out_free_mom;
 		}
 
-		current_mom->files = files_from_bundles(current_mom->submanifests);
-		current_mom->files = consolidate_files(current_mom->files);
+		current_mom->files = consolidate_bundle_files(current_mom->submanifests);
 
 		/* Now that we have the consolidated list of all files, load bundle to be removed submanifest */
 		ret = load_bundle_manifest(bundle, subs, current_version, &bundle_manifest);
@@ -675,12 +675,121 @@ enum swupd_code remove_bundles(char **bundles)
 	return ret_code;
 }
 
+/* A bundle found while resolving includes, and its header-only manifest */
+struct bundle_header {
+	const char *name;
+	struct manifest *manifest;
+};
+
+static bool bundle_header_equal(const void *a, const void *b)
+{
+	return strcmp(((const struct bundle_header *)a)->name, ((const struct bundle_header *)b)->name) == 0;
+}
+
+static size_t bundle_header_hash(const void *data)
+{
+	return hashmap_hash_from_string(((const struct bundle_header *)data)->name);
+}
+
+static void bundle_header_free(void *data)
+{
+	struct bundle_header *header = data;
+
+	free_manifest(header->manifest);
+	free(header);
+}
+
+/*
+ * Load the header of all bundles in the include graph of BUNDLES. Each level
+ * of the graph is loaded as one concurrent batch and each bundle is loaded
+ * only once. Bundles that fail to load are kept with a NULL manifest, so
+ * errors are reported by add_subscriptions() only if it needs them.
+ *
+ * Includes already in SUBS are pruned like add_subscriptions_recurse()
+ * does, so their subtrees are not loaded.
+ */
+static struct hashmap *load_bundle_headers(struct list *bundles, struct list *subs, struct manifest *mom, int recursion)
+{
+	struct hashmap *headers;
+	struct list *level = NULL;
+	struct list *iter;
+
+	headers = hashmap_new(list_len(mom->manifests), bundle_header_equal, bundle_header_hash);
+	ON_NULL_ABORT(headers);
+
+	for (iter = list_head(bundles); iter; iter = iter->next) {
+		if (component_subscribed(subs, iter->data) && recursion > 0) {
+			continue;
+		}
+		level = list_prepend_data(level, iter->data);
+	}
+
+	while (level) {
+		struct list *files = NULL;
+		struct list *manifests;
+		struct list *next = NULL;
+
+		for (iter = level; iter; iter = iter->next) {
+			struct bundle_header key = { 0 };
+			struct bundle_header *header;
+			struct file *file;
+
+			key.name = iter->data;
+			if (hashmap_get(headers, &key)) {
+				continue;
+			}
+
+			header = calloc(1, sizeof(struct bundle_header));
+			ON_NULL_ABORT(header);
+			header->name = iter->data;
+			hashmap_put(headers, header);
+
+			file = search_bundle_in_manifest(mom, header->name);
+			if (file) {
+				files = list_prepend_data(files, file);
+			}
+		}
+		list_free_list(level);
+
+		manifests = load_manifests(mom, files, true);
+		list_free_list(files);
+
+		for (iter = manifests; iter; iter = iter->next) {
+			struct manifest *manifest = iter->data;
+			struct bundle_header key = { 0 };
+			struct bundle_header *header;
+			struct list *include;
+
+			key.name = manifest->component;
+			header = hashmap_get(headers, &key);
+			if (!header) {
+				free_manifest(manifest);
+				continue;
+			}
+			header->name = manifest->component;
+			header->manifest = manifest;
+
+			for (include = manifest->includes; include; include = include->next) {
+				if (component_subscribed(subs, include->data)) {
+					continue;
+				}
+				next = list_prepend_data(next, include->data);
+			}
+		}
+		list_free_list(manifests);
+
+		level = next;
+	}
+
+	return headers;
+}
+
 /* bitmapped return
    1 error happened
    2 new subscriptions
    4 bad name given
 */
-int add_subscriptions(struct list *bundles, struct list **subs, struct manifest *mom, bool find_all, int recursion)
+static int add_subscriptions_recurse(struct list *bundles, struct list **subs, struct manifest *mom, bool find_all, int recursion, struct hashmap *headers)
 {
 	char *bundle;
 	int manifest_err;
@@ -688,6 +797,8 @@ int add_subscriptions(struct list *bundles, struct list **subs, struct manifest
 	struct file *file;
 	struct list *iter;
 	struct manifest *manifest;
+	struct bundle_header key = { 0 };
+	struct bundle_header *header;
 
 	iter = list_head(bundles);
 	while (iter) {
@@ -713,22 +824,34 @@ int add_subscriptions(struct list *bundles, struct list **subs, struct manifest
 			continue;
 		}
 
-		manifest = load_manifest(file->last_change, file, mom, true, &manifest_err);
-		if (!manifest) {
-			error("Unable to download manifest %s version %d, exiting now\n", bundle, file->last_change);
-			ret |= add_sub_ERR;
-			goto out;
+		/* Headers already loaded are owned by the headers map */
+		key.name = bundle;
+		header = hashmap_get(headers, &key);
+		if (!header || !header->manifest) {
+			manifest = load_manifest(file->last_change, file, mom, true, &manifest_err);
+			if (!manifest) {
+				error("Unable to download manifest %s version %d, exiting now\n", bundle, file->last_change);
+				ret |= add_sub_ERR;
+				goto out;
+			}
+			if (!header) {
+				header = calloc(1, sizeof(struct bundle_header));
+				ON_NULL_ABORT(header);
+				header->name = manifest->component;
+				hashmap_put(headers, header);
+			}
+			header->name = manifest->component;
+			header->manifest = manifest;
 		}
+		manifest = header->manifest;
 
 		if (manifest->includes) {
-			int r = add_subscriptions(manifest->includes, subs, mom, find_all, recursion + 1);
+			int r = add_subscriptions_recurse(manifest->includes, subs, mom, find_all, recursion + 1, headers);
 			if (r & add_sub_ERR) {
-				free_manifest(manifest);
 				goto out;
 			}
 			ret |= r; /* merge in recursive call results */
 		}
-		free_manifest(manifest);
 
 		if (!find_all && is_installed_bundle(bundle)) {
 			continue;
@@ -744,6 +867,18 @@ out:
 	return ret;
 }
 
+int add_subscriptions(struct list *bundles, struct list **subs, struct manifest *mom, bool find_all, int recursion)
+{
+	struct hashmap *headers;
+	int ret;
+
+	headers = load_bundle_headers(bundles, *subs, mom, recursion);
+	ret = add_subscriptions_recurse(bundles, subs, mom, find_all, recursion, headers);
+	hashmap_free_hash_and_data(headers, bundle_header_free);
+
+	return ret;
+}
+
 static enum swupd_code install_bundles(struct list *bundles, struct list **subs, struct manifest *mom)
 {
 	int ret;
@@ -838,14 +973,12 @@ static enum swupd_code install_bundles(struct list *bundles, struct list **subs,
 	progress_set_step(2, "consolidate_files");
 
 	/* get all files already installed in the target system */
-	installed_files = files_from_bundles(installed_bundles);
-	installed_files = consolidate_files(installed_files);
+	installed_files = consolidate_bundle_files(installed_bundles);
 	mom->files = installed_files;
 	installed_files = filter_out_deleted_files(installed_files);
 
 	/* get all the files included in the bundles to be added */
-	to_install_files = files_from_bundles(to_install_bundles);
-	to_install_files = consolidate_files(to_install_files);
+	to_install_files = consolidate_bundle_files(to_install_bundles);
 	to_install_files = filter_out_deleted_files(to_install_files);
 
 	/* from the list of files to be installed, remove those files already in the target system */
@@ -864,7 +997,7 @@ static enum swupd_code install_bundles(struct list *bundles, struct list **subs,
 		filepath = mk_full_filename(path_prefix, "/usr/");
 
 		/* Calculate free space on filepath */
-		fs_free = get_available_space(filepath);
+		fs_free = get_fs_available_space(filepath);
 		free_string(&filepath);
 
 		/* Add 10% to bundle_size as a 'fudge factor' */
@@ -908,7 +1041,7 @@ static enum swupd_code install_bundles(struct list *bundles, struct list **subs,
 	/* step 5: Download missing files */
 	timelist_timer_start(global_times, "Download missing files");
 	progress_set_step(5, "download_fullfiles");
-	ret = download_fullfiles(to_install_files, NULL);
+	ret = download_fullfiles(to_install_files, NULL, false);
 	if (ret) {
 		/* make sure the return code is positive */
 		ret = abs(ret);
@@ -926,12 +1059,14 @@ static enum swupd_code install_bundles(struct list *bundles, struct list **subs,
 	/* This loop does an initial check to verify the hash of every downloaded file to install,
 	 * if the hash is wrong it is removed from staging area so it can be re-downloaded */
 	char *hashpath;
+	char hash[SWUPD_HASH_LEN];
 	iter = list_head(to_install_files);
 	while (iter) {
 		file = iter->data;
 		iter = iter->next;
 
-		string_or_die(&hashpath, "%s/staged/%s", state_dir, file->hash);
+		hash_to_hex(&file->hash, hash);
+		string_or_die(&hashpath, "%s/staged/%s", state_dir, hash);
 
 		if (access(hashpath, F_OK) < 0) {
 			/* the file does not exist in the staged directory, it will need
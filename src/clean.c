@@ -25,6 +25,9 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "download_size.h"
+#include "hash_cache.h"
+#include "search_index.h"
 #include "swupd.h"
 
 static void print_help(void)
@@ -173,6 +176,21 @@ static bool is_pack_indicator(const char UNUSED_PARAM *dir, const struct dirent
 	return !memcmp(name, prefix, prefix_len) && !memcmp(name + len - suffix_len, suffix, suffix_len);
 }
 
+static bool is_hash_cache(const char UNUSED_PARAM *dir, const struct dirent *entry)
+{
+	return strcmp(entry->d_name, HASH_CACHE_FILENAME) == 0;
+}
+
+static bool is_search_index(const char UNUSED_PARAM *dir, const struct dirent *entry)
+{
+	return strcmp(entry->d_name, SEARCH_INDEX_FILENAME) == 0;
+}
+
+static bool is_download_sizes(const char UNUSED_PARAM *dir, const struct dirent *entry)
+{
+	return strcmp(entry->d_name, DOWNLOAD_SIZES_FILENAME) == 0;
+}
+
 static bool is_all_digits(const char *s)
 {
 	for (; *s; s++) {
@@ -338,6 +356,9 @@ static enum swupd_code clean_staged_manifests(const char *path, bool dry_run, bo
 		} else {
 			/* Remove all manifest files, including hash-hints */
 			ret = remove_if(version_dir, dry_run, is_manifest);
+			if (ret == 0) {
+				ret = remove_if(version_dir, dry_run, is_search_index);
+			}
 		}
 
 		/* Remove empty dirs if possible. */
@@ -431,6 +452,21 @@ enum swupd_code clean_statedir(bool dry_run, bool all)
 		return ret;
 	}
 
+	/* Cache of file hashes, it will be regenerated by the next verify. */
+	if (all) {
+		ret = remove_if(state_dir, dry_run, is_hash_cache);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	/* Sizes of files to download, the ones of old versions are never used
+	 * again and the others are queried again when needed. */
+	ret = remove_if(state_dir, dry_run, is_download_sizes);
+	if (ret != 0) {
+		return ret;
+	}
+
 	/* NOTE: do not clean the state_dir/bundles directory */
 
 	return clean_staged_manifests(state_dir, dry_run, all);
@@ -24,19 +24,26 @@
 /*
  * The curl library is great, but it is a little bit of a pain to get it to
  * reuse connections properly for simple cases. This file will manage our
- * curl handle properly so that we have a standing chance to get reuse
+ * curl handles properly so that we have a standing chance to get reuse
  * of our connections.
  *
+ * All downloads, synchronous or not, get their curl handles from a process
+ * wide transfer context. Handles are reused instead of created for each
+ * download and all of them share the DNS cache, TLS sessions and open
+ * connections, so the handshakes with the server are done only once.
+ *
  * NOTE NOTE NOTE
  *
- * Only use these from the main thread of the program. For multithreaded
- * use, you need to manage your own curl multi environment.
+ * Only use the synchronous download functions from the main thread of the
+ * program. For multithreaded use, you need to manage your own curl multi
+ * environment.
  */
 
 #define _GNU_SOURCE
 #include <curl/curl.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,8 +57,16 @@
 #define SWUPD_CURL_LOW_SPEED_LIMIT 1
 #define SWUPD_CURL_CONNECT_TIMEOUT 30
 #define SWUPD_CURL_RCV_TIMEOUT 120
+// Maximum number of idle curl handles kept for reuse
+#define SWUPD_CURL_MAX_IDLE_HANDLES 64
 
-static CURL *curl = NULL;
+static struct {
+	CURLSH *share; /* DNS, TLS session and connection caches */
+	pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+	pthread_mutex_t lock; /* protects idle handles */
+	CURL *idle[SWUPD_CURL_MAX_IDLE_HANDLES];
+	int idle_len;
+} context = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 uint64_t total_curl_sz = 0;
 
@@ -123,26 +138,148 @@ exit:
 	return curl_ret;
 }
 
+static void share_lock(CURL UNUSED_PARAM *handle, curl_lock_data data, curl_lock_access UNUSED_PARAM access, void UNUSED_PARAM *userptr)
+{
+	pthread_mutex_lock(&context.share_locks[data]);
+}
+
+static void share_unlock(CURL UNUSED_PARAM *handle, curl_lock_data data, void UNUSED_PARAM *userptr)
+{
+	pthread_mutex_unlock(&context.share_locks[data]);
+}
+
+static int share_init(void)
+{
+	int i;
+
+	context.share = curl_share_init();
+	if (!context.share) {
+		return -1;
+	}
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_init(&context.share_locks[i], NULL);
+	}
+
+	if (curl_share_setopt(context.share, CURLSHOPT_LOCKFUNC, share_lock) != CURLSHE_OK ||
+	    curl_share_setopt(context.share, CURLSHOPT_UNLOCKFUNC, share_unlock) != CURLSHE_OK ||
+	    curl_share_setopt(context.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK) {
+		return -1;
+	}
+
+	// Sharing is just an optimization, so ignore what the library doesn't support
+	if (curl_share_setopt(context.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK) {
+		debug("Curl - TLS sessions can't be shared\n");
+	}
+#if LIBCURL_VERSION_NUM >= 0x073900 /* 7.57.0 */
+	if (curl_share_setopt(context.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+		debug("Curl - Connections can't be shared\n");
+	}
+#endif
+
+	return 0;
+}
+
+static void share_deinit(void)
+{
+	int i;
+
+	if (!context.share) {
+		return;
+	}
+
+	curl_share_cleanup(context.share);
+	context.share = NULL;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_destroy(&context.share_locks[i]);
+	}
+}
+
+CURL *swupd_curl_handle_get(void)
+{
+	CURL *handle = NULL;
+
+	if (!context.share) {
+		error("Curl hasn't been initialized\n");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&context.lock);
+	if (context.idle_len > 0) {
+		handle = context.idle[--context.idle_len];
+	}
+	pthread_mutex_unlock(&context.lock);
+
+	if (handle) {
+		// Keeps connections and caches, but drops options of the last use
+		curl_easy_reset(handle);
+	} else {
+		handle = curl_easy_init();
+		if (!handle) {
+			return NULL;
+		}
+	}
+
+	if (curl_easy_setopt(handle, CURLOPT_SHARE, context.share) != CURLE_OK) {
+		curl_easy_cleanup(handle);
+		return NULL;
+	}
+
+	return handle;
+}
+
+void swupd_curl_handle_release(CURL *handle)
+{
+	if (!handle) {
+		return;
+	}
+
+	pthread_mutex_lock(&context.lock);
+	if (context.idle_len < SWUPD_CURL_MAX_IDLE_HANDLES) {
+		context.idle[context.idle_len++] = handle;
+		handle = NULL;
+	}
+	pthread_mutex_unlock(&context.lock);
+
+	curl_easy_cleanup(handle);
+}
+
+static void free_idle_handles(void)
+{
+	pthread_mutex_lock(&context.lock);
+	while (context.idle_len > 0) {
+		curl_easy_cleanup(context.idle[--context.idle_len]);
+	}
+	pthread_mutex_unlock(&context.lock);
+}
+
 static int check_connection(const char *test_capath)
 {
 	CURLcode curl_ret;
+	CURL *curl;
 	long response = 0;
+	int ret = -1;
+
+	curl = swupd_curl_handle_get();
+	if (!curl) {
+		return -1;
+	}
 
 	debug("Curl - check_connection url: %s\n", version_url);
 	curl_ret = swupd_curl_set_basic_options(curl, version_url, false);
 	if (curl_ret != CURLE_OK) {
-		return -1;
+		goto exit;
 	}
 
 	curl_ret = curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
 	if (curl_ret != CURLE_OK) {
-		return -1;
+		goto exit;
 	}
 
 	if (test_capath) {
 		curl_ret = curl_easy_setopt(curl, CURLOPT_CAPATH, test_capath);
 		if (curl_ret != CURLE_OK) {
-			return -1;
+			goto exit;
 		}
 	}
 
@@ -150,27 +287,35 @@ static int check_connection(const char *test_capath)
 
 	switch (curl_ret) {
 	case CURLE_OK:
-		return 0;
+		ret = 0;
+		break;
 	case CURLE_SSL_CACERT:
 		debug("Curl - Unable to verify server SSL certificate\n");
-		return -SWUPD_BAD_CERT;
+		ret = -SWUPD_BAD_CERT;
+		break;
 	case CURLE_SSL_CERTPROBLEM:
 		debug("Curl - Problem with the local client SSL certificate\n");
-		return -SWUPD_BAD_CERT;
+		ret = -SWUPD_BAD_CERT;
+		break;
 	case CURLE_OPERATION_TIMEDOUT:
 		debug("Curl - Timed out\n");
-		return -CURLE_OPERATION_TIMEDOUT;
+		ret = -CURLE_OPERATION_TIMEDOUT;
+		break;
 	case CURLE_HTTP_RETURNED_ERROR:
 		if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response) != CURLE_OK) {
 			response = 0;
 		}
 		debug("Curl - process_curl_error_codes: curl_ret = %d, response = %d\n", curl_ret, response);
-		return -1;
+		break;
 	default:
 		debug("Curl - Download error - (%d) %s\n", curl_ret,
 		      curl_easy_strerror(curl_ret));
-		return -1;
+		break;
 	}
+
+exit:
+	swupd_curl_handle_release(curl);
+	return ret;
 }
 
 int swupd_curl_init(void)
@@ -182,7 +327,7 @@ int swupd_curl_init(void)
 	int ret;
 	struct stat st;
 
-	if (curl) {
+	if (context.share) {
 		warn("Curl has already been initialized\n");
 		return 0;
 	}
@@ -193,9 +338,9 @@ int swupd_curl_init(void)
 		return -1;
 	}
 
-	curl = curl_easy_init();
-	if (curl == NULL) {
+	if (share_init() != 0) {
 		error("Curl - Failed to initialize session\n");
+		share_deinit();
 		curl_global_cleanup();
 		return -1;
 	}
@@ -242,85 +387,17 @@ int swupd_curl_init(void)
 
 void swupd_curl_deinit(void)
 {
-	if (!curl) {
+	if (!context.share) {
 		return;
 	}
 
-	curl_easy_cleanup(curl);
-	curl = NULL;
+	// Handles using the share must be closed before it
+	free_idle_handles();
+	share_deinit();
 	free_string(&capath);
 	curl_global_cleanup();
 }
 
-static size_t dummy_write_cb(void UNUSED_PARAM *func, size_t size, size_t nmemb, void UNUSED_PARAM *data)
-{
-	/* Drop the content */
-	return (size_t)(size * nmemb);
-}
-
-double swupd_curl_query_content_size(char *url)
-{
-	CURLcode curl_ret;
-	double content_size;
-
-	if (!curl) {
-		error("Curl hasn't been initialized\n");
-		return -1;
-	}
-
-	curl_easy_reset(curl);
-
-	/* Set buffer for error string */
-	curl_ret = curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-	if (curl_ret != CURLE_OK) {
-		return -1;
-	}
-
-	curl_ret = curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, dummy_write_cb);
-	if (curl_ret != CURLE_OK) {
-		return -1;
-	}
-
-	curl_ret = curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
-	if (curl_ret != CURLE_OK) {
-		return -1;
-	}
-
-	curl_ret = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dummy_write_cb);
-	if (curl_ret != CURLE_OK) {
-		return -1;
-	}
-
-	curl_ret = curl_easy_setopt(curl, CURLOPT_URL, url);
-	if (curl_ret != CURLE_OK) {
-		return -1;
-	}
-
-	if (capath) {
-		curl_ret = curl_easy_setopt(curl, CURLOPT_CAPATH, capath);
-		if (curl_ret != CURLE_OK) {
-			return -1;
-		}
-	}
-
-	curl_ret = swupd_curl_set_optional_client_cert(curl);
-	if (curl_ret != CURLE_OK) {
-		return -1;
-	}
-
-	curl_ret = curl_easy_perform(curl);
-	if (curl_ret != CURLE_OK) {
-		return -1;
-	}
-
-	curl_ret = curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_size);
-	if (curl_ret != CURLE_OK) {
-		return -1;
-	}
-
-	return content_size;
-}
-
 static size_t swupd_download_file_to_memory(void *ptr, size_t size, size_t nmemb, void *userdata)
 {
 	struct curl_file_data *file_data = (struct curl_file_data *)userdata;
@@ -476,9 +553,15 @@ static enum download_status swupd_curl_get_file_full(const char *url, char *file
 	static bool resume_download_supported = true;
 
 	CURLcode curl_ret;
+	CURL *curl;
 	enum download_status status;
 	struct curl_file local = { 0 };
 
+	curl = swupd_curl_handle_get();
+	if (!curl) {
+		return DOWNLOAD_STATUS_ERROR;
+	}
+
 restart_download:
 	curl_easy_reset(curl);
 
@@ -550,6 +633,7 @@ exit:
 		unlink(filename);
 	}
 
+	swupd_curl_handle_release(curl);
 	return status;
 }
 
@@ -595,7 +679,7 @@ static int retry_download_loop(const char *url, char *filename, struct curl_file
 	int strategy;
 	int ret;
 
-	if (!curl) {
+	if (!context.share) {
 		error("Curl hasn't been initialized\n");
 		return -1;
 	}
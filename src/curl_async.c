@@ -34,6 +34,7 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "lib/congestion.h"
 #include "lib/hashmap.h"
 #include "lib/thread_pool.h"
 #include "swupd.h"
@@ -45,6 +46,10 @@
 #define CURL_MULTI_TIMEOUT 500
 // Fixed window added to hysteresis upper bound before it is enforced.
 #define XFER_QUEUE_BUFFER 5
+// Maximum number of downloaded files waiting for the success callback, per thread
+#define CALLBACK_QUEUE_FACTOR 2
+// Time to wait for the success callbacks to catch up in ms
+#define CALLBACK_QUEUE_WAIT 10
 
 /*
  * This file provides a managed download facility for parallelizing download
@@ -65,31 +70,22 @@
  * traversing a manifest, doing hash comparisons, and (re)staging any files
  * whose hash miscompares.
  *
- * file->hash[0:1] acts as index into the arrays
+ * The hashmap grows as needed, this is only its initial capacity.
  */
 #define SWUPD_CURL_HASH_BUCKETS 256
 
-/*
- * Converts a character to its hexadecimal value (0 to 15 assuming that the
- * input was from the set 0123456789abcdef).
- */
-#define HASH_VALUE(h) (h >= 'a' ? h - 'a' + 10 : h - '0')
-
-/*
- * converts two characters to a value in the range 0 to 255.
- */
-#define HASH_TO_KEY(hash) (HASH_VALUE(hash[0]) << 4 | HASH_VALUE(hash[1]))
-
 struct swupd_curl_parallel_handle {
 	int retry_delay;	     /* Retry delay */
 	size_t mcurl_size, max_xfer; /* hysteresis parameters */
 	bool resume_failed;
 	int last_retry; /* keep the largest retry number so far */
+	struct congestion_control cc; /* Adjusts max_xfer to the network */
 
 	CURLM *mcurl;			    /* Curl handle */
 	struct list *failed;		    /* List of failed downloads */
 	struct hashmap *curl_hashmap;       /* Hashmap mentioned above */
 	struct tp *thpool;		    /* Pointer to the threadpool */
+	unsigned int pending_callbacks;     /* Success callbacks not completed yet */
 	swupd_curl_success_cb success_cb;   /* Callback to success function */
 	swupd_curl_error_cb error_cb;       /* Callback to error function */
 	swupd_curl_free_cb free_cb;	 /* Callback to free user data */
@@ -109,6 +105,7 @@ struct multi_curl_file {
 	size_t hash_key;		/* hash_key of this file */
 	const char *hash;		/* Unique identifier of this file. */
 	swupd_curl_success_cb callback; /* Holds original success callback to be wrapped */
+	unsigned int *pending_callbacks; /* Counter of pending callbacks in the handle */
 
 	void *data;     /* user's data */
 	bool cb_retval; /* return value from callback */
@@ -123,6 +120,7 @@ static void success_callback_wrapper(void *data)
 {
 	struct multi_curl_file *file = data;
 	file->cb_retval = file->callback(file->data);
+	__atomic_sub_fetch(file->pending_callbacks, 1, __ATOMIC_RELAXED);
 }
 
 static bool file_hash_cmp(const void *a, const void *b)
@@ -133,7 +131,7 @@ static bool file_hash_cmp(const void *a, const void *b)
 	if (!fa->hash || !fb->hash) {
 		return strcmp(fa->file.path, fb->file.path) == 0;
 	}
-	return hash_equal(fa->hash, fb->hash);
+	return strcmp(fa->hash, fb->hash) == 0;
 }
 
 static size_t file_hash_value(const void *data)
@@ -155,7 +153,7 @@ static void free_curl_file(struct swupd_curl_parallel_handle *h, struct multi_cu
 	if (curl != NULL) {
 		/* Must remove handle out of multi queue first!*/
 		curl_multi_remove_handle(h->mcurl, curl);
-		curl_easy_cleanup(curl);
+		swupd_curl_handle_release(curl);
 		file->curl = NULL;
 	}
 
@@ -163,19 +161,91 @@ static void free_curl_file(struct swupd_curl_parallel_handle *h, struct multi_cu
 	free(file);
 }
 
+/*
+ * Each number of parallel downloads used gets its own entry in the time
+ * stats, so the time spent downloading with each one can be compared.
+ */
+static void start_parallel_downloads_timer(struct swupd_curl_parallel_handle *h)
+{
+	char *name = NULL;
+
+	string_or_die(&name, "Download with %zu parallel downloads", h->max_xfer);
+	timelist_timer_start(global_times, name);
+	free_string(&name);
+}
+
+// Apply a decision of the congestion control to the number of parallel downloads.
+// 'backoff' is true if the decision was taken because a download was retried.
+static void update_number_of_parallel_downloads(struct swupd_curl_parallel_handle *h, enum congestion_decision decision, bool backoff)
+{
+	const struct congestion_window *w = &h->cc.last;
+
+	if (w->transfers > 0) {
+		debug("Curl - Last %zu downloads: %zu errors, %.0f bytes/s, %.3fs latency (base %.3fs)\n",
+		      w->transfers, w->errors, congestion_window_throughput(w),
+		      congestion_window_latency(w), h->cc.base_latency);
+	}
+
+	if (decision == CONGESTION_KEEP) {
+		return;
+	}
+
+	if (decision == CONGESTION_DECREASE && (backoff || w->errors > 0)) {
+		info("Curl - Reducing number of parallel downloads to %zu\n", h->cc.limit);
+	} else if (decision == CONGESTION_DECREASE) {
+		// Latency changes are expected on healthy connections, so
+		// don't bother the user with them
+		debug("Curl - Reducing number of parallel downloads to %zu due to high latency\n", h->cc.limit);
+	} else {
+		debug("Curl - Increasing number of parallel downloads to %zu\n", h->cc.limit);
+	}
+	h->max_xfer = h->cc.limit;
+
+	timelist_timer_stop(global_times);
+	start_parallel_downloads_timer(h);
+}
+
 static void reevaluate_number_of_parallel_downloads(struct swupd_curl_parallel_handle *h, int retry)
 {
-	if (h->last_retry >= retry || h->max_xfer == 1) {
+	if (h->last_retry >= retry) {
 		return;
 	}
 
 	h->last_retry = retry;
 
-	// It's not expected to have any retry if the connection is good
-	// So stop downloading in parallel if the connection is bad
-	h->max_xfer = 1;
+	// It's not expected to have any retry if the connection is good, so
+	// download fewer files in parallel until the connection recovers
+	update_number_of_parallel_downloads(h, congestion_backoff(&h->cc), true);
+}
+
+/*
+ * Report the result of a download to the congestion control. Only failures
+ * that may be caused by too many downloads in parallel are counted as
+ * errors.
+ */
+static void account_download(struct swupd_curl_parallel_handle *h, CURL *handle, enum download_status status)
+{
+	curl_off_t bytes = 0;
+	double total_time = 0, start_time = 0, pretransfer_time = 0;
+	bool error;
+
+	switch (status) {
+	case DOWNLOAD_STATUS_PARTIAL_FILE:
+	case DOWNLOAD_STATUS_TIMEOUT:
+	case DOWNLOAD_STATUS_ERROR:
+		error = true;
+		break;
+	default:
+		error = false;
+		break;
+	}
+
+	curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &total_time);
+	curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME, &pretransfer_time);
+	curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &start_time);
 
-	info("Curl - Reducing number of parallel downloads to %ld\n", h->max_xfer);
+	update_number_of_parallel_downloads(h, congestion_add_transfer(&h->cc, error, bytes, total_time, start_time - pretransfer_time), false);
 }
 
 struct swupd_curl_parallel_handle *swupd_curl_parallel_download_start(size_t max_xfer)
@@ -188,9 +258,9 @@ struct swupd_curl_parallel_handle *swupd_curl_parallel_download_start(size_t max
 		goto error;
 	}
 
-	/* Libarchive is not thread safe when using the archive_disk_write api.
-	 * So for now, use only 1 thread to handle untar/extraction */
-	h->thpool = tp_start(1);
+	/* Downloaded files are extracted and verified by the success callback,
+	 * so use one thread per job to keep up with the downloads */
+	h->thpool = tp_start(get_max_jobs());
 	if (!h->thpool) {
 		h->thpool = tp_start(0);
 		if (!h->thpool) {
@@ -204,9 +274,11 @@ struct swupd_curl_parallel_handle *swupd_curl_parallel_download_start(size_t max
 
 	curl_multi_setopt(h->mcurl, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX | CURLPIPE_HTTP1);
 
+	congestion_init(&h->cc, get_min_xfer(), max_xfer);
 	h->max_xfer = max_xfer;
 	h->curl_hashmap = hashmap_new(SWUPD_CURL_HASH_BUCKETS, file_hash_cmp, file_hash_value);
 	h->retry_delay = retry_delay;
+	start_parallel_downloads_timer(h);
 
 	return h;
 error:
@@ -269,7 +341,8 @@ static int perform_curl_io_and_complete(struct swupd_curl_parallel_handle *h, in
 
 		curl_ret = curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&file);
 		if (curl_ret != CURLE_OK) {
-			curl_easy_cleanup(handle);
+			curl_multi_remove_handle(h->mcurl, handle);
+			swupd_curl_handle_release(handle);
 			continue;
 		}
 
@@ -278,12 +351,18 @@ static int perform_curl_io_and_complete(struct swupd_curl_parallel_handle *h, in
 		curl_ret = swupd_download_file_close(msg->data.result, &file->file);
 		file->status = process_curl_error_codes(curl_ret, handle);
 		debug("Curl - Complete ASYNC download: %s -> %s, status=%d\n", file->url, file->file.path, file->status);
+		account_download(h, handle, file->status);
 		if (file->status == DOWNLOAD_STATUS_COMPLETED) {
 			/* Wrap the success callback and schedule execution
 			 * Results from the callback will be stored in multi_curl_file's cb_retval
 			 * which is later checked for errors. */
 			file->callback = h->success_cb;
-			tp_task_schedule(h->thpool, (void *)success_callback_wrapper, (void *)file);
+			file->pending_callbacks = &h->pending_callbacks;
+			__atomic_add_fetch(&h->pending_callbacks, 1, __ATOMIC_RELAXED);
+			if (tp_task_schedule(h->thpool, (void *)success_callback_wrapper, (void *)file) != 0) {
+				/* cb_retval is still false, so the download will be retried */
+				__atomic_sub_fetch(&h->pending_callbacks, 1, __ATOMIC_RELAXED);
+			}
 		} else {
 			//Check if user can handle errors
 			if (!h->error_cb || h->error_cb(file->status, file->data)) {
@@ -309,7 +388,7 @@ static int perform_curl_io_and_complete(struct swupd_curl_parallel_handle *h, in
 		 * hash. */
 
 		curl_multi_remove_handle(h->mcurl, handle);
-		curl_easy_cleanup(handle);
+		swupd_curl_handle_release(handle);
 		file->curl = NULL;
 		count++;
 
@@ -425,6 +504,45 @@ static int poll_fewer_than(struct swupd_curl_parallel_handle *h, size_t xfer_que
 	return 0;
 }
 
+/*
+ * Don't start new downloads while too many downloaded files are waiting to be
+ * processed by the success callback, so files don't pile up on disk when the
+ * network is faster than the threads. Transfers already in progress keep
+ * being processed while waiting.
+ */
+static int wait_for_callbacks(struct swupd_curl_parallel_handle *h)
+{
+	CURLMcode curlm_ret;
+	int running, numfds;
+	unsigned int max_pending = CALLBACK_QUEUE_FACTOR * tp_get_num_threads(h->thpool);
+
+	if (max_pending == 0) {
+		// Callbacks are run synchronously
+		return 0;
+	}
+
+	while (__atomic_load_n(&h->pending_callbacks, __ATOMIC_RELAXED) >= max_pending) {
+		curlm_ret = curl_multi_wait(h->mcurl, NULL, 0, CALLBACK_QUEUE_WAIT, &numfds);
+		if (curlm_ret != CURLM_OK) {
+			return -1;
+		}
+		if (!numfds) {
+			usleep(CALLBACK_QUEUE_WAIT * 1000);
+		}
+
+		curlm_ret = curl_multi_perform(h->mcurl, &running);
+		if (curlm_ret != CURLM_OK) {
+			return -1;
+		}
+
+		if (perform_curl_io_and_complete(h, h->mcurl_size) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int process_download(struct swupd_curl_parallel_handle *h, struct multi_curl_file *file)
 {
 	CURL *curl = NULL;
@@ -432,7 +550,7 @@ static int process_download(struct swupd_curl_parallel_handle *h, struct multi_c
 	CURLcode curl_ret = CURLE_OK;
 	struct stat stat;
 
-	curl = curl_easy_init();
+	curl = swupd_curl_handle_get();
 	if (curl == NULL) {
 		goto out_bad;
 	}
@@ -512,6 +630,15 @@ int swupd_curl_parallel_download_enqueue(struct swupd_curl_parallel_handle *h, c
 		return -1;
 	}
 
+	// Wait before queueing the file, so it's never left in the queue without
+	// a transfer on errors
+	if (wait_for_callbacks(h) != 0) {
+		if (h->free_cb) {
+			h->free_cb(data);
+		}
+		return -1;
+	}
+
 	file = calloc(1, sizeof(struct multi_curl_file));
 	ON_NULL_ABORT(file);
 
@@ -520,7 +647,7 @@ int swupd_curl_parallel_download_enqueue(struct swupd_curl_parallel_handle *h, c
 	file->data = data;
 	if (hash) {
 		file->hash = hash;
-		file->hash_key = HASH_TO_KEY(hash);
+		file->hash_key = hashmap_hash_from_string(hash);
 	} else {
 		file->hash_key = hashmap_hash_from_string(filename);
 	}
@@ -543,8 +670,9 @@ int swupd_curl_parallel_download_enqueue(struct swupd_curl_parallel_handle *h, c
 int swupd_curl_parallel_download_end(struct swupd_curl_parallel_handle *h, int *num_downloads)
 {
 	struct multi_curl_file *file;
-	int i, downloads = 0;
+	int downloads = 0;
 	struct list *l;
+	size_t i;
 	bool retry = true;
 	int ret = 0;
 
@@ -556,14 +684,11 @@ int swupd_curl_parallel_download_end(struct swupd_curl_parallel_handle *h, int *
 	while (poll_fewer_than(h, 0, 0) == 0 && retry) {
 		retry = false;
 
-		/* Wait for all threads to complete */
-		if (tp_get_num_threads(h->thpool) > 0) {
-			tp_complete(h->thpool);
-			h->thpool = tp_start(1);
-		}
+		/* Wait for all callbacks to complete */
+		tp_wait(h->thpool);
 
 		/* Check return values from threads, add failed items to h->failed list to retry */
-		HASHMAP_FOREACH(h->curl_hashmap, i, l, file)
+		HASHMAP_FOREACH(h->curl_hashmap, i, file)
 		{
 			if (!file->cb_retval) {
 				h->failed = list_prepend_data(h->failed, file);
@@ -612,11 +737,12 @@ int swupd_curl_parallel_download_end(struct swupd_curl_parallel_handle *h, int *
 		ret = -SWUPD_COULDNT_DOWNLOAD_FILE;
 	}
 
+	timelist_timer_stop(global_times); // closing: Download with N parallel downloads
 	curl_multi_cleanup(h->mcurl);
 	tp_complete(h->thpool);
 	list_free_list(h->failed);
 
-	HASHMAP_FOREACH(h->curl_hashmap, i, l, file)
+	HASHMAP_FOREACH(h->curl_hashmap, i, file)
 	{
 		downloads++;
 		free_curl_file(h, file);
@@ -630,3 +756,122 @@ int swupd_curl_parallel_download_end(struct swupd_curl_parallel_handle *h, int *
 	}
 	return ret;
 }
+
+static CURL *start_content_size_query(CURLM *mcurl, const char *url, double *size)
+{
+	CURL *curl;
+
+	curl = swupd_curl_handle_get();
+	if (!curl) {
+		return NULL;
+	}
+
+	if (curl_easy_setopt(curl, CURLOPT_NOBODY, 1L) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)size) != CURLE_OK ||
+	    swupd_curl_set_basic_options(curl, url, true) != CURLE_OK ||
+	    curl_multi_add_handle(mcurl, curl) != CURLM_OK) {
+		swupd_curl_handle_release(curl);
+		return NULL;
+	}
+
+	return curl;
+}
+
+int swupd_curl_query_content_sizes(char **urls, double *sizes, size_t count, size_t max_xfer)
+{
+	CURLM *mcurl;
+	CURLMsg *msg;
+	CURLMcode curlm_ret = CURLM_OK;
+	CURL **handles;
+	size_t next = 0, in_flight = 0, i;
+	int running, numfds, unused;
+	int failed = 0;
+
+	if (count == 0) {
+		return 0;
+	}
+	for (i = 0; i < count; i++) {
+		sizes[i] = -1;
+	}
+	if (max_xfer == 0) {
+		max_xfer = 1;
+	}
+
+	mcurl = curl_multi_init();
+	if (!mcurl) {
+		return -1;
+	}
+	curl_multi_setopt(mcurl, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX | CURLPIPE_HTTP1);
+
+	handles = calloc(count, sizeof(CURL *));
+	ON_NULL_ABORT(handles);
+
+	while (next < count || in_flight > 0) {
+		for (; next < count && in_flight < max_xfer; next++) {
+			handles[next] = start_content_size_query(mcurl, urls[next], &sizes[next]);
+			if (handles[next]) {
+				in_flight++;
+			}
+		}
+
+		curlm_ret = curl_multi_perform(mcurl, &running);
+		if (curlm_ret != CURLM_OK) {
+			break;
+		}
+
+		while ((msg = curl_multi_info_read(mcurl, &unused))) {
+			CURL *curl = msg->easy_handle;
+			curl_off_t content_size;
+			double *size;
+
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			if (curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&size) != CURLE_OK) {
+				curlm_ret = CURLM_INTERNAL_ERROR;
+				goto out;
+			}
+
+			if (msg->data.result == CURLE_OK &&
+			    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_size) == CURLE_OK &&
+			    content_size >= 0) {
+				*size = content_size;
+			}
+
+			curl_multi_remove_handle(mcurl, curl);
+			swupd_curl_handle_release(curl);
+			handles[size - sizes] = NULL;
+			in_flight--;
+		}
+
+		if (in_flight > 0) {
+			curlm_ret = curl_multi_wait(mcurl, NULL, 0, CURL_MULTI_TIMEOUT, &numfds);
+			if (curlm_ret != CURLM_OK) {
+				break;
+			}
+		}
+	}
+
+out:
+	// Requests still running after errors
+	for (i = 0; i < next; i++) {
+		if (handles[i]) {
+			curl_multi_remove_handle(mcurl, handles[i]);
+			swupd_curl_handle_release(handles[i]);
+		}
+	}
+	free(handles);
+	curl_multi_cleanup(mcurl);
+	if (curlm_ret != CURLM_OK) {
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (sizes[i] < 0) {
+			failed++;
+		}
+	}
+
+	return failed;
+}
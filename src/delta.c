@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,10 +36,12 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "lib/hashmap.h"
+#include "lib/thread_pool.h"
 #include "swupd.h"
 #include "xattrs.h"
 
-static bool compute_hash_from_file(char *filename, char *hash)
+static bool compute_hash_from_file(char *filename, union swupd_hash *hash)
 {
 	/* TODO: implement this without the indirection of creating a file... */
 	struct file f = { 0 };
@@ -51,11 +54,11 @@ static bool compute_hash_from_file(char *filename, char *hash)
 		return false;
 	}
 
-	hash_assign(&f.hash[0], hash);
+	hash_assign(&f.hash, hash);
 	return true;
 }
 
-static void apply_one_delta(char *from_file, char *to_staged, char *delta_file, char *to_hash)
+static void apply_one_delta(char *from_file, char *to_staged, char *delta_file, const union swupd_hash *to_hash)
 {
 	int ret = apply_bsdiff_delta(from_file, to_staged, delta_file);
 	if (ret) {
@@ -64,13 +67,13 @@ static void apply_one_delta(char *from_file, char *to_staged, char *delta_file,
 
 	xattrs_copy(from_file, to_staged);
 
-	char hash[SWUPD_HASH_LEN];
-	if (!compute_hash_from_file(to_staged, &hash[0])) {
+	union swupd_hash hash;
+	if (!compute_hash_from_file(to_staged, &hash)) {
 		warn("Couldn't use delta file %s: hash calculation failed\n", delta_file);
 		(void)remove(to_staged);
 		return;
 	}
-	if (!hash_equal(hash, to_hash)) {
+	if (!hash_equal(&hash, to_hash)) {
 		warn("Couldn't use delta file %s: application resulted in wrong hash\n", delta_file);
 		(void)remove(to_staged);
 	}
@@ -78,7 +81,7 @@ static void apply_one_delta(char *from_file, char *to_staged, char *delta_file,
 
 /* Check if the delta filename is well-formed, if so return true and fill the from/to
  * buffers with the corresponding hashes. Return false otherwise. */
-static bool check_delta_filename(const char *delta_name, char *from, char *to)
+static bool check_delta_filename(const char *delta_name, union swupd_hash *from, union swupd_hash *to)
 {
 	/* Delta files have the form [FROM_VERSION]-[TO_VERSION]-[FROM_HASH]-[TO_HASH]. */
 	const char *s = delta_name;
@@ -102,102 +105,346 @@ static bool check_delta_filename(const char *delta_name, char *from, char *to)
 		return false;
 	}
 
-	hash_assign(s, from);
+	if (!hash_from_hex(s, from)) {
+		return false;
+	}
 
 	/* Consume the first hash and the separator. */
 	s += hash_len + 1;
 
-	hash_assign(s, to);
+	return hash_from_hex(s, to);
+}
 
-	return true;
+/*
+ * All files in the current manifest that share the same hash, so the 'from'
+ * file of any delta is found with a single lookup. The on-disk verification
+ * of the candidates is done at most once and the result is shared by all
+ * deltas using this hash.
+ */
+struct delta_from {
+	union swupd_hash hash;
+	struct list *files;
+	pthread_mutex_t lock;
+	bool verified;
+	bool bad_on_sys;
+	char *found;
+};
+
+/* One delta file found in state_dir/delta to be applied */
+struct delta_job {
+	char *delta_file;
+	char *to_staged;
+	union swupd_hash to;
+	struct delta_from *from;
+	struct delta_job *next; /* Next delta to try for the same 'to' file */
+};
+
+static bool delta_from_equal(const void *a, const void *b)
+{
+	return hash_equal(&((const struct delta_from *)a)->hash, &((const struct delta_from *)b)->hash);
+}
+
+static size_t delta_from_hash(const void *data)
+{
+	return hash_prefix(&((const struct delta_from *)data)->hash);
+}
+
+static void delta_from_free(void *data)
+{
+	struct delta_from *from = data;
+
+	list_free_list(from->files);
+	pthread_mutex_destroy(&from->lock);
+	free_string(&from->found);
+	free(from);
+}
+
+static bool delta_job_equal(const void *a, const void *b)
+{
+	return hash_equal(&((const struct delta_job *)a)->to, &((const struct delta_job *)b)->to);
+}
+
+static size_t delta_job_hash(const void *data)
+{
+	return hash_prefix(&((const struct delta_job *)data)->to);
+}
+
+static struct hashmap *build_from_index(struct manifest *current_manifest)
+{
+	struct hashmap *index;
+	struct list *ll;
+
+	index = hashmap_new(list_len(current_manifest->files), delta_from_equal, delta_from_hash);
+	ON_NULL_ABORT(index);
+
+	for (ll = list_head(current_manifest->files); ll; ll = ll->next) {
+		struct file *file = ll->data;
+		struct delta_from key = { 0 };
+		struct delta_from *from;
+
+		if (file->is_deleted || file->is_ghosted || !file->is_file) {
+			continue;
+		}
+
+		hash_assign(&file->hash, &key.hash);
+		from = hashmap_get(index, &key);
+		if (!from) {
+			from = calloc(1, sizeof(struct delta_from));
+			ON_NULL_ABORT(from);
+			hash_assign(&file->hash, &from->hash);
+			pthread_mutex_init(&from->lock, NULL);
+			hashmap_put(index, from);
+		}
+		from->files = list_prepend_data(from->files, file);
+	}
+
+	return index;
+}
+
+/* Return the path of a file in the system matching the 'from' hash, or NULL */
+static const char *find_from_file(struct delta_from *from)
+{
+	struct list *ll;
+
+	pthread_mutex_lock(&from->lock);
+	if (from->verified) {
+		goto out;
+	}
+	from->verified = true;
+
+	for (ll = list_head(from->files); ll && !from->found; ll = ll->next) {
+		struct file *file = ll->data;
+		char *filename;
+
+		/* Verify the actual file in the disk matches our expectations. */
+		filename = mk_full_filename(path_prefix, file->filename);
+		if (!verify_file(file, filename)) {
+			free_string(&filename);
+			from->bad_on_sys = true;
+			continue;
+		}
+
+		from->found = filename;
+	}
+
+out:
+	pthread_mutex_unlock(&from->lock);
+	return from->found;
+}
+
+static void delta_job_try(struct delta_job *job, char *to_staged)
+{
+	const char *found = NULL;
+
+	if (job->from) {
+		found = find_from_file(job->from);
+	}
+
+	if (!found) {
+		if (job->from && job->from->bad_on_sys) {
+			warn("Couldn't use delta file %s: 'from' file corrupted on system, consider running 'swupd verify --fix'\n", job->delta_file);
+		} else {
+			warn("Couldn't use delta file %s: no 'from' file to apply was found\n", job->delta_file);
+		}
+		return;
+	}
+
+	apply_one_delta((char *)found, to_staged, job->delta_file, &job->to);
+}
+
+/* Try all deltas producing the same file, in order, until one works */
+static void delta_job_run(void *data)
+{
+	struct delta_job *first = data;
+	struct delta_job *job;
+	struct stat st;
+
+	for (job = first; job; job = job->next) {
+		delta_job_try(job, first->to_staged);
+		if (lstat(first->to_staged, &st) == 0) {
+			return;
+		}
+	}
+}
+
+/*
+ * bsdiff keeps the old file, the new file and the delta in memory while
+ * applying a delta, so limit the number of deltas applied at the same time
+ * to what fits in half of the available memory.
+ */
+static int get_delta_jobs(struct delta_job *jobs, size_t count)
+{
+	long mem = get_available_memory();
+	long max_size = 0;
+	long limit;
+	size_t i;
+	int num_jobs = get_max_jobs();
+
+	if (mem < 0) {
+		return num_jobs;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct file *file;
+		struct stat st;
+		char *filename;
+		long size = 0;
+
+		if (!jobs[i].to_staged) {
+			continue;
+		}
+		if (stat(jobs[i].delta_file, &st) == 0) {
+			size += st.st_size;
+		}
+
+		/* The new file is usually about the size of the old one */
+		file = jobs[i].from->files->data;
+		filename = mk_full_filename(path_prefix, file->filename);
+		if (stat(filename, &st) == 0) {
+			size += 2 * st.st_size;
+		}
+		free_string(&filename);
+
+		if (size > max_size) {
+			max_size = size;
+		}
+	}
+
+	if (max_size == 0) {
+		return num_jobs;
+	}
+
+	limit = (mem / 2) / max_size;
+	if (limit < 1) {
+		return 1;
+	}
+	if (limit < num_jobs) {
+		return limit;
+	}
+
+	return num_jobs;
 }
 
 void apply_deltas(struct manifest *current_manifest)
 {
 	char *delta_dir;
+	struct hashmap *index;
+	struct hashmap *queued;
+	struct delta_job *jobs = NULL;
+	size_t count = 0, alloc = 0, i;
+	struct tp *tp;
+	int num_jobs;
+
 	string_or_die(&delta_dir, "%s/delta", state_dir);
 
 	DIR *dir = opendir(delta_dir);
 	if (!dir) {
 		/* No deltas available to apply. */
+		free_string(&delta_dir);
 		return;
 	}
 
+	index = build_from_index(current_manifest);
+
 	struct dirent *ent;
 	while ((ent = readdir(dir))) {
 		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
 			continue;
 		}
 
-		char *to_staged = NULL;
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			jobs = realloc(jobs, alloc * sizeof(struct delta_job));
+			ON_NULL_ABORT(jobs);
+		}
 
+		struct delta_job *job = &jobs[count++];
+		struct delta_from key = { 0 };
 		char *delta_name = ent->d_name;
-		char *delta_file;
-		string_or_die(&delta_file, "%s/%s", delta_dir, delta_name);
 
-		char from[SWUPD_HASH_LEN] = { 0 };
-		char to[SWUPD_HASH_LEN] = { 0 };
-		if (!check_delta_filename(delta_name, &from[0], &to[0])) {
-			warn("Invalid name for delta file: %s\n", delta_file);
-			goto next;
+		memset(job, 0, sizeof(*job));
+		string_or_die(&job->delta_file, "%s/%s", delta_dir, delta_name);
+
+		if (!check_delta_filename(delta_name, &key.hash, &job->to)) {
+			warn("Invalid name for delta file: %s\n", job->delta_file);
+			continue;
 		}
 
-		string_or_die(&to_staged, "%s/staged/%s", state_dir, to);
+		char to_hex[SWUPD_HASH_LEN];
+		hash_to_hex(&job->to, to_hex);
+		string_or_die(&job->to_staged, "%s/staged/%s", state_dir, to_hex);
 
 		/* If 'to' file already exists, no need to apply delta. */
 		struct stat stat;
-		if (lstat(to_staged, &stat) == 0) {
-			goto next;
+		if (lstat(job->to_staged, &stat) == 0) {
+			free_string(&job->to_staged);
+			continue;
 		}
 
-		/* TODO: Sort the list of files by hash then walk it
-		 * in parallel with the (sorted) results of readdir. */
-
-		struct list *ll = list_head(current_manifest->files);
-		char *found = NULL;
-		bool bad_on_sys = false;
-
-		for (; ll && !found; ll = ll->next) {
-			struct file *file = ll->data;
-			if (file->is_deleted || file->is_ghosted || !file->is_file || !hash_equal(file->hash, from)) {
-				continue;
-			}
+		job->from = hashmap_get(index, &key);
+		if (!job->from) {
+			warn("Couldn't use delta file %s: no 'from' file to apply was found\n", job->delta_file);
+			free_string(&job->to_staged);
+			continue;
+		}
+	}
+	closedir(dir);
 
-			/* Verify the actual file in the disk matches our expectations. */
-			char hash[SWUPD_HASH_LEN];
-			char *filename;
-			string_or_die(&filename, "%s/%s", path_prefix, file->filename);
+	/* Deltas from different versions may produce the same file and can't be
+	 * applied at the same time, so they are chained in a single job that
+	 * tries them in order until one of them works */
+	queued = hashmap_new(count, delta_job_equal, delta_job_hash);
+	ON_NULL_ABORT(queued);
+	for (i = 0; i < count; i++) {
+		struct delta_job *job = &jobs[i];
+		struct delta_job *first;
 
-			if (!compute_hash_from_file(filename, hash) || !hash_equal(file->hash, hash)) {
-				free_string(&filename);
-				bad_on_sys = true;
-				continue;
-			}
+		if (!job->to_staged) {
+			continue;
+		}
 
-			found = filename;
+		first = hashmap_get(queued, job);
+		if (!first) {
+			hashmap_put(queued, job);
+			continue;
 		}
 
-		if (!found) {
-			warn("Couldn't use delta file %s: ", delta_file);
-			if (bad_on_sys) {
-				info("'from' file corrupted on system, consider running 'swupd verify --fix'\n");
-			} else {
-				info("no 'from' file to apply was found\n");
-			}
-			goto next;
+		while (first->next) {
+			first = first->next;
 		}
+		first->next = job;
+		free_string(&job->to_staged);
+	}
+	hashmap_free(queued);
+
+	num_jobs = get_delta_jobs(jobs, count);
+	tp = tp_start(num_jobs > 1 ? num_jobs : 0);
+	if (!tp) {
+		warn("Unable to create a thread pool - applying deltas synchronously\n");
+		tp = tp_start(0);
+		ON_NULL_ABORT(tp);
+	}
 
-		apply_one_delta(found, to_staged, delta_file, to);
-		free_string(&found);
+	for (i = 0; i < count; i++) {
+		if (!jobs[i].to_staged) {
+			continue;
+		}
+		if (tp_task_schedule(tp, delta_job_run, &jobs[i]) != 0) {
+			/* Not able to use the thread pool, so do it ourselves */
+			delta_job_run(&jobs[i]);
+		}
+	}
+	tp_complete(tp);
 
-	next:
+	for (i = 0; i < count; i++) {
 		/* Always remove delta files. Once applied the full staged file will be
 		 * available, so no need to keep the delta around. */
-		swupd_rm(delta_file);
-		free_string(&delta_file);
-		free_string(&to_staged);
+		swupd_rm(jobs[i].delta_file);
+		free_string(&jobs[i].delta_file);
+		free_string(&jobs[i].to_staged);
 	}
 
-	closedir(dir);
+	free(jobs);
+	hashmap_free_hash_and_data(index, delta_from_free);
 	free_string(&delta_dir);
 }
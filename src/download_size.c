@@ -0,0 +1,296 @@
+/*
+ *   Software Updater - client side
+ *
+ *      Copyright © 2019 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "download_size.h"
+#include "lib/hashmap.h"
+#include "swupd.h"
+
+/*
+ * Content in the server never changes for a version, so the size of each file
+ * queried from the server is saved in a size index in the state directory.
+ * The index is a text file with one "<size>\t<version>/<name>" line per file,
+ * where new sizes are appended.
+ */
+
+// Maximum number of size queries sent at the same time
+#define SIZE_QUERY_MAX_XFER 15
+
+struct download_file {
+	int version;
+	char *name;
+	size_t hash_key;
+	uint64_t estimate;
+	double size; /* -1 if unknown */
+	bool from_server;
+};
+
+struct download_size {
+	struct download_file *files;
+	size_t len;
+	size_t capacity;
+};
+
+static size_t file_hash_key(int version, const char *name)
+{
+	return hashmap_hash_from_string(name) ^ (size_t)version;
+}
+
+struct download_size *download_size_new(void)
+{
+	struct download_size *ds = calloc(1, sizeof(struct download_size));
+	ON_NULL_ABORT(ds);
+
+	return ds;
+}
+
+void download_size_add(struct download_size *ds, int version, const char *name, uint64_t estimate)
+{
+	struct download_file *file;
+
+	if (ds->len == ds->capacity) {
+		ds->capacity = ds->capacity ? ds->capacity * 2 : 64;
+		ds->files = realloc(ds->files, ds->capacity * sizeof(struct download_file));
+		ON_NULL_ABORT(ds->files);
+	}
+
+	file = &ds->files[ds->len++];
+	file->version = version;
+	file->name = strdup_or_die(name);
+	file->hash_key = file_hash_key(version, name);
+	file->estimate = estimate;
+	file->size = -1;
+	file->from_server = false;
+}
+
+void download_size_free(struct download_size *ds)
+{
+	size_t i;
+
+	if (!ds) {
+		return;
+	}
+
+	for (i = 0; i < ds->len; i++) {
+		free_string(&ds->files[i].name);
+	}
+	free(ds->files);
+	free(ds);
+}
+
+static bool file_equal(const void *a, const void *b)
+{
+	const struct download_file *fa = a;
+	const struct download_file *fb = b;
+
+	return fa->version == fb->version && strcmp(fa->name, fb->name) == 0;
+}
+
+static size_t file_hash(const void *data)
+{
+	return ((struct download_file *)data)->hash_key;
+}
+
+static char *get_index_filename(void)
+{
+	char *filename = NULL;
+
+	string_or_die(&filename, "%s/%s", state_dir, DOWNLOAD_SIZES_FILENAME);
+	return filename;
+}
+
+// Fill the size of the files with the sizes in the index
+static void load_index(struct download_size *ds)
+{
+	struct hashmap *files;
+	struct download_file key = { 0 };
+	struct download_file *file;
+	char *filename;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+	FILE *f;
+	size_t i;
+
+	filename = get_index_filename();
+	f = fopen(filename, "r");
+	free_string(&filename);
+	if (!f) {
+		return;
+	}
+
+	files = hashmap_new(ds->len, file_equal, file_hash);
+	for (i = 0; i < ds->len; i++) {
+		hashmap_put(files, &ds->files[i]);
+	}
+
+	while ((line_len = getline(&line, &line_size, f)) > 0) {
+		char *version, *name;
+		long long size;
+
+		if (line[line_len - 1] == '\n') {
+			line[line_len - 1] = '\0';
+		}
+
+		size = strtoll(line, &version, 10);
+		if (*version != '\t' || size < 0) {
+			continue;
+		}
+
+		key.version = strtol(version + 1, &name, 10);
+		if (*name != '/') {
+			continue;
+		}
+
+		key.name = name + 1;
+		key.hash_key = file_hash_key(key.version, key.name);
+		file = hashmap_get(files, &key);
+		if (file) {
+			file->size = size;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	hashmap_free(files);
+}
+
+// Append sizes of the files found in the server to the index
+static void save_index(struct download_size *ds)
+{
+	struct download_file *files = ds->files;
+	size_t len = ds->len;
+	char *filename;
+	FILE *f;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (files[i].from_server) {
+			break;
+		}
+	}
+	if (i == len) {
+		return;
+	}
+
+	filename = get_index_filename();
+	f = fopen(filename, "a");
+	if (!f) {
+		debug("Unable to save download sizes to %s\n", filename);
+		free_string(&filename);
+		return;
+	}
+
+	for (; i < len; i++) {
+		if (files[i].from_server) {
+			fprintf(f, "%" PRIu64 "\t%i/%s\n", (uint64_t)files[i].size, files[i].version, files[i].name);
+		}
+	}
+
+	if (fclose(f) != 0) {
+		debug("Unable to save download sizes to %s\n", filename);
+	}
+	free_string(&filename);
+}
+
+// Query the server for the size of the files not in the index
+static void query_missing_sizes(struct download_size *ds)
+{
+	struct download_file **missing;
+	char **urls;
+	double *sizes;
+	size_t i, len = 0;
+
+	missing = malloc(ds->len * sizeof(struct download_file *));
+	ON_NULL_ABORT(missing);
+
+	for (i = 0; i < ds->len; i++) {
+		if (ds->files[i].size < 0) {
+			missing[len++] = &ds->files[i];
+		}
+	}
+
+	if (len == 0) {
+		free(missing);
+		return;
+	}
+
+	urls = malloc(len * sizeof(char *));
+	ON_NULL_ABORT(urls);
+	sizes = malloc(len * sizeof(double));
+	ON_NULL_ABORT(sizes);
+
+	for (i = 0; i < len; i++) {
+		urls[i] = NULL;
+		string_or_die(&urls[i], "%s/%i/%s", content_url, missing[i]->version, missing[i]->name);
+	}
+
+	debug("Querying the size of %zu files from the server\n", len);
+	if (swupd_curl_query_content_sizes(urls, sizes, len, get_max_xfer(SIZE_QUERY_MAX_XFER)) >= 0) {
+		for (i = 0; i < len; i++) {
+			if (sizes[i] >= 0) {
+				missing[i]->size = sizes[i];
+				missing[i]->from_server = true;
+			}
+		}
+	}
+
+	for (i = 0; i < len; i++) {
+		free_string(&urls[i]);
+	}
+	free(urls);
+	free(sizes);
+	free(missing);
+}
+
+double download_size_total(struct download_size *ds)
+{
+	double total = 0;
+	size_t i;
+
+	if (ds->len == 0) {
+		return 0;
+	}
+
+	load_index(ds);
+	query_missing_sizes(ds);
+	save_index(ds);
+
+	for (i = 0; i < ds->len; i++) {
+		struct download_file *file = &ds->files[i];
+
+		if (file->size < 0) {
+			if (file->estimate == 0) {
+				debug("The size of %i/%s could not be found\n", file->version, file->name);
+				return -1;
+			}
+
+			debug("Using estimated size for %i/%s\n", file->version, file->name);
+			file->size = file->estimate;
+		}
+		total += file->size;
+	}
+
+	return total;
+}
@@ -0,0 +1,59 @@
+#ifndef __INCLUDE_GUARD_DOWNLOAD_SIZE_H
+#define __INCLUDE_GUARD_DOWNLOAD_SIZE_H
+
+/**
+ * @file
+ * @brief Estimate the size of a set of files to be downloaded.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Name of the size index file, saved in the state directory. */
+#define DOWNLOAD_SIZES_FILENAME "download.sizes"
+
+/** @brief Set of files created with download_size_new(). */
+struct download_size;
+
+/**
+ * @brief Create a new set of files to get the download size of.
+ * @note Free it with download_size_free()
+ */
+struct download_size *download_size_new(void);
+
+/**
+ * @brief Add a file to the set.
+ *
+ * @param version The version of the file in the content url
+ * @param name Name of the file, relative to the version directory in the
+ * content url, like "files/<hash>.tar"
+ * @param estimate Size used if the real size can't be found, or 0 if there's
+ * no estimate for this file
+ */
+void download_size_add(struct download_size *ds, int version, const char *name, uint64_t estimate);
+
+/**
+ * @brief Get the size of all files in the set, in bytes.
+ *
+ * Sizes are taken from the size index saved in the state directory. Sizes
+ * not in the index are queried from the server, with concurrent requests,
+ * and saved in the index for next time. The estimate is used for files whose
+ * size couldn't be queried.
+ *
+ * @returns The total size or -1 if the size of any file couldn't be found.
+ */
+double download_size_total(struct download_size *ds);
+
+/**
+ * @brief Free the set of files.
+ */
+void download_size_free(struct download_size *ds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
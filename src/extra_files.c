@@ -30,57 +30,258 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "lib/thread_pool.h"
 #include "signature.h"
 #include "swupd.h"
 
-static struct filerecord *F; /* Array of filerecords */
-static int nF = 0;	   /* Number of filerecords */
+/* Record returned by getdents64, not exposed by all C libraries */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
 
-static const regex_t *path_whitelist;
-static int path_prefix_len;
+#define DENTS_BUF_SIZE (64 * 1024)
 
-/* Helper function to call from nftw */
-static inline int bsearch_helper(const void *A, const void *B)
+/* The tree walk, done by a thread pool with one task per directory */
+struct walk {
+	struct tp *tp;
+	const regex_t *whitelist;
+	size_t path_prefix_len;
+	dev_t dev;		/* only the file system of the start is walked */
+	struct walk_dir *done; /* directories already read */
+};
+
+/* A directory and the files found in it, kept by the task reading the
+ * directory so no locking is needed */
+struct walk_dir {
+	struct walk *walk;
+	char *path;
+	struct filerecord *record; /* record of this directory in its parent */
+	struct filerecord *entries;
+	int len;
+	int size;
+	struct walk_dir *next;
+};
+
+static struct walk_dir *walk_dir_new(struct walk *walk, char *path, struct filerecord *record)
 {
-	return strcmp(*(const char **)A, ((struct filerecord *)B)->filename);
+	struct walk_dir *dir = calloc(1, sizeof(struct walk_dir));
+
+	ON_NULL_ABORT(dir);
+	dir->walk = walk;
+	dir->path = path;
+	dir->record = record;
+
+	return dir;
 }
 
-static int record_filename(const char *name, const struct stat *stat __attribute__((unused)), int type, struct FTW *ftw __attribute__((unused)))
+static void walk_dir_add(struct walk_dir *dir, const char *relname, bool is_dir)
 {
-	/* Name as it would appear in manifest, f.i. /usr */
-	const char *relname = name + path_prefix_len - 1;
+	if (dir->len == dir->size) {
+		dir->size = dir->size ? dir->size * 2 : 32;
+		dir->entries = realloc(dir->entries, dir->size * sizeof(struct filerecord));
+		ON_NULL_ABORT(dir->entries);
+	}
 
-	if (!relname[0] || !strcmp(relname, "/")) {
-		/* Do not record root while descending into it. */
-		return 0;
+	/* Only store name relative to top of area */
+	dir->entries[dir->len].filename = strdup_or_die(relname);
+	dir->entries[dir->len].dir = is_dir;
+	dir->entries[dir->len].in_manifest = false; /* Because we do yet know */
+	dir->len++;
+}
+
+static bool is_whitelisted(struct walk *walk, const char *relname)
+{
+	/* ignore matching entry and everything underneath it */
+	return walk->whitelist && regexec(walk->whitelist, relname, 0, NULL, 0) == 0;
+}
+
+static void walk_dir_run(void *data);
+
+static void walk_dir_schedule(struct walk *walk, char *path, struct filerecord *record)
+{
+	struct walk_dir *dir = walk_dir_new(walk, path, record);
+
+	if (tp_task_schedule(walk->tp, walk_dir_run, dir) != 0) {
+		/* Not able to use the thread pool, so do it ourselves */
+		walk_dir_run(dir);
+	}
+}
+
+/* Read the entries of one directory, with the same results nftw() gives
+ * with FTW_PHYS | FTW_MOUNT, and schedule the walk of its subdirectories */
+static void walk_dir_run(void *data)
+{
+	struct walk_dir *dir = data;
+	struct walk *walk = dir->walk;
+	struct linux_dirent64 *dent;
+	char *buf, *path;
+	size_t base_len;
+	int *subdirs = NULL;
+	int subdirs_len = 0;
+	long n, pos;
+	int fd, i;
+
+	fd = openat(AT_FDCWD, dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		/* nftw() reports directories that can't be read as FTW_DNR */
+		if (dir->record) {
+			dir->record->dir = false;
+		}
+		goto done;
+	}
+
+	buf = malloc(DENTS_BUF_SIZE);
+	ON_NULL_ABORT(buf);
+
+	base_len = strlen(dir->path);
+	if (base_len > 0 && dir->path[base_len - 1] == '/') {
+		base_len--;
+	}
+	path = malloc(base_len + NAME_MAX + 2);
+	ON_NULL_ABORT(path);
+	memcpy(path, dir->path, base_len);
+	path[base_len] = '/';
+
+	while ((n = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SIZE)) > 0) {
+		for (pos = 0; pos < n; pos += dent->d_reclen) {
+			const char *relname;
+			struct stat st;
+			bool is_dir = false;
+
+			dent = (struct linux_dirent64 *)(buf + pos);
+			if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+				continue;
+			}
+
+			strcpy(path + base_len + 1, dent->d_name);
+			relname = path + walk->path_prefix_len - 1;
+			if (is_whitelisted(walk, relname)) {
+				continue;
+			}
+
+			/* Entries that can't be stat'ed are still reported,
+			 * as FTW_NS */
+			if (fstatat(fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+				if (st.st_dev != walk->dev) {
+					continue;
+				}
+				is_dir = S_ISDIR(st.st_mode);
+			}
+
+			if (is_dir) {
+				if (subdirs_len % 32 == 0) {
+					subdirs = realloc(subdirs, (subdirs_len + 32) * sizeof(int));
+					ON_NULL_ABORT(subdirs);
+				}
+				subdirs[subdirs_len++] = dir->len;
+			}
+			walk_dir_add(dir, relname, is_dir);
+		}
+	}
+	close(fd);
+
+	/* Entries don't move anymore, so subdirectories can update their
+	 * records */
+	for (i = 0; i < subdirs_len; i++) {
+		struct filerecord *record = &dir->entries[subdirs[i]];
+		char *subdir_path;
+
+		string_or_die(&subdir_path, "%.*s%s", (int)(walk->path_prefix_len - 1), path, record->filename);
+		walk_dir_schedule(walk, subdir_path, record);
+	}
+
+	free(subdirs);
+	free(path);
+	free(buf);
+
+done:
+	dir->next = __atomic_load_n(&walk->done, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&walk->done, &dir->next, dir, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
 	}
+}
+
+/* Walk the tree under start, returning all entries found in *files */
+static int walk_files(const char *start, const regex_t *whitelist, struct filerecord **files, int *files_len)
+{
+	struct walk walk = { 0 };
+	struct walk_dir *root, *dir, *next;
+	const char *relname;
+	struct stat st;
+	char *root_path;
+	size_t len;
+	int count = 0;
 
-	if (path_whitelist) {
-		int match_res;
-		match_res = regexec(path_whitelist, relname, 0, NULL, 0);
-		if (match_res == 0) {
-			/* ignore matching entry and everything underneath it */
-			return FTW_SKIP_SUBTREE;
+	walk.whitelist = whitelist;
+	walk.path_prefix_len = strlen(path_prefix);
+
+	/* Like nftw(), ignore trailing slashes of start */
+	root_path = strdup_or_die(start);
+	len = strlen(root_path);
+	while (len > 1 && root_path[len - 1] == '/') {
+		root_path[--len] = '\0';
+	}
+
+	/* Start is the root of the walk */
+	root = walk_dir_new(&walk, root_path, NULL);
+	relname = root_path + walk.path_prefix_len - 1;
+	if (len < walk.path_prefix_len - 1 || lstat(root_path, &st) != 0) {
+		free(root_path);
+		free(root);
+		return -1;
+	}
+
+	walk.dev = st.st_dev;
+	walk.done = root;
+	if (!is_whitelisted(&walk, relname)) {
+		/* Do not record root while descending into it. */
+		if (relname[0] && strcmp(relname, "/") != 0) {
+			walk_dir_add(root, relname, S_ISDIR(st.st_mode));
 		}
+
+		if (S_ISDIR(st.st_mode)) {
+			walk.tp = tp_start(get_max_jobs());
+			if (!walk.tp) {
+				warn("Unable to create a thread pool - walking the tree synchronously\n");
+				walk.tp = tp_start(0);
+				ON_NULL_ABORT(walk.tp);
+			}
+			walk_dir_schedule(&walk, strdup_or_die(root_path), root->len ? &root->entries[0] : NULL);
+			tp_complete(walk.tp);
+		}
+	}
+
+	for (dir = walk.done; dir; dir = dir->next) {
+		count += dir->len;
 	}
 
-	char *savedname = strdup_or_die(relname); /* Only store name relative to top of area */
-	F = realloc(F, (nF + 1) * sizeof(*F));    /* TODO, check realloc is smart, so don't need to double myself */
-	ON_NULL_ABORT(F);
+	*files = malloc((count + 1) * sizeof(struct filerecord));
+	ON_NULL_ABORT(*files);
+	*files_len = 0;
+	for (dir = walk.done; dir; dir = next) {
+		next = dir->next;
+		if (dir->len > 0) {
+			memcpy(*files + *files_len, dir->entries, dir->len * sizeof(struct filerecord));
+			*files_len += dir->len;
+		}
+		free(dir->entries);
+		free(dir->path);
+		free(dir);
+	}
 
-	F[nF].filename = savedname;
-	F[nF].dir = (type == FTW_D);
-	F[nF].in_manifest = false; /* Because we do yet know */
-	nF++;
 	return 0;
 }
 
@@ -114,41 +315,73 @@ static bool handle(const char *filename, bool is_dir, bool fix)
 	return ret;
 }
 
+static int file_ptr_sort_filename(const void *a, const void *b)
+{
+	return strcmp((*(struct file *const *)a)->filename, (*(struct file *const *)b)->filename);
+}
+
 /* expect the start to end in /usr and be the absolute path to the root */
 enum swupd_code walk_tree(struct manifest *manifest, const char *start, bool fix, const regex_t *whitelist, struct file_counts *counts)
 {
-	/* Walk the tree, */
+	struct filerecord *F = NULL; /* Array of filerecords */
+	int nF = 0;		     /* Number of filerecords */
+	struct file **files;
+	size_t files_len, j;
 	int rc;
 	int ret;
-	path_prefix_len = strlen(path_prefix);
-	path_whitelist = whitelist;
-	rc = nftw(start, &record_filename, 0, FTW_ACTIONRETVAL | FTW_PHYS | FTW_MOUNT);
+	int k;
+
+	/* Walk the tree, */
+	rc = walk_files(start, whitelist, &F, &nF);
 	const char *skip_dir = NULL; /* Skip files below this in printout */
 	if (rc) {
 		rc = SWUPD_OUT_OF_MEMORY_ERROR;
 		goto tidy; /* Already printed out of memory */
 	}
 	qsort(F, nF, sizeof(*F), &qsort_helper);
-	/* Interesting question, would it be faster to sort this linked list,
-	 * or convert it to an array of pointers, or just pull them off one
-	 * at a time? Try one at a time first.
-	 */
-	struct list *iter = list_head(manifest->files);
-	while (iter) {
-		struct file *file;
-		struct filerecord *found;
-
-		file = iter->data;
-		iter = iter->next;
+
+	/* Both lists sorted by name, so they can be merged in one pass */
+	if (manifest->files_by_name) {
+		files = manifest->files_by_name;
+		files_len = manifest->files_by_name_len;
+	} else {
+		struct list *iter;
+
+		files = malloc((list_len(manifest->files) + 1) * sizeof(struct file *));
+		ON_NULL_ABORT(files);
+		files_len = 0;
+		for (iter = list_head(manifest->files); iter; iter = iter->next) {
+			files[files_len++] = iter->data;
+		}
+		qsort(files, files_len, sizeof(struct file *), file_ptr_sort_filename);
+	}
+
+	k = 0;
+	j = 0;
+	while (k < nF && j < files_len) {
+		struct file *file = files[j];
+		int cmp;
 
 		if (file->is_deleted && !file->is_ghosted) {
+			j++;
 			continue;
 		}
-		found = bsearch(&file->filename, F, nF, sizeof(*F), &bsearch_helper);
-		if (found) {
-			found->in_manifest = true;
+
+		cmp = strcmp(F[k].filename, file->filename);
+		if (cmp < 0) {
+			k++;
+		} else if (cmp > 0) {
+			j++;
+		} else {
+			F[k].in_manifest = true;
+			k++;
 		}
 	}
+
+	if (files != manifest->files_by_name) {
+		free(files);
+	}
+
 	/* list files/directories which are extra.
 	 * This is reverse so that files are removed before their parent dirs */
 	for (int i = nF - 1; i >= 0; i--) {
@@ -24,22 +24,71 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "download_size.h"
+#include "lib/hashmap.h"
 #include "swupd.h"
 
 /* hysteresis thresholds */
 //FIXME #562
 #define MAX_XFER 15
 
-static void download_mix_file(struct file *file)
+/*
+ * A fullfile to be downloaded and extracted. All files in the update sharing
+ * the same hash use the same fullfile, and when prestaging they are all
+ * prestaged as soon as it's extracted.
+ */
+struct fullfile_download {
+	struct file *file;
+	struct list *targets;
+	char hash[SWUPD_HASH_LEN];
+};
+
+static bool fullfile_download_equal(const void *a, const void *b)
+{
+	return hash_equal(&((const struct fullfile_download *)a)->file->hash,
+			  &((const struct fullfile_download *)b)->file->hash);
+}
+
+static size_t fullfile_download_hash(const void *data)
+{
+	return hash_prefix(&((const struct fullfile_download *)data)->file->hash);
+}
+
+static void fullfile_download_free(void *data)
+{
+	struct fullfile_download *download = data;
+
+	list_free_list(download->targets);
+	free(download);
+}
+
+static bool extract_and_prestage(struct fullfile_download *download)
 {
+	struct list *iter;
+
+	if (untar_full_download(download->file) != 0) {
+		return false;
+	}
+
+	/* Files that couldn't be prestaged are staged later by do_staging() */
+	for (iter = download->targets; iter; iter = iter->next) {
+		do_prestaging(iter->data);
+	}
+
+	return true;
+}
+
+static void download_mix_file(struct fullfile_download *download)
+{
+	struct file *file = download->file;
 	char *url, *filename;
 
-	string_or_die(&url, "%s/%i/files/%s.tar", MIX_STATE_DIR, file->last_change, file->hash);
-	string_or_die(&filename, "%s/download/.%s.tar", state_dir, file->hash);
+	string_or_die(&url, "%s/%i/files/%s.tar", MIX_STATE_DIR, file->last_change, download->hash);
+	string_or_die(&filename, "%s/download/.%s.tar", state_dir, download->hash);
 
 	/* Mix content is local, so don't queue files up for curl downloads */
 	if (link_or_rename(url, filename) == 0) {
-		untar_full_download(file);
+		extract_and_prestage(download);
 	} else {
 		warn("Failed to copy local mix file: %s\n", file->staging);
 	}
@@ -48,13 +97,14 @@ static void download_mix_file(struct file *file)
 	free_string(&filename);
 }
 
-static void download_file(struct swupd_curl_parallel_handle *download_handle, struct file *file)
+static void download_file(struct swupd_curl_parallel_handle *download_handle, struct fullfile_download *download)
 {
+	struct file *file = download->file;
 	char *url, *filename;
 
-	string_or_die(&filename, "%s/download/.%s.tar", state_dir, file->hash);
-	string_or_die(&url, "%s/%i/files/%s.tar", content_url, file->last_change, file->hash);
-	swupd_curl_parallel_download_enqueue(download_handle, url, filename, file->hash, file);
+	string_or_die(&filename, "%s/download/.%s.tar", state_dir, download->hash);
+	string_or_die(&url, "%s/%i/files/%s.tar", content_url, file->last_change, download->hash);
+	swupd_curl_parallel_download_enqueue(download_handle, url, filename, download->hash, download);
 	free_string(&url);
 	free_string(&filename);
 }
@@ -66,69 +116,76 @@ static bool download_error(enum download_status status, UNUSED_PARAM void *data)
 
 static bool download_successful(void *data)
 {
-	if (!data) {
+	struct fullfile_download *download = data;
+
+	if (!download) {
 		return false;
 	}
 
-	if (untar_full_download(data) != 0) {
+	if (!extract_and_prestage(download)) {
 		warn("Error for %s tarfile extraction, (check free space for %s?)\n",
-		     ((struct file *)data)->hash, state_dir);
+		     download->hash, state_dir);
 	}
 	return true;
 }
 
-static double fullfile_query_total_download_size(struct list *files)
+static double fullfile_query_total_download_size(struct list *downloads)
 {
-	long size = 0;
-	long total_size = 0;
-	struct file *file = NULL;
+	double total_size;
+	struct fullfile_download *download = NULL;
+	struct download_size *ds;
 	struct list *list = NULL;
-	char *url = NULL;
+	char *name = NULL;
 	int count = 0;
 
-	for (list = list_head(files); list; list = list->next) {
-		file = list->data;
+	ds = download_size_new();
+	for (list = list_head(downloads); list; list = list->next) {
+		download = list->data;
 
 		/* if it is a file from a mix, we won't download it */
-		if (file->is_mix) {
+		if (download->file->is_mix) {
 			continue;
 		}
 
-		string_or_die(&url, "%s/%i/files/%s.tar", content_url, file->last_change, file->hash);
-		size = swupd_curl_query_content_size(url);
-		if (size != -1) {
-			total_size += size;
-		} else {
-			debug("The header for file %s could not be downloaded\n", file->filename);
-			free_string(&url);
-			return -SWUPD_COULDNT_DOWNLOAD_FILE;
-		}
-
+		string_or_die(&name, "files/%s.tar", download->hash);
+		download_size_add(ds, download->file->last_change, name, 0);
+		free_string(&name);
 		count++;
-		debug("File: %s (%.2lf Mb)\n", url, (double)size / 1000000);
-		free_string(&url);
+	}
+
+	total_size = download_size_total(ds);
+	download_size_free(ds);
+	if (total_size < 0) {
+		debug("The size of the files to download could not be found\n");
+		return -SWUPD_COULDNT_DOWNLOAD_FILE;
 	}
 
 	debug("Number of files to download: %d\n", count);
-	debug("Total size of files to be downloaded: %.2lf Mb\n", (double)total_size / 1000000);
+	debug("Total size of files to be downloaded: %.2lf Mb\n", total_size / 1000000);
 	return total_size;
 }
 
 /*
  * Download fullfiles from the list of files.
  *
+ * Each fullfile is extracted to the staged directory as soon as its download
+ * completes. If prestage is true, the files using it are also copied to their
+ * .update name in the target directory, while other downloads are in flight.
+ *
  * Return 0 on success or a negative number or errors.
  */
-int download_fullfiles(struct list *files, int *num_downloads)
+int download_fullfiles(struct list *files, int *num_downloads, bool prestage)
 {
 	struct swupd_curl_parallel_handle *download_handle;
+	struct hashmap *downloads_map;
 	struct list *iter;
-	struct list *need_download = NULL;
+	struct list *downloads = NULL;
 	struct file *file;
 	struct stat stat;
 	struct download_progress download_progress = { 0, 0 };
 	unsigned int complete = 0;
 	unsigned int list_length;
+	int ret;
 	const unsigned int MAX_FILES = 1000;
 
 	if (!files) {
@@ -136,29 +193,54 @@ int download_fullfiles(struct list *files, int *num_downloads)
 		return SWUPD_OK;
 	}
 
-	/* make a new list with only the files we actually need to download */
+	downloads_map = hashmap_new(list_len(files), fullfile_download_equal, fullfile_download_hash);
+	ON_NULL_ABORT(downloads_map);
+
+	/* make a new list with only the files we actually need to download.
+	 * Different directories may need the same tar, in those cases it needs
+	 * to be downloaded only once */
 	for (iter = list_head(files); iter; iter = iter->next) {
+		struct fullfile_download key = { 0 };
+		struct fullfile_download *download;
 		char *targetfile;
+		char hash[SWUPD_HASH_LEN];
 		file = iter->data;
 
 		if (file->is_deleted || file->do_not_update) {
 			continue;
 		}
 
-		string_or_die(&targetfile, "%s/staged/%s", state_dir, file->hash);
-		if (lstat(targetfile, &stat) != 0 || !verify_file(file, targetfile)) {
-			need_download = list_append_data(need_download, file);
+		hash_to_hex(&file->hash, hash);
+		string_or_die(&targetfile, "%s/staged/%s", state_dir, hash);
+		if (lstat(targetfile, &stat) == 0 && verify_file(file, targetfile)) {
+			free_string(&targetfile);
+			continue;
 		}
-
 		free_string(&targetfile);
+
+		key.file = file;
+		download = hashmap_get(downloads_map, &key);
+		if (!download) {
+			download = calloc(1, sizeof(struct fullfile_download));
+			ON_NULL_ABORT(download);
+			download->file = file;
+			memcpy(download->hash, hash, SWUPD_HASH_LEN);
+			hashmap_put(downloads_map, download);
+			downloads = list_append_data(downloads, download);
+		}
+		if (prestage) {
+			download->targets = list_prepend_data(download->targets, file);
+		}
 	}
 
-	if (!need_download) {
+	if (!downloads) {
 		/* no file needs to be downloaded */
 		info("No extra files need to be downloaded\n");
 		progress_complete_step();
+		hashmap_free(downloads_map);
 		return 0;
 	}
+	downloads = list_head(downloads);
 
 	/* we need to download some files, so set up curl */
 	download_handle = swupd_curl_parallel_download_start(get_max_xfer(MAX_XFER));
@@ -167,34 +249,17 @@ int download_fullfiles(struct list *files, int *num_downloads)
 		/* If we hit this point, the network is accessible but we were
 		 * unable to download the needed files. This is a terminal error
 		 * and we need good logging */
+		list_free_list(downloads);
+		hashmap_free_hash_and_data(downloads_map, fullfile_download_free);
 		return -SWUPD_COULDNT_DOWNLOAD_FILE;
 	}
 
 	/* getting the size of many files can be very expensive, so if
 	 * the files are not too many, get their size, otherwise just use their count
 	 * to report progress */
-	list_length = list_len(need_download);
+	list_length = list_len(downloads);
 	if (list_length < MAX_FILES) {
-		/* remove tar duplicates from the list first */
-		need_download = list_sort(need_download, file_sort_hash);
-		for (iter = list_head(need_download); iter; iter = iter->next) {
-			if (iter->next == NULL) {
-				break;
-			}
-			struct file *file1, *file2;
-			file1 = iter->data;
-			file2 = iter->next->data;
-
-			/* different directories may need the same tar, in those cases it needs
-			 * to be downloaded only once, the tar for each file is downloaded from
-			 * <last_change>/files/<hash>.tar */
-			if (strcmp(file1->hash, file2->hash) == 0 && (file1->last_change == file2->last_change)) {
-				iter = list_free_item(iter, NULL);
-			}
-		}
-		need_download = list_head(iter);
-
-		download_progress.total_download_size = fullfile_query_total_download_size(need_download);
+		download_progress.total_download_size = fullfile_query_total_download_size(downloads);
 		if (download_progress.total_download_size > 0) {
 			/* enable the progress callback */
 			swupd_curl_parallel_download_set_progress_callbacks(download_handle, swupd_progress_callback, &download_progress);
@@ -209,13 +274,13 @@ int download_fullfiles(struct list *files, int *num_downloads)
 	/* download loop */
 	info("Starting download of remaining update content. This may take a while...\n");
 
-	for (iter = list_head(need_download); iter; iter = iter->next) {
-		file = iter->data;
+	for (iter = list_head(downloads); iter; iter = iter->next) {
+		struct fullfile_download *download = iter->data;
 
-		if (file->is_mix) {
-			download_mix_file(file);
+		if (download->file->is_mix) {
+			download_mix_file(download);
 		} else {
-			download_file(download_handle, file);
+			download_file(download_handle, download);
 		}
 
 		/* fall back for progress reporting when the download size
@@ -225,7 +290,10 @@ int download_fullfiles(struct list *files, int *num_downloads)
 			progress_report(complete, list_length);
 		}
 	}
-	list_free_list(need_download);
+	list_free_list(downloads);
+
+	ret = swupd_curl_parallel_download_end(download_handle, num_downloads);
+	hashmap_free_hash_and_data(downloads_map, fullfile_download_free);
 
-	return swupd_curl_parallel_download_end(download_handle, num_downloads);
+	return ret;
 }
@@ -31,8 +31,13 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "hash_cache.h"
 #include "lib/log.h"
 #include "swupd.h"
+
+// Value of global options without a short option, out of the range of chars
+#define OPT_MIN_PARALLEL_DOWNLOADS 256
+
 bool allow_mix_collisions = false;
 bool migrate = false;
 bool sigcheck = true;
@@ -50,7 +55,7 @@ bool update_complete = false;
 bool ignore_orphans = true;
 char *format_string = NULL;
 char *path_prefix = NULL; /* must always end in '/' */
-char *mounted_dirs = NULL;
+struct mount_table *mount_table = NULL;
 char *bundle_to_add = NULL;
 char *state_dir = NULL;
 int skip_diskspace_check = 0;
@@ -72,6 +77,8 @@ bool content_url_is_local = false;
 char *cert_path = NULL;
 int update_server_port = -1;
 static int max_parallel_downloads = -1;
+static int min_parallel_downloads = -1;
+static int max_jobs = -1;
 static int log_level = LOG_INFO;
 char **swupd_argv = NULL;
 
@@ -534,7 +541,8 @@ void globals_deinit(void)
 	free_string(&version_url);
 	free_string(&path_prefix);
 	free_string(&format_string);
-	free_string(&mounted_dirs);
+	mount_table_free(mount_table);
+	mount_table = NULL;
 	free_string(&state_dir);
 	free_string(&bundle_to_add);
 	timelist_free(global_times);
@@ -555,13 +563,40 @@ size_t get_max_xfer(size_t default_max_xfer)
 	return default_max_xfer;
 }
 
+size_t get_min_xfer(void)
+{
+	if (min_parallel_downloads > 0) {
+		return min_parallel_downloads;
+	}
+
+	return 1;
+}
+
+int get_max_jobs(void)
+{
+	long cpus;
+
+	if (max_jobs > 0) {
+		return max_jobs;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 0) {
+		return 1;
+	}
+
+	return cpus;
+}
+
 static const struct option global_opts[] = {
 	{ "certpath", required_argument, 0, 'C' },
 	{ "contenturl", required_argument, 0, 'c' },
 	{ "format", required_argument, 0, 'F' },
 	{ "help", no_argument, 0, 'h' },
 	{ "ignore-time", no_argument, 0, 'I' },
+	{ "jobs", required_argument, 0, 'J' },
 	{ "max-parallel-downloads", required_argument, 0, 'W' },
+	{ "min-parallel-downloads", required_argument, 0, OPT_MIN_PARALLEL_DOWNLOADS },
 	{ "no-boot-update", no_argument, 0, 'b' },
 	{ "no-scripts", no_argument, 0, 'N' },
 	{ "nosigcheck", no_argument, 0, 'n' },
@@ -578,6 +613,8 @@ static const struct option global_opts[] = {
 	{ "max-retries", required_argument, 0, 'r' },
 	{ "retry-delay", required_argument, 0, 'd' },
 	{ "json-output", no_argument, 0, 'j' },
+	{ "no-hash-cache", no_argument, &hash_cache_disabled, 1 },
+	{ "force-rehash", no_argument, &hash_cache_force_rehash, 1 },
 	{ 0, 0, 0, 0 }
 };
 
@@ -649,6 +686,20 @@ static bool global_parse_opt(int opt, char *optarg)
 			return false;
 		}
 		return true;
+	case OPT_MIN_PARALLEL_DOWNLOADS:
+		err = strtoi_err(optarg, &min_parallel_downloads);
+		if (err < 0 || min_parallel_downloads <= 0) {
+			error("Invalid --min-parallel-downloads argument: %s\n\n", optarg);
+			return false;
+		}
+		return true;
+	case 'J':
+		err = strtoi_err(optarg, &max_jobs);
+		if (err < 0 || max_jobs <= 0) {
+			error("Invalid --jobs argument: %s\n\n", optarg);
+			return false;
+		}
+		return true;
 	case 'r':
 		err = strtoi_err(optarg, &max_retries);
 		if (err < 0 || max_retries < 0) {
@@ -725,9 +776,13 @@ void global_print_help(void)
 	print("   -N, --no-scripts        Do not run the post-update scripts and boot update tool\n");
 	print("   -b, --no-boot-update    Do not install boot files to the boot partition (containers)\n");
 	print("   -W, --max-parallel-downloads=[n] Set the maximum number of parallel downloads\n");
+	print("   --min-parallel-downloads=[n] Set the minimum number of parallel downloads used when the network has problems. Default: 1\n");
+	print("   -J, --jobs=[n]          Set the maximum number of threads used to process files. Default: number of online CPUs\n");
 	print("   -r, --max-retries       Maximum number of retries for download failures\n");
 	print("   -d, --retry-delay       Initial delay between download retries, this will be doubled for each retry\n");
 	print("   -j, --json-output       Print all output as a JSON stream\n");
+	print("   --no-hash-cache         Do not use or update the cache of file hashes\n");
+	print("   --force-rehash          Ignore cached file hashes and compute them again\n");
 	print("   --quiet                 Quiet output. Print only important information and errors\n");
 	print("   --debug                 Print extra information to help debugging problems\n");
 	print("\n");
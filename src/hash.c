@@ -22,7 +22,10 @@
  */
 
 #define _GNU_SOURCE
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,73 +35,198 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "hash_cache.h"
 #include "swupd.h"
 #include "swupd_build_variant.h"
 #include "xattrs.h"
 
-void hash_assign(const char *src, char *dst)
+/* Files larger than this are hashed in chunks instead of mapped at once */
+#define HASH_STREAM_THRESHOLD (8 * 1024 * 1024)
+/* Size of each chunk read when hashing large files */
+#define HASH_STREAM_CHUNK (1024 * 1024)
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+void hash_assign(const union swupd_hash *src, union swupd_hash *dst)
 {
-	memcpy(dst, src, SWUPD_HASH_LEN - 1);
-	dst[SWUPD_HASH_LEN - 1] = '\0';
+	*dst = *src;
 }
 
-bool hash_equal(const char *hash1, const char *hash2)
+bool hash_equal(const union swupd_hash *hash1, const union swupd_hash *hash2)
 {
-	if (bcmp(hash1, hash2, SWUPD_HASH_LEN - 1) == 0) {
-		return true;
-	} else {
-		return false;
+	return ((hash1->words[0] ^ hash2->words[0]) |
+		(hash1->words[1] ^ hash2->words[1]) |
+		(hash1->words[2] ^ hash2->words[2]) |
+		(hash1->words[3] ^ hash2->words[3])) == 0;
+}
+
+bool hash_is_zeros(const union swupd_hash *hash)
+{
+	return (hash->words[0] | hash->words[1] | hash->words[2] | hash->words[3]) == 0;
+}
+
+static void hash_set_zeros(union swupd_hash *hash)
+{
+	memset(hash->bytes, 0, SWUPD_DIGEST_LEN);
+}
+
+/* Same as the "1111..." hex hash used for present files by compute_hash_lazy() */
+static void hash_set_ones(union swupd_hash *hash)
+{
+	memset(hash->bytes, 0x11, SWUPD_DIGEST_LEN);
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
 	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
 }
 
-bool hash_is_zeros(char *hash)
+bool hash_from_hex(const char *hex, union swupd_hash *hash)
 {
-	return hash_equal("0000000000000000000000000000000000000000000000000000000000000000", hash);
+	int i;
+
+	for (i = 0; i < SWUPD_DIGEST_LEN; i++) {
+		int high = hex_value(hex[i * 2]);
+		int low = high < 0 ? -1 : hex_value(hex[i * 2 + 1]);
+
+		if (low < 0) {
+			hash_set_zeros(hash);
+			return false;
+		}
+		hash->bytes[i] = high << 4 | low;
+	}
+
+	return true;
 }
 
-static void hash_set_zeros(char *hash)
+void hash_to_hex(const union swupd_hash *hash, char *hex)
 {
-	hash_assign("0000000000000000000000000000000000000000000000000000000000000000", hash);
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < SWUPD_DIGEST_LEN; i++) {
+		hex[i * 2] = digits[hash->bytes[i] >> 4];
+		hex[i * 2 + 1] = digits[hash->bytes[i] & 0xf];
+	}
+	hex[SWUPD_HASH_LEN - 1] = '\0';
 }
 
-static void hash_set_ones(char *hash)
+uint64_t hash_prefix(const union swupd_hash *hash)
 {
-	hash_assign("1111111111111111111111111111111111111111111111111111111111111111", hash);
+	/* big endian, so prefixes sort in the same order as the hex strings */
+	return be64toh(hash->words[0]);
 }
 
-static void hmac_sha256_for_data(char *hash,
+static void hmac_sha256_for_data(union swupd_hash *hash,
 				 const unsigned char *key, size_t key_len,
 				 const unsigned char *data, size_t data_len)
 {
-	unsigned char digest[EVP_MAX_MD_SIZE];
 	unsigned int digest_len = 0;
-	char *digest_str;
-	size_t digest_str_len;
-	unsigned int i;
 
 	if (data == NULL) {
 		hash_set_zeros(hash);
 		return;
 	}
 
-	if (HMAC(EVP_sha256(), (const void *)key, key_len, data, data_len, digest, &digest_len) == NULL) {
+	if (HMAC(EVP_sha256(), (const void *)key, key_len, data, data_len, hash->bytes, &digest_len) == NULL ||
+	    digest_len != SWUPD_DIGEST_LEN) {
 		hash_set_zeros(hash);
 		return;
 	}
+}
 
-	digest_str_len = (digest_len * 2) + 1;
-	digest_str = calloc(digest_str_len, sizeof(char));
-	ON_NULL_ABORT(digest_str);
+/* Same as hmac_sha256_for_data(), but reads the data from FD in chunks so
+ * large files don't need to be mapped in memory. Pages already hashed are
+ * dropped from the page cache as we go. Returns 0 on success. */
+static int hmac_sha256_for_fd(union swupd_hash *hash,
+			      const unsigned char *key, size_t key_len,
+			      int fd, uint64_t data_len)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	size_t digest_len = sizeof(digest);
+	unsigned char *buf;
+	uint64_t done = 0;
+	EVP_MD_CTX *ctx;
+	EVP_PKEY *pkey;
+	int ret = -1;
+
+	buf = malloc(HASH_STREAM_CHUNK);
+	ON_NULL_ABORT(buf);
+
+	/* The HMAC_CTX API is deprecated in OpenSSL 3, while this one is
+	 * available in all supported versions */
+	ctx = EVP_MD_CTX_new();
+	ON_NULL_ABORT(ctx);
+
+	/* Empty keys are rejected, but HMAC pads short keys with zeros, so a
+	 * single zero byte gives the same result */
+	if (key_len == 0) {
+		key = (const unsigned char *)"";
+		key_len = 1;
+	}
 
-	for (i = 0; i < digest_len; i++) {
-		snprintf(&digest_str[i * 2], digest_str_len, "%02x", (unsigned int)digest[i]);
+	pkey = EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, NULL, key, key_len);
+	if (!pkey) {
+		goto out;
 	}
 
-	hash_assign(digest_str, hash);
-	free_string(&digest_str);
+	if (EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, pkey) != 1) {
+		goto out;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while (done < data_len) {
+		size_t to_read = data_len - done < HASH_STREAM_CHUNK ? data_len - done : HASH_STREAM_CHUNK;
+		ssize_t r;
+
+		r = read(fd, buf, to_read);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto out;
+		}
+		if (r == 0) {
+			/* file was truncated after stat */
+			goto out;
+		}
+
+		if (EVP_DigestSignUpdate(ctx, buf, r) != 1) {
+			goto out;
+		}
+
+		posix_fadvise(fd, done, r, POSIX_FADV_DONTNEED);
+		done += r;
+	}
+
+	if (EVP_DigestSignFinal(ctx, digest, &digest_len) != 1 || digest_len != SWUPD_DIGEST_LEN) {
+		goto out;
+	}
+
+	memcpy(hash->bytes, digest, SWUPD_DIGEST_LEN);
+	ret = 0;
+
+out:
+	EVP_PKEY_free(pkey);
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return ret;
 }
 
-static void hmac_sha256_for_string(char *hash,
+static void hmac_sha256_for_string(union swupd_hash *hash,
 				   const unsigned char *key, size_t key_len,
 				   const char *str)
 {
@@ -116,19 +244,22 @@ static void hmac_compute_key(const char *filename,
 {
 	char *xattrs_blob = (void *)0xdeadcafe;
 	size_t xattrs_blob_len = 0;
+	union swupd_hash key_hash;
 
 	if (use_xattrs) {
 		xattrs_get_blob(filename, &xattrs_blob, &xattrs_blob_len);
 	}
 
-	hmac_sha256_for_data(key, (const unsigned char *)updt_stat,
+	hmac_sha256_for_data(&key_hash, (const unsigned char *)updt_stat,
 			     sizeof(struct update_stat),
 			     (const unsigned char *)xattrs_blob,
 			     xattrs_blob_len);
 
-	if (hash_is_zeros(key)) {
+	/* The key is the hex string of the hash, as done by the server */
+	if (hash_is_zeros(&key_hash)) {
 		*key_len = 0;
 	} else {
+		hash_to_hex(&key_hash, key);
 		*key_len = SWUPD_HASH_LEN - 1;
 	}
 
@@ -145,9 +276,9 @@ int compute_hash_lazy(struct file *file, char *filename)
 {
 	struct stat sb;
 	if (lstat(filename, &sb) == 0) {
-		hash_set_ones(file->hash);
+		hash_set_ones(&file->hash);
 	} else {
-		hash_set_zeros(file->hash);
+		hash_set_zeros(&file->hash);
 	}
 	return 0;
 }
@@ -163,14 +294,15 @@ enum swupd_code compute_hash(struct file *file, char *filename)
 	char key[SWUPD_HASH_LEN];
 	size_t key_len;
 	unsigned char *blob;
-	FILE *fl;
+	int fd;
 
 	if (file->is_deleted) {
-		hash_set_zeros(file->hash);
+		hash_set_zeros(&file->hash);
 		return SWUPD_OK;
 	}
 
-	hash_set_zeros(key);
+	key[0] = '\0';
+	key_len = 0;
 
 	if (file->is_link) {
 		char link[PATH_MAXLEN];
@@ -180,7 +312,7 @@ enum swupd_code compute_hash(struct file *file, char *filename)
 
 		if (ret >= 0) {
 			hmac_compute_key(filename, &file->stat, key, &key_len, file->use_xattrs);
-			hmac_sha256_for_string(file->hash,
+			hmac_sha256_for_string(&file->hash,
 					       (const unsigned char *)key,
 					       key_len,
 					       link);
@@ -192,7 +324,7 @@ enum swupd_code compute_hash(struct file *file, char *filename)
 
 	if (file->is_dir) {
 		hmac_compute_key(filename, &file->stat, key, &key_len, file->use_xattrs);
-		hmac_sha256_for_string(file->hash,
+		hmac_sha256_for_string(&file->hash,
 				       (const unsigned char *)key,
 				       key_len,
 				       SWUPD_HASH_DIRNAME); //Make independent of dirname
@@ -200,29 +332,43 @@ enum swupd_code compute_hash(struct file *file, char *filename)
 	}
 
 	/* if we get here, this is a regular file */
-	fl = fopen(filename, "r");
-	if (!fl) {
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		return SWUPD_COMPUTE_HASH_ERROR;
 	}
-	blob = mmap(NULL, file->stat.st_size, PROT_READ, MAP_PRIVATE, fileno(fl), 0);
+
+	hmac_compute_key(filename, &file->stat, key, &key_len, file->use_xattrs);
+
+	if (file->stat.st_size > HASH_STREAM_THRESHOLD) {
+		if (hmac_sha256_for_fd(&file->hash, (const unsigned char *)key, key_len,
+				       fd, file->stat.st_size) != 0) {
+			close(fd);
+			return SWUPD_COMPUTE_HASH_ERROR;
+		}
+		close(fd);
+		return SWUPD_OK;
+	}
+
+	blob = mmap(NULL, file->stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (blob == MAP_FAILED && file->stat.st_size != 0) {
-		abort();
+		close(fd);
+		return SWUPD_COMPUTE_HASH_ERROR;
 	}
 
-	hmac_compute_key(filename, &file->stat, key, &key_len, file->use_xattrs);
-	hmac_sha256_for_data(file->hash,
+	hmac_sha256_for_data(&file->hash,
 			     (const unsigned char *)key,
 			     key_len,
 			     blob,
 			     file->stat.st_size);
 	munmap(blob, file->stat.st_size);
-	fclose(fl);
+	close(fd);
 	return SWUPD_OK;
 }
 
 bool verify_file(struct file *file, char *filename)
 {
 	struct file local = { 0 };
+	struct stat st;
 
 	local.filename = file->filename;
 	/*
@@ -234,13 +380,19 @@ bool verify_file(struct file *file, char *filename)
 	 */
 	local.use_xattrs = !file->is_manifest;
 
+	/* Skip hashing files that didn't change since the last time they were hashed */
+	if (hash_cache_lookup(filename, local.use_xattrs, &st, &local.hash)) {
+		return hash_equal(&file->hash, &local.hash);
+	}
+
 	populate_file_struct(&local, filename);
 	if (compute_hash(&local, filename) != 0) {
 		return false;
 	}
+	hash_cache_store(filename, local.use_xattrs, &st, &local.hash);
 
 	/* Check if manifest hash matches local file hash */
-	return hash_equal(file->hash, local.hash);
+	return hash_equal(&file->hash, &local.hash);
 }
 
 bool verify_file_lazy(char *filename)
@@ -251,7 +403,7 @@ bool verify_file_lazy(char *filename)
 		return false;
 	}
 
-	return !hash_is_zeros(local.hash);
+	return !hash_is_zeros(&local.hash);
 }
 
 /* Compares the hash for BUNDLE with that listed in the Manifest.MoM.  If the
@@ -263,8 +415,11 @@ int verify_bundle_hash(struct manifest *manifest, struct file *bundle)
 	struct list *iter = list_head(manifest->manifests);
 	struct file *current;
 	char *local = NULL, *cached;
+	char hash[SWUPD_HASH_LEN];
 	int ret = 0;
 
+	hash_to_hex(&bundle->hash, hash);
+
 	while (iter) {
 		struct stat sb, sb2;
 
@@ -276,7 +431,7 @@ int verify_bundle_hash(struct manifest *manifest, struct file *bundle)
 		}
 
 		string_or_die(&cached, "%s/%i/Manifest.%s.%s", state_dir,
-			      current->last_change, current->filename, bundle->hash);
+			      current->last_change, current->filename, hash);
 
 		string_or_die(&local, "%s/%i/Manifest.%s", state_dir,
 			      current->last_change, current->filename);
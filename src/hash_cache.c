@@ -0,0 +1,383 @@
+/*
+ *   Software Updater - client side
+ *
+ *      Copyright © 2019 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash_cache.h"
+#include "lib/hashmap.h"
+#include "swupd.h"
+
+/*
+ * The hash cache saves the hash computed for a file together with the stat
+ * data of that file at the time it was hashed. If the file still has the same
+ * device, inode, size, mode, owner, mtime and ctime, the cached hash is used
+ * instead of reading the whole file again. Changes to file content update
+ * mtime and changes to permissions, ownership or extended attributes update
+ * ctime, so any change that affects the hash invalidates the entry.
+ *
+ * The cache is loaded from the state directory on first use and written back
+ * by hash_cache_deinit() if any entry was added, updated or removed. Entries
+ * are removed when a lookup finds that the file was deleted or changed, so the
+ * cache doesn't keep entries that can never match again.
+ */
+
+#define HASH_CACHE_MAGIC "SWUPDHC"
+#define HASH_CACHE_VERSION 2
+#define HASH_CACHE_MIN_BUCKETS (1 << 16)
+
+/* Files changed less than this many seconds ago are not cached, because
+ * they could still be modified without a visible change in their timestamps */
+#define HASH_CACHE_RACY_WINDOW 2
+
+int hash_cache_disabled = 0;
+int hash_cache_force_rehash = 0;
+
+struct hash_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
+struct hash_cache_record {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t use_xattrs;
+	union swupd_hash hash;
+	uint32_t path_len;
+};
+
+struct cache_entry {
+	char *path;
+	size_t hash_key;
+	struct hash_cache_record rec;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashmap *cache = NULL;
+static bool cache_loaded = false;
+static bool cache_dirty = false;
+
+static bool entry_equal(const void *a, const void *b)
+{
+	const struct cache_entry *ea = a;
+	const struct cache_entry *eb = b;
+
+	return strcmp(ea->path, eb->path) == 0;
+}
+
+static size_t entry_hash(const void *data)
+{
+	return ((const struct cache_entry *)data)->hash_key;
+}
+
+static void free_entry(void *data)
+{
+	struct cache_entry *entry = data;
+
+	free_string(&entry->path);
+	free(entry);
+}
+
+static void record_from_stat(struct hash_cache_record *rec, bool use_xattrs, const struct stat *st)
+{
+	rec->dev = st->st_dev;
+	rec->ino = st->st_ino;
+	rec->size = st->st_size;
+	rec->mtime_sec = st->st_mtim.tv_sec;
+	rec->mtime_nsec = st->st_mtim.tv_nsec;
+	rec->ctime_sec = st->st_ctim.tv_sec;
+	rec->ctime_nsec = st->st_ctim.tv_nsec;
+	rec->mode = st->st_mode;
+	rec->uid = st->st_uid;
+	rec->gid = st->st_gid;
+	rec->use_xattrs = use_xattrs;
+}
+
+static bool record_matches(const struct hash_cache_record *a, const struct hash_cache_record *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	       a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+	       a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec &&
+	       a->mode == b->mode && a->uid == b->uid && a->gid == b->gid &&
+	       a->use_xattrs == b->use_xattrs;
+}
+
+static struct cache_entry *new_entry(char *path)
+{
+	struct cache_entry *entry;
+
+	entry = calloc(1, sizeof(struct cache_entry));
+	ON_NULL_ABORT(entry);
+
+	entry->path = path;
+	entry->hash_key = hashmap_hash_from_string(path);
+
+	return entry;
+}
+
+static void load_cache(void)
+{
+	struct hash_cache_header header;
+	char *cache_file = NULL;
+	size_t buckets = HASH_CACHE_MIN_BUCKETS;
+	uint32_t i;
+	FILE *f;
+
+	cache_loaded = true;
+	if (!state_dir) {
+		return;
+	}
+
+	string_or_die(&cache_file, "%s/%s", state_dir, HASH_CACHE_FILENAME);
+	f = fopen(cache_file, "r");
+	if (f) {
+		if (fread(&header, sizeof(header), 1, f) != 1 ||
+		    memcmp(header.magic, HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC)) != 0 ||
+		    header.version != HASH_CACHE_VERSION) {
+			debug("Ignoring invalid hash cache %s\n", cache_file);
+			fclose(f);
+			f = NULL;
+		} else if (header.count > buckets / 2) {
+			buckets = header.count * 2;
+		}
+	}
+
+	cache = hashmap_new(buckets, entry_equal, entry_hash);
+
+	if (!f) {
+		goto out;
+	}
+
+	for (i = 0; i < header.count; i++) {
+		struct hash_cache_record rec;
+		struct cache_entry *entry;
+		char *path;
+
+		if (fread(&rec, sizeof(rec), 1, f) != 1 || rec.path_len == 0 || rec.path_len > PATH_MAXLEN) {
+			break;
+		}
+
+		path = malloc(rec.path_len + 1);
+		ON_NULL_ABORT(path);
+		if (fread(path, rec.path_len, 1, f) != 1) {
+			free(path);
+			break;
+		}
+		path[rec.path_len] = '\0';
+
+		entry = new_entry(path);
+		entry->rec = rec;
+		if (!hashmap_put(cache, entry)) {
+			free_entry(entry);
+		}
+	}
+
+	if (i != header.count) {
+		/* Whatever we read so far is still valid, but rewrite the file */
+		debug("Hash cache %s is truncated\n", cache_file);
+		cache_dirty = true;
+	}
+	fclose(f);
+
+out:
+	free_string(&cache_file);
+}
+
+bool hash_cache_lookup(const char *filename, bool use_xattrs, struct stat *st, union swupd_hash *hash)
+{
+	struct hash_cache_record rec = { 0 };
+	struct cache_entry key = { 0 };
+	struct cache_entry *entry;
+	bool exists = true;
+	bool found = false;
+
+	if (lstat(filename, st) != 0) {
+		memset(st, 0, sizeof(struct stat));
+		exists = false;
+	}
+
+	if (hash_cache_disabled) {
+		return false;
+	}
+	if (exists && (hash_cache_force_rehash || !S_ISREG(st->st_mode))) {
+		return false;
+	}
+
+	record_from_stat(&rec, use_xattrs, st);
+	key.path = (char *)filename;
+	key.hash_key = hashmap_hash_from_string(filename);
+
+	pthread_mutex_lock(&cache_lock);
+	if (!cache_loaded) {
+		load_cache();
+	}
+
+	entry = cache ? hashmap_get(cache, &key) : NULL;
+	if (!entry) {
+		goto out;
+	}
+
+	if (exists && record_matches(&entry->rec, &rec)) {
+		hash_assign(&entry->rec.hash, hash);
+		found = true;
+	} else if (!exists || entry->rec.use_xattrs == rec.use_xattrs) {
+		/* The file was removed or changed, so this entry can't match
+		 * anymore. It's replaced by hash_cache_store() if the file
+		 * is hashed again. */
+		hashmap_pop(cache, &key);
+		free_entry(entry);
+		cache_dirty = true;
+	}
+
+out:
+	pthread_mutex_unlock(&cache_lock);
+
+	return found;
+}
+
+void hash_cache_store(const char *filename, bool use_xattrs, const struct stat *st, const union swupd_hash *hash)
+{
+	struct cache_entry key = { 0 };
+	struct cache_entry *entry;
+	time_t now;
+
+	if (hash_cache_disabled || !S_ISREG(st->st_mode)) {
+		return;
+	}
+
+	now = time(NULL);
+	if (st->st_mtim.tv_sec >= now - HASH_CACHE_RACY_WINDOW ||
+	    st->st_ctim.tv_sec >= now - HASH_CACHE_RACY_WINDOW) {
+		return;
+	}
+
+	key.path = (char *)filename;
+	key.hash_key = hashmap_hash_from_string(filename);
+
+	pthread_mutex_lock(&cache_lock);
+	if (!cache_loaded) {
+		load_cache();
+	}
+	if (!cache) {
+		goto out;
+	}
+
+	entry = hashmap_get(cache, &key);
+	if (!entry) {
+		entry = new_entry(strdup_or_die(filename));
+		hashmap_put(cache, entry);
+	}
+
+	record_from_stat(&entry->rec, use_xattrs, st);
+	hash_assign(hash, &entry->rec.hash);
+	entry->rec.path_len = strlen(filename);
+	cache_dirty = true;
+
+out:
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void save_cache(void)
+{
+	struct hash_cache_header header = { HASH_CACHE_MAGIC, HASH_CACHE_VERSION, 0 };
+	struct cache_entry *entry;
+	char *cache_file = NULL;
+	char *tmp_file = NULL;
+	bool ok = true;
+	size_t i;
+	int fd;
+	FILE *f;
+
+	string_or_die(&cache_file, "%s/%s", state_dir, HASH_CACHE_FILENAME);
+	string_or_die(&tmp_file, "%s.tmp", cache_file);
+
+	fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		debug("Unable to write hash cache %s: %s\n", tmp_file, strerror(errno));
+		goto out;
+	}
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp_file);
+		goto out;
+	}
+
+	header.count = hashmap_len(cache);
+
+	ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	HASHMAP_FOREACH(cache, i, entry)
+	{
+		if (!ok) {
+			break;
+		}
+		ok = fwrite(&entry->rec, sizeof(entry->rec), 1, f) == 1 &&
+		     fwrite(entry->path, entry->rec.path_len, 1, f) == 1;
+	}
+
+	if (fclose(f) != 0 || !ok) {
+		debug("Unable to write hash cache %s\n", tmp_file);
+		unlink(tmp_file);
+		goto out;
+	}
+
+	if (rename(tmp_file, cache_file) != 0) {
+		debug("Unable to rename hash cache %s: %s\n", tmp_file, strerror(errno));
+		unlink(tmp_file);
+	}
+
+out:
+	free_string(&tmp_file);
+	free_string(&cache_file);
+}
+
+void hash_cache_deinit(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (cache && cache_dirty && state_dir && !hash_cache_disabled) {
+		save_cache();
+	}
+
+	if (cache) {
+		hashmap_free_hash_and_data(cache, free_entry);
+		cache = NULL;
+	}
+	cache_loaded = false;
+	cache_dirty = false;
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,56 @@
+#ifndef __INCLUDE_GUARD_HASH_CACHE_H
+#define __INCLUDE_GUARD_HASH_CACHE_H
+
+/**
+ * @file
+ * @brief Persistent cache of file hashes, keyed by the file stat data.
+ */
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+union swupd_hash;
+
+/** @brief Name of the hash cache file inside the state directory. */
+#define HASH_CACHE_FILENAME "hash_cache"
+
+/** @brief If set, the hash cache is neither read nor updated. */
+extern int hash_cache_disabled;
+
+/** @brief If set, cached hashes are ignored but the cache is still updated. */
+extern int hash_cache_force_rehash;
+
+/**
+ * @brief Look for the hash of filename in the cache.
+ *
+ * The file is lstat()ed and the result is stored in st, so it can be used
+ * with hash_cache_store() if the hash needs to be computed.
+ *
+ * The cached entry is removed if the file was deleted or changed since it was
+ * stored.
+ *
+ * @returns true if the cached hash is still valid for this file and was copied
+ * to hash, false otherwise.
+ */
+bool hash_cache_lookup(const char *filename, bool use_xattrs, struct stat *st, union swupd_hash *hash);
+
+/**
+ * @brief Store the hash of filename, computed when the file had stat st.
+ */
+void hash_cache_store(const char *filename, bool use_xattrs, const struct stat *st, const union swupd_hash *hash);
+
+/**
+ * @brief Write the cache to the state directory, if it was modified, and free
+ * all memory used by it.
+ */
+void hash_cache_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -128,7 +128,10 @@ enum swupd_code hashdump_main(int argc, char **argv)
 	if (ret != 0) {
 		warn("compute_hash() failed\n");
 	} else {
-		print("%s\n", file.hash);
+		char hash[SWUPD_HASH_LEN];
+
+		hash_to_hex(&file.hash, hash);
+		print("%s\n", hash);
 		if (file.is_dir && is_directory_mounted(fullname)) {
 			warn("!! dumped hash might not match a manifest "
 			     "hash because a mount is active\n");
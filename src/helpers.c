@@ -36,6 +36,7 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "hash_cache.h"
 #include "signature.h"
 #include "swupd.h"
 #include "swupd_build_variant.h"
@@ -108,17 +109,20 @@ int rm_staging_dir_contents(const char *rel_path)
 static void unlink_all_staged_content(struct file *file)
 {
 	char *filename;
+	char hash[SWUPD_HASH_LEN];
+
+	hash_to_hex(&file->hash, hash);
 
 	/* downloaded tar file */
-	string_or_die(&filename, "%s/download/%s.tar", state_dir, file->hash);
+	string_or_die(&filename, "%s/download/%s.tar", state_dir, hash);
 	unlink(filename);
 	free_string(&filename);
-	string_or_die(&filename, "%s/download/.%s.tar", state_dir, file->hash);
+	string_or_die(&filename, "%s/download/.%s.tar", state_dir, hash);
 	unlink(filename);
 	free_string(&filename);
 
 	/* downloaded and un-tar'd file */
-	string_or_die(&filename, "%s/staged/%s", state_dir, file->hash);
+	string_or_die(&filename, "%s/staged/%s", state_dir, hash);
 	(void)remove(filename);
 	free_string(&filename);
 }
@@ -210,66 +214,6 @@ static int create_required_dirs(void)
 	return ensure_root_owned_dir(state_dir);
 }
 
-/**
- * store a colon separated list of current mountpoint into
- * variable mounted_dirs, this function do not return a value.
- *
- * e.g: :/proc:/mnt/acct:
- */
-static void get_mounted_directories(void)
-{
-	FILE *file;
-	char *line = NULL;
-	char *mnt;
-	char *tmp;
-	ssize_t ret;
-	char *c;
-	size_t n;
-
-	file = fopen("/proc/self/mountinfo", "r");
-	if (!file) {
-		return;
-	}
-
-	while (!feof(file)) {
-		ret = getline(&line, &n, file);
-		if ((ret < 0) || (line == NULL)) {
-			break;
-		}
-
-		c = strchr(line, '\n');
-		if (c) {
-			*c = 0;
-		}
-
-		n = 0;
-		mnt = strtok(line, " ");
-		while (mnt != NULL) {
-			if (n == 4) {
-				/* The "4" assumes today's mountinfo form of:
-				* 16 36 0:3 / /proc rw,relatime master:7 - proc proc rw
-				* where the fifth field is the mountpoint. */
-				if (strcmp(mnt, "/") == 0) {
-					break;
-				}
-
-				if (mounted_dirs == NULL) {
-					string_or_die(&mounted_dirs, "%s", ":");
-				}
-				tmp = mounted_dirs;
-				string_or_die(&mounted_dirs, "%s%s:", tmp, mnt);
-				free_string(&tmp);
-				break;
-			}
-			n++;
-			mnt = strtok(NULL, " ");
-		}
-		free_string(&line);
-	}
-	free_string(&line);
-	fclose(file);
-}
-
 // prepends prefix to an path (eg: the global path_prefix to a
 // file->filename or some other path prefix and path), insuring there
 // is no duplicate '/' at the strings' junction and no trailing '/'
@@ -302,68 +246,39 @@ char *mk_full_filename(const char *prefix, const char *path)
 // expects filename w/o path_prefix prepended
 bool is_directory_mounted(const char *filename)
 {
+	const struct mount_entry *mount;
 	char *fname;
-	bool ret = false;
-	char *tmp;
 
-	if (mounted_dirs == NULL) {
+	if (mount_table == NULL) {
 		return false;
 	}
 
-	tmp = mk_full_filename(path_prefix, filename);
-	string_or_die(&fname, ":%s:", tmp);
-	free_string(&tmp);
-
-	if (strstr(mounted_dirs, fname)) {
-		ret = true;
-	}
-
+	fname = mk_full_filename(path_prefix, filename);
+	mount = mount_table_find(mount_table, fname);
 	free_string(&fname);
 
-	return ret;
+	/* The root of the system is not considered */
+	return mount && strcmp(mount->path, "/") != 0;
 }
 
-// expects filename w/o path_prefix prepended
-bool is_under_mounted_directory(const char *filename)
+/* Get the free space of the file system path is on. Paths that don't exist
+ * yet use the file system they would be created on. */
+long get_fs_available_space(const char *path)
 {
-	bool ret = false;
-	int err;
-	char *token;
-	char *mountpoint;
-	char *dir;
-	char *fname;
-	char *tmp;
+	const struct mount_entry *mount;
+	long space;
 
-	if (mounted_dirs == NULL) {
-		return false;
+	space = get_available_space(path);
+	if (space >= 0) {
+		return space;
 	}
 
-	dir = strdup_or_die(mounted_dirs);
-
-	token = strtok(dir + 1, ":");
-	while (token != NULL) {
-		string_or_die(&mountpoint, "%s/", token);
-
-		tmp = mk_full_filename(path_prefix, filename);
-		string_or_die(&fname, ":%s:", tmp);
-		free_string(&tmp);
-
-		err = strncmp(fname, mountpoint, strlen(mountpoint));
-		free_string(&fname);
-		if (err == 0) {
-			free_string(&mountpoint);
-			ret = true;
-			break;
-		}
-
-		token = strtok(NULL, ":");
-
-		free_string(&mountpoint);
+	mount = mount_table_find_containing(mount_table, path);
+	if (!mount) {
+		return -1;
 	}
 
-	free_string(&dir);
-
-	return ret;
+	return get_available_space(mount->path);
 }
 
 static int swupd_rm_file(const char *path)
@@ -499,13 +414,19 @@ void free_file_data(void *data)
 
 	/* peer is a pointer to file contained
 	 * in another list and must not be disposed */
-	free_string(&file->filename);
 	free_string(&file->staging);
 
 	if (file->header) {
 		free(file->header);
+		file->header = NULL;
 	}
 
+	/* the filename and the file itself are released with the manifest */
+	if (file->in_file_table) {
+		return;
+	}
+
+	free_string(&file->filename);
 	free(file);
 }
 
@@ -513,6 +434,8 @@ void swupd_deinit(void)
 {
 	swupd_curl_deinit();
 	signature_deinit();
+	hash_cache_deinit();
+	heuristics_deinit();
 	v_lockfile();
 	globals_deinit();
 	dump_file_descriptor_leaks();
@@ -539,7 +462,7 @@ enum swupd_code swupd_init(enum swupd_init_config config)
 		goto out_fds;
 	}
 
-	get_mounted_directories();
+	mount_table = mount_table_load("/proc/self/mountinfo");
 
 	if ((config & SWUPD_NO_ROOT) == 0) {
 		check_root();
@@ -740,8 +663,10 @@ enum swupd_code verify_fix_path(char *targetpath, struct manifest *target_MoM)
 		unlink_all_staged_content(file);
 
 		/* download the fullfile for the missing path */
-		string_or_die(&tar_dotfile, "%s/download/.%s.tar", state_dir, file->hash);
-		string_or_die(&url, "%s/%i/files/%s.tar", content_url, file->last_change, file->hash);
+		char hash[SWUPD_HASH_LEN];
+		hash_to_hex(&file->hash, hash);
+		string_or_die(&tar_dotfile, "%s/download/.%s.tar", state_dir, hash);
+		string_or_die(&url, "%s/%i/files/%s.tar", content_url, file->last_change, hash);
 		ret = swupd_curl_get_file(url, tar_dotfile);
 		if (ret != 0) {
 			error("Failed to download file %s in verify_fix_path\n", file->filename);
@@ -917,12 +842,14 @@ int untar_full_download(void *data)
 	char *tarfile;
 	char *tar_dotfile;
 	char *targetfile;
+	char hash[SWUPD_HASH_LEN];
 	struct stat stat;
 	int err;
 
-	string_or_die(&tar_dotfile, "%s/download/.%s.tar", state_dir, file->hash);
-	string_or_die(&tarfile, "%s/download/%s.tar", state_dir, file->hash);
-	string_or_die(&targetfile, "%s/staged/%s", state_dir, file->hash);
+	hash_to_hex(&file->hash, hash);
+	string_or_die(&tar_dotfile, "%s/download/.%s.tar", state_dir, hash);
+	string_or_die(&tarfile, "%s/download/%s.tar", state_dir, hash);
+	string_or_die(&targetfile, "%s/staged/%s", state_dir, hash);
 
 	/* If valid target file already exists, we're done.
 	 * NOTE: this should NEVER happen given the checking that happens
@@ -951,7 +878,7 @@ int untar_full_download(void *data)
 	}
 	free_string(&tar_dotfile);
 
-	err = archives_check_single_file_tarball(tarfile, file->hash);
+	err = archives_check_single_file_tarball(tarfile, hash);
 	if (err) {
 		goto exit;
 	}
@@ -963,7 +890,7 @@ int untar_full_download(void *data)
 	free_string(&outputdir);
 	if (err) {
 		warn("ignoring tar extract failure for fullfile %s.tar (ret %d)\n",
-		     file->hash, err);
+		     hash, err);
 		goto exit;
 		/* TODO: respond to ARCHIVE_RETRY error codes
 		 * libarchive returns ARCHIVE_RETRY when tar extraction fails but the
@@ -22,6 +22,7 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,99 +31,223 @@
 #include "config.h"
 #include "swupd.h"
 
+/* Classes of paths, all found at once by classify_path() */
+enum path_class {
+	PATH_CONFIG = 1 << 0,
+	PATH_STATE = 1 << 1,
+	PATH_NOT_STATE = 1 << 2, /* exception to PATH_STATE */
+	PATH_MOUNTED = 1 << 3,	 /* mount point, always state */
+	PATH_BOOT = 1 << 4,
+	PATH_KERNEL = 1 << 5,
+	PATH_BOOTLOADER = 1 << 6,
+	PATH_SYSTEMD = 1 << 7,
+};
+
+struct path_rule {
+	const char *path;
+	bool exact; /* only the path itself, not all paths starting with it */
+	unsigned int classes;
+};
+
 /* trailing slash is to indicate dir itself is expected to exist, but
  * contents are ignored */
-static bool is_config(char *filename)
+static const struct path_rule path_rules[] = {
+	{ "/etc/", false, PATH_CONFIG },
+
+	{ "/data", false, PATH_STATE },
+	{ "/dev/", false, PATH_STATE },
+	{ "/home/", false, PATH_STATE },
+	{ "/lost+found", false, PATH_STATE },
+	{ "/proc/", false, PATH_STATE },
+	{ "/root/", false, PATH_STATE },
+	{ "/run/", false, PATH_STATE },
+	{ "/sys/", false, PATH_STATE },
+	{ "/tmp/", false, PATH_STATE },
+	{ "/usr/src/", false, PATH_STATE },
+	{ "/var/", false, PATH_STATE },
+	{ "/usr/src/debug", true, PATH_NOT_STATE },
+	/* all the entries inside kernel directory, then only the kernel
+	 * directory */
+	{ "/usr/src/kernel/", false, PATH_NOT_STATE },
+	{ "/usr/src/kernel", true, PATH_NOT_STATE },
+
+	{ "/boot/", false, PATH_BOOT },
+	{ "/usr/lib/modules/", false, PATH_BOOT },
+	{ "/usr/lib/kernel/", false, PATH_BOOT | PATH_KERNEL },
+	{ "/usr/lib/systemd/systemd", true, PATH_SYSTEMD },
+	{ "/usr/lib/gummiboot", false, PATH_BOOT | PATH_BOOTLOADER },
+	{ "/usr/bin/gummiboot", false, PATH_BOOT | PATH_BOOTLOADER },
+	{ "/usr/bin/bootctl", false, PATH_BOOT | PATH_BOOTLOADER },
+	{ "/usr/lib/systemd/boot", false, PATH_BOOT | PATH_BOOTLOADER },
+};
+
+/* Node of the trie with all rules. Node 0 is the root, so it's also used
+ * as "no node" in links. */
+struct path_node {
+	unsigned int prefix_classes; /* classes of paths starting here */
+	unsigned int exact_classes;  /* classes of the path ending here */
+	uint32_t first_child;
+	uint32_t next_sibling;
+	char c;
+};
+
+static struct path_node *path_nodes = NULL;
+static uint32_t path_nodes_len = 0;
+static uint32_t path_nodes_size = 0;
+
+static uint32_t path_node_child(uint32_t node, char c)
 {
-	if (strncmp(filename, "/etc/", 5) == 0) {
-		return true;
+	uint32_t child;
+
+	for (child = path_nodes[node].first_child; child; child = path_nodes[child].next_sibling) {
+		if (path_nodes[child].c == c) {
+			return child;
+		}
 	}
-	return false;
+
+	return 0;
 }
 
-static void config_file_heuristics(struct file *file)
+static uint32_t path_node_new(void)
 {
-	if (is_config(file->filename)) {
-		file->is_config = 1;
+	if (path_nodes_len == path_nodes_size) {
+		path_nodes_size = path_nodes_size ? path_nodes_size * 2 : 256;
+		path_nodes = realloc(path_nodes, path_nodes_size * sizeof(struct path_node));
+		ON_NULL_ABORT(path_nodes);
 	}
+	memset(&path_nodes[path_nodes_len], 0, sizeof(struct path_node));
+
+	return path_nodes_len++;
 }
 
-/* trailing slash is to indicate dir itself is expected to exist, but
- * contents are ignored */
-static bool is_state(char *filename)
+static void add_path_rule(const char *path, bool exact, unsigned int classes)
 {
-	if (is_directory_mounted(filename)) {
-		return true;
+	uint32_t node = 0;
+	const char *p;
+
+	for (p = path; *p; p++) {
+		uint32_t child = path_node_child(node, *p);
+
+		if (!child) {
+			child = path_node_new();
+			path_nodes[child].c = *p;
+			path_nodes[child].next_sibling = path_nodes[node].first_child;
+			path_nodes[node].first_child = child;
+		}
+		node = child;
 	}
 
-	if (is_under_mounted_directory(filename)) {
-		return true;
+	if (exact) {
+		path_nodes[node].exact_classes |= classes;
+	} else {
+		path_nodes[node].prefix_classes |= classes;
 	}
+}
 
-	if ((strlen(filename) == 14) && (strncmp(filename, "/usr/src/debug", 14) == 0)) {
-		return false;
+/* Add the mount points under path_prefix, as they would appear in the
+ * manifest */
+static void add_mount_points(void)
+{
+	size_t prefix_len;
+	size_t i;
+
+	if (!mount_table) {
+		return;
 	}
 
-	/* Compare the first part of the path, first all the entries inside
-	 * kernel directory, then only the kernel directory */
-	if ((strncmp(filename, "/usr/src/kernel/", 16) == 0) ||
-	    ((strlen(filename) == 15) && (strncmp(filename, "/usr/src/kernel", 15) == 0))) {
-		return false;
+	prefix_len = strlen(path_prefix);
+	while (prefix_len && path_prefix[prefix_len - 1] == '/') {
+		prefix_len--;
 	}
 
-	if ((strncmp(filename, "/data", 5) == 0) ||
-	    (strncmp(filename, "/dev/", 5) == 0) ||
-	    (strncmp(filename, "/home/", 6) == 0) ||
-	    (strncmp(filename, "/lost+found", 11) == 0) ||
-	    (strncmp(filename, "/proc/", 6) == 0) ||
-	    (strncmp(filename, "/root/", 6) == 0) ||
-	    (strncmp(filename, "/run/", 5) == 0) ||
-	    (strncmp(filename, "/sys/", 5) == 0) ||
-	    (strncmp(filename, "/tmp/", 5) == 0) ||
-	    (strncmp(filename, "/usr/src/", 9) == 0) ||
-	    (strncmp(filename, "/var/", 5) == 0)) {
-		return true;
+	for (i = 0; i < mount_table->len; i++) {
+		const char *path = mount_table->entries[i].path;
+
+		if (strncmp(path, path_prefix, prefix_len) == 0 && path[prefix_len] == '/' &&
+		    strcmp(path, "/") != 0) {
+			add_path_rule(path + prefix_len, true, PATH_MOUNTED);
+		}
 	}
-	return false;
 }
 
-static void runtime_state_heuristics(struct file *file)
+static void compile_path_rules(void)
 {
-	if (is_state(file->filename)) {
-		file->is_state = 1;
+	size_t i;
+
+	path_node_new();
+	for (i = 0; i < sizeof(path_rules) / sizeof(path_rules[0]); i++) {
+		add_path_rule(path_rules[i].path, path_rules[i].exact, path_rules[i].classes);
 	}
+	add_mount_points();
 }
 
-static void boot_file_heuristics(struct file *file)
+/* Get all classes of filename in one pass over it */
+static unsigned int classify_path(const char *filename)
 {
-	if ((strncmp(file->filename, "/boot/", 6) == 0) ||
-	    (strncmp(file->filename, "/usr/lib/modules/", 17) == 0)) {
-		file->is_boot = 1;
+	unsigned int classes;
+	uint32_t node = 0;
+	const char *p;
+
+	if (!path_nodes) {
+		compile_path_rules();
+	}
+
+	classes = path_nodes[0].prefix_classes;
+	for (p = filename; *p; p++) {
+		node = path_node_child(node, *p);
+		if (!node) {
+			return classes;
+		}
+		classes |= path_nodes[node].prefix_classes;
+	}
+
+	return classes | path_nodes[node].exact_classes;
+}
+
+static bool is_state(unsigned int classes)
+{
+	if (classes & PATH_MOUNTED) {
+		return true;
+	}
+
+	return (classes & PATH_STATE) && !(classes & PATH_NOT_STATE);
+}
+
+void apply_heuristics(struct file *file)
+{
+	unsigned int classes = classify_path(file->filename);
+
+	if (is_state(classes)) {
+		file->is_state = 1;
 	}
 
-	if (strncmp(file->filename, "/usr/lib/kernel/", 16) == 0) {
+	if (classes & PATH_BOOT) {
 		file->is_boot = 1;
+	}
+
+	if (classes & PATH_KERNEL) {
 		need_update_boot = true;
 	}
 
-	if (strcmp(file->filename, "/usr/lib/systemd/systemd") == 0) {
+	if (classes & PATH_SYSTEMD) {
 		need_systemd_reexec = true;
 	}
 
-	if ((strncmp(file->filename, "/usr/lib/gummiboot", 18) == 0) ||
-	    (strncmp(file->filename, "/usr/bin/gummiboot", 18) == 0) ||
-	    (strncmp(file->filename, "/usr/bin/bootctl", 16) == 0) ||
-	    (strncmp(file->filename, "/usr/lib/systemd/boot", 21) == 0)) {
-		file->is_boot = 1;
+	if (classes & PATH_BOOTLOADER) {
 		need_update_bootloader = true;
 	}
+
+	if (classes & PATH_CONFIG) {
+		file->is_config = 1;
+	}
 }
 
-void apply_heuristics(struct file *file)
+void heuristics_deinit(void)
 {
-	runtime_state_heuristics(file);
-	boot_file_heuristics(file);
-	config_file_heuristics(file);
+	free(path_nodes);
+	path_nodes = NULL;
+	path_nodes_len = 0;
+	path_nodes_size = 0;
 }
 
 /* Determines whether or not FILE should be ignored for this swupd action. Note
@@ -133,10 +258,12 @@ void apply_heuristics(struct file *file)
  */
 bool ignore(struct file *file)
 {
+	unsigned int classes = classify_path(file->filename);
+
 	if ((OS_IS_STATELESS && file->is_config) ||
-	    (OS_IS_STATELESS && is_config(file->filename)) || // ideally we trust the manifest but short term reapply check here
+	    (OS_IS_STATELESS && (classes & PATH_CONFIG)) || // ideally we trust the manifest but short term reapply check here
 	    (file->is_state) ||
-	    is_state(file->filename) || // ideally we trust the manifest but short term reapply check here
+	    is_state(classes) || // ideally we trust the manifest but short term reapply check here
 	    (file->is_boot && file->is_deleted) ||
 	    (ignore_orphans && file->is_orphan) ||
 	    (file->is_ghosted)) {
@@ -22,6 +22,7 @@
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +32,8 @@
 #include "log.h"
 #include "strings.h"
 
+static pthread_mutex_t write_disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* _archive_check_err(ar, ret)
  *
  * Check and print archive errors */
@@ -146,8 +149,11 @@ int archives_extract_to(const char *tarfile, const char *outputdir)
 		return r;
 	}
 
-	/* set up write */
+	/* set up write. archive_write_disk_new() briefly changes the process
+	 * umask to read it, so don't let two threads do it at the same time */
+	pthread_mutex_lock(&write_disk_lock);
 	ext = archive_write_disk_new();
+	pthread_mutex_unlock(&write_disk_lock);
 	r = archive_write_disk_set_options(ext, flags);
 	if (_archive_check_err(ext, r)) {
 		goto out;
@@ -0,0 +1,145 @@
+/*
+ *   Software Updater - client side
+ *
+ *      Copyright (c) 2019 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "congestion.h"
+
+#include <string.h>
+
+// The limit is reduced when the latency is this many times the base latency
+#define LATENCY_FACTOR 2
+// and at least this much higher, in seconds, to ignore jitter on fast links
+#define LATENCY_MIN_INCREASE 0.1
+
+void congestion_init(struct congestion_control *cc, size_t floor, size_t ceiling)
+{
+	memset(cc, 0, sizeof(*cc));
+	cc->ceiling = ceiling;
+	cc->floor = floor < ceiling ? floor : ceiling;
+	cc->limit = ceiling;
+}
+
+double congestion_window_throughput(const struct congestion_window *window)
+{
+	if (window->time <= 0) {
+		return 0;
+	}
+
+	return window->bytes / window->time;
+}
+
+double congestion_window_latency(const struct congestion_window *window)
+{
+	size_t successes = window->transfers - window->errors;
+
+	if (successes == 0) {
+		return 0;
+	}
+
+	return window->latency / successes;
+}
+
+static enum congestion_decision decrease(struct congestion_control *cc)
+{
+	size_t limit = cc->limit / 2;
+
+	if (limit < cc->floor) {
+		limit = cc->floor;
+	}
+	if (limit == cc->limit) {
+		return CONGESTION_KEEP;
+	}
+
+	cc->limit = limit;
+	return CONGESTION_DECREASE;
+}
+
+static enum congestion_decision increase(struct congestion_control *cc)
+{
+	if (cc->limit >= cc->ceiling) {
+		return CONGESTION_KEEP;
+	}
+
+	cc->limit++;
+	return CONGESTION_INCREASE;
+}
+
+static bool latency_too_high(struct congestion_control *cc, double latency)
+{
+	if (latency <= 0) {
+		return false;
+	}
+
+	if (cc->base_latency <= 0 || latency < cc->base_latency) {
+		cc->base_latency = latency;
+		return false;
+	}
+
+	if (latency < cc->base_latency * LATENCY_FACTOR ||
+	    latency < cc->base_latency + LATENCY_MIN_INCREASE) {
+		return false;
+	}
+
+	// Reducing the number of transfers can't help anymore, so the
+	// network is just slower than it was
+	if (cc->limit <= cc->floor) {
+		cc->base_latency = latency;
+		return false;
+	}
+
+	return true;
+}
+
+static void end_window(struct congestion_control *cc)
+{
+	cc->last = cc->window;
+	memset(&cc->window, 0, sizeof(cc->window));
+}
+
+enum congestion_decision congestion_add_transfer(struct congestion_control *cc, bool error, uint64_t bytes, double time, double latency)
+{
+	struct congestion_window *w = &cc->window;
+	size_t window_size = cc->limit ? cc->limit : 1;
+
+	w->transfers++;
+	if (error) {
+		w->errors++;
+	} else {
+		w->bytes += bytes;
+		w->time += time;
+		w->latency += latency;
+	}
+
+	if (w->transfers < window_size) {
+		return CONGESTION_KEEP;
+	}
+
+	end_window(cc);
+	if (cc->last.errors > 0 ||
+	    latency_too_high(cc, congestion_window_latency(&cc->last))) {
+		return decrease(cc);
+	}
+
+	return increase(cc);
+}
+
+enum congestion_decision congestion_backoff(struct congestion_control *cc)
+{
+	end_window(cc);
+	return decrease(cc);
+}
@@ -0,0 +1,109 @@
+#ifndef __INCLUDE_GUARD_CONGESTION_H
+#define __INCLUDE_GUARD_CONGESTION_H
+
+/**
+ * @file
+ * @brief Congestion control for parallel transfers.
+ *
+ * Limits the number of transfers running at the same time using additive
+ * increase and multiplicative decrease (AIMD). Results of completed
+ * transfers are grouped in windows of as many transfers as the current
+ * limit. At the end of each window the limit is halved if there were errors
+ * or if the latency of the transfers grew too much over the lowest latency
+ * seen so far. Otherwise the limit is increased by one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Change made to the limit of parallel transfers. */
+enum congestion_decision {
+	CONGESTION_KEEP = 0,
+	CONGESTION_INCREASE,
+	CONGESTION_DECREASE,
+};
+
+/** @brief Statistics of the transfers completed in a window. */
+struct congestion_window {
+	/** @brief Number of transfers completed. */
+	size_t transfers;
+	/** @brief Number of transfers that failed. */
+	size_t errors;
+	/** @brief Bytes received by successful transfers. */
+	uint64_t bytes;
+	/** @brief Sum of the time of successful transfers, in seconds. */
+	double time;
+	/** @brief Sum of the latency of successful transfers, in seconds. */
+	double latency;
+};
+
+/** @brief State of the congestion control. */
+struct congestion_control {
+	/** @brief Current limit of parallel transfers. */
+	size_t limit;
+	/** @brief The limit is never reduced below this value. */
+	size_t floor;
+	/** @brief The limit is never increased above this value. */
+	size_t ceiling;
+	/** @brief Lowest average latency of a window, in seconds. Zero if
+	 * there was no successful transfer yet. */
+	double base_latency;
+	/** @brief Transfers completed in the current window. */
+	struct congestion_window window;
+	/** @brief Statistics of the last window completed. */
+	struct congestion_window last;
+};
+
+/**
+ * @brief Initialize the congestion control.
+ *
+ * The limit starts at 'ceiling' and stays between 'floor' and 'ceiling'. A
+ * floor larger than the ceiling is reduced to the ceiling.
+ */
+void congestion_init(struct congestion_control *cc, size_t floor, size_t ceiling);
+
+/**
+ * @brief Account for a completed transfer.
+ *
+ * @param error True if the transfer failed because of a problem that may be
+ * caused by too many transfers, like a timeout
+ * @param bytes Number of bytes received
+ * @param time Total time of the transfer, in seconds
+ * @param latency Time between sending the request and receiving the first
+ * byte of the response, in seconds
+ *
+ * @returns The change made to the limit, if this transfer completed a
+ * window. Statistics of the window are available in cc->last.
+ */
+enum congestion_decision congestion_add_transfer(struct congestion_control *cc, bool error, uint64_t bytes, double time, double latency);
+
+/**
+ * @brief Halve the limit and start a new window, without waiting for the
+ * current one to complete.
+ *
+ * @returns CONGESTION_DECREASE or CONGESTION_KEEP if the limit is already
+ * at the floor.
+ */
+enum congestion_decision congestion_backoff(struct congestion_control *cc);
+
+/**
+ * @brief Get the average throughput of the transfers in a window, in bytes
+ * per second.
+ */
+double congestion_window_throughput(const struct congestion_window *window);
+
+/**
+ * @brief Get the average latency of the transfers in a window, in seconds.
+ */
+double congestion_window_latency(const struct congestion_window *window);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
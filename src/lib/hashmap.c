@@ -23,32 +23,68 @@
 #define _GNU_SOURCE
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 
 #include "hashmap.h"
-#include "list.h"
 #include "log.h"
 #include "macros.h"
 
-#define HASH_MASK(bits) (HASH_SIZE(bits) - 1)
+/* Start with a table of this size, at least */
+#define HASHMAP_MIN_BITS 3
 
-size_t hashmap_hash_from_string(const char *key)
+/* 2^64 divided by the golden ratio, used to spread hashes over the table */
+#define HASHMAP_FIBONACCI 0x9E3779B97F4A7C15ULL
+
+/* Constant from the MurmurHash3 finalizer */
+#define HASH_MULTIPLIER 0xff51afd7ed558ccdULL
+
+static inline uint64_t hash_mix(uint64_t hash)
 {
-	size_t hash = 0;
+	hash ^= hash >> 33;
+	hash *= HASH_MULTIPLIER;
+	hash ^= hash >> 33;
 
-	while (*key) {
-		hash = hash * 29 /* a prime number */ + *key;
-		key++;
+	return hash;
+}
+
+/* Hash strings 8 bytes at a time */
+size_t hashmap_hash_from_string(const char *key)
+{
+	size_t len = strlen(key);
+	uint64_t hash = len;
+	uint64_t word;
+
+	while (len >= sizeof(word)) {
+		memcpy(&word, key, sizeof(word));
+		hash = hash_mix(hash ^ word);
+		key += sizeof(word);
+		len -= sizeof(word);
 	}
 
-	return hash;
+	word = 0;
+	memcpy(&word, key, len);
+
+	return (size_t)hash_mix(hash ^ word);
+}
+
+static inline size_t home_slot(struct hashmap *hashmap, uint64_t hash)
+{
+	return (size_t)(hash >> (64 - hashmap->bits));
 }
 
-static inline struct list **get_hashmap_list(struct hashmap *hashmap, const void *data)
+/* Distance of the element in slot i from its home slot */
+static inline size_t probe_distance(struct hashmap *hashmap, size_t i)
 {
-	return &hashmap->map[hashmap->hash(data) & HASH_MASK(hashmap->mask_bits)];
+	return (i - home_slot(hashmap, hashmap->slots[i].hash)) & (hashmap->size - 1);
+}
+
+static inline uint64_t get_hash(struct hashmap *hashmap, const void *data)
+{
+	return (uint64_t)hashmap->hash(data) * HASHMAP_FIBONACCI;
 }
 
 static unsigned int calc_bits(size_t capacity)
@@ -68,16 +104,93 @@ static unsigned int calc_bits(size_t capacity)
 	return bits;
 }
 
+static void alloc_slots(struct hashmap *hashmap, unsigned int bits)
+{
+	hashmap->bits = bits;
+	hashmap->size = (size_t)1 << bits;
+	hashmap->slots = calloc(hashmap->size, sizeof(struct hashmap_slot));
+	ON_NULL_ABORT(hashmap->slots);
+}
+
+/* Insert an element known not to be in the hashmap, moving elements closer to
+ * their home slot out of the way. */
+static void insert_slot(struct hashmap *hashmap, struct hashmap_slot slot)
+{
+	struct hashmap_slot tmp;
+	size_t i, dist = 0;
+
+	i = home_slot(hashmap, slot.hash);
+	while (hashmap->slots[i].data) {
+		size_t cur_dist = probe_distance(hashmap, i);
+
+		if (cur_dist < dist) {
+			tmp = hashmap->slots[i];
+			hashmap->slots[i] = slot;
+			slot = tmp;
+			dist = cur_dist;
+		}
+		i = (i + 1) & (hashmap->size - 1);
+		dist++;
+	}
+
+	hashmap->slots[i] = slot;
+	hashmap->count++;
+}
+
+static void grow(struct hashmap *hashmap)
+{
+	struct hashmap_slot *old_slots = hashmap->slots;
+	size_t old_size = hashmap->size;
+	size_t i;
+
+	alloc_slots(hashmap, hashmap->bits + 1);
+	hashmap->count = 0;
+	for (i = 0; i < old_size; i++) {
+		if (old_slots[i].data) {
+			insert_slot(hashmap, old_slots[i]);
+		}
+	}
+
+	free(old_slots);
+}
+
+/* Position of the element equal to key or -1 if not found */
+static ssize_t find_slot(struct hashmap *hashmap, const void *key, uint64_t hash)
+{
+	size_t i, dist = 0;
+
+	i = home_slot(hashmap, hash);
+	while (hashmap->slots[i].data) {
+		/* Elements are sorted by distance from the home slot, so key
+		 * can't be after an element closer to its home slot */
+		if (probe_distance(hashmap, i) < dist) {
+			break;
+		}
+		if (hashmap->slots[i].hash == hash &&
+		    hashmap->equal(key, hashmap->slots[i].data)) {
+			return i;
+		}
+		i = (i + 1) & (hashmap->size - 1);
+		dist++;
+	}
+
+	return -1;
+}
+
 struct hashmap *hashmap_new(size_t capacity, hash_equal_fn_t equal, hash_fn_t hash)
 {
 	struct hashmap *hashmap;
-	unsigned int mask_bits = calc_bits(capacity);
-	size_t real_capacity = HASH_SIZE(mask_bits);
+	unsigned int bits;
 
-	hashmap = calloc(1, sizeof(struct hashmap) + real_capacity * sizeof(struct list *));
+	hashmap = calloc(1, sizeof(struct hashmap));
 	ON_NULL_ABORT(hashmap);
 
-	hashmap->mask_bits = mask_bits;
+	/* Keep the table at most 7/8 full */
+	bits = calc_bits(capacity + capacity / 7);
+	if (bits < HASHMAP_MIN_BITS) {
+		bits = HASHMAP_MIN_BITS;
+	}
+	alloc_slots(hashmap, bits);
 	hashmap->hash = hash;
 	hashmap->equal = equal;
 
@@ -86,12 +199,21 @@ struct hashmap *hashmap_new(size_t capacity, hash_equal_fn_t equal, hash_fn_t ha
 
 void hashmap_free_hash_and_data(struct hashmap *hashmap, free_data_fn_t free_data)
 {
-	int i;
+	size_t i;
 
-	for (i = 0; i < HASH_SIZE(hashmap->mask_bits); i++) {
-		list_free_list_and_data(hashmap->map[i], free_data);
+	if (!hashmap) {
+		return;
 	}
 
+	if (free_data) {
+		for (i = 0; i < hashmap->size; i++) {
+			if (hashmap->slots[i].data) {
+				free_data(hashmap->slots[i].data);
+			}
+		}
+	}
+
+	free(hashmap->slots);
 	free(hashmap);
 }
 
@@ -102,83 +224,91 @@ void hashmap_free(struct hashmap *hashmap)
 
 bool hashmap_put(struct hashmap *hashmap, void *data)
 {
-	struct list **items, *i;
+	struct hashmap_slot slot;
 
-	items = get_hashmap_list(hashmap, data);
-	for (i = *items; i; i = i->next) {
-		if (hashmap->equal(data, i->data)) {
-			return false;
-		}
+	if (!data) {
+		return false;
 	}
-	*items = list_prepend_data(*items, data);
-
-	return true;
-}
 
-static struct list *hashmap_get_internal(struct hashmap *hashmap, const void *key, bool remove)
-{
-	struct list **items, *i;
+	slot.data = data;
+	slot.hash = get_hash(hashmap, data);
+	if (find_slot(hashmap, data, slot.hash) >= 0) {
+		return false;
+	}
 
-	items = get_hashmap_list(hashmap, key);
-	for (i = *items; i; i = i->next) {
-		if (hashmap->equal(key, i->data)) {
-			void *data = i->data;
-			if (remove) {
-				//If it's the first element of the list, update head
-				if (i == *items) {
-					*items = i->next;
-				}
-				list_free_item(i, NULL);
-			}
-			return data;
-		}
+	if ((hashmap->count + 1) * 8 > hashmap->size * 7) {
+		grow(hashmap);
 	}
+	insert_slot(hashmap, slot);
 
-	return NULL;
+	return true;
 }
 
 void *hashmap_get(struct hashmap *hashmap, const void *key)
 {
-	return hashmap_get_internal(hashmap, key, false);
+	ssize_t i = find_slot(hashmap, key, get_hash(hashmap, key));
+
+	return i < 0 ? NULL : hashmap->slots[i].data;
 }
 
 void *hashmap_pop(struct hashmap *hashmap, const void *key)
 {
-	return hashmap_get_internal(hashmap, key, true);
+	ssize_t pos = find_slot(hashmap, key, get_hash(hashmap, key));
+	size_t i, next;
+	void *data;
+
+	if (pos < 0) {
+		return NULL;
+	}
+
+	i = pos;
+	data = hashmap->slots[i].data;
+
+	/* Shift the following elements back, so there are no holes between
+	 * elements and their home slot */
+	next = (i + 1) & (hashmap->size - 1);
+	while (hashmap->slots[next].data && probe_distance(hashmap, next) > 0) {
+		hashmap->slots[i] = hashmap->slots[next];
+		i = next;
+		next = (next + 1) & (hashmap->size - 1);
+	}
+	hashmap->slots[i].data = NULL;
+	hashmap->slots[i].hash = 0;
+	hashmap->count--;
+
+	return data;
 }
 
 bool hashmap_contains(struct hashmap *hashmap, const void *key)
 {
-	return hashmap_get_internal(hashmap, key, false) != NULL;
+	return find_slot(hashmap, key, get_hash(hashmap, key)) >= 0;
+}
+
+size_t hashmap_len(struct hashmap *hashmap)
+{
+	return hashmap->count;
 }
 
 void hashmap_print(struct hashmap *hashmap, void(print_data)(void *data))
 {
-	struct list *l;
-	void *out_data;
-	int i;
-	size_t count = 0;
+	size_t i;
 
 	if (!hashmap) {
 		return;
 	}
 
-	info("Hashmap (bits: %x, size: %d)\n", hashmap->mask_bits,
-	     HASH_SIZE(hashmap->mask_bits));
+	info("Hashmap (bits: %u, size: %zu)\n", hashmap->bits, hashmap->size);
 
-	for (i = 0; i < HASH_SIZE(hashmap->mask_bits); i++) {
-		info("map[%d] list(%d) {", i, list_len(hashmap->map[i]));
-		for (l = hashmap->map[i], out_data = l ? l->data : NULL;
-		     l && (out_data = l->data); l = l->next) {
-			if (print_data) {
-				print_data(out_data);
-			}
-			count++;
+	for (i = 0; i < hashmap->size; i++) {
+		if (!hashmap->slots[i].data) {
+			continue;
+		}
+		info("slot[%zu] distance(%zu) {", i, probe_distance(hashmap, i));
+		if (print_data) {
+			print_data(hashmap->slots[i].data);
 		}
 		info("}\n");
 	}
 
-	info("Total elements: %ld\n", count);
-
-	return;
+	info("Total elements: %zu\n", hashmap->count);
 }
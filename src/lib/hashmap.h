@@ -7,15 +7,13 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/** @brief Get the size of a hashmap from the number of used bits. */
-#define HASH_SIZE(bits) (1 << bits)
-
 /** @brief Callback to free data from this hashmap. */
 typedef void (*free_data_fn_t)(void *data);
 
@@ -25,23 +23,42 @@ typedef size_t (*hash_fn_t)(const void *data);
 /** @brief Callback to compare two different user's data. */
 typedef bool (*hash_equal_fn_t)(const void *a, const void *b);
 
-/** @brief Hashmap internal structure. */
+/** @brief One position of the hashmap table. */
+struct hashmap_slot {
+	/** @brief User's data, NULL if the slot is empty. */
+	void *data;
+	/** @brief Mixed hash of data, used to find its home slot. */
+	uint64_t hash;
+};
+
+/**
+ * @brief Hashmap internal structure.
+ *
+ * Elements are stored in an open addressing table using Robin Hood hashing,
+ * so the distance of any element from its home slot is kept short. The table
+ * grows when it gets 7/8 full.
+ */
 struct hashmap {
-	/** @brief Bits used in hashmap mask. */
-	unsigned int mask_bits;
-	/** @brief Save callback to get the hash from one specific data. */
+	/** @brief Bits used to get the home slot from a hash. */
+	unsigned int bits;
+	/** @brief Number of slots in the table, a power of 2. */
+	size_t size;
+	/** @brief Number of elements in the hashmap. */
+	size_t count;
+	/** @brief Save callback to compare elements. */
 	hash_equal_fn_t equal;
 	/** @brief Save the callback to get the hash from one specific data. */
 	hash_fn_t hash;
-	/** @brief Internal map structure */
-	struct list *map[];
+	/** @brief Internal table */
+	struct hashmap_slot *slots;
 };
 
 /**
  * @brief Create a new hashmap.
  *
- * Size of the hashmap will be the closest power of 2 number greater than capacity.
- * Function hash will be used as a hash function and equal to compare elements.
+ * The hashmap is created with room for capacity elements and grows when
+ * needed. Function hash will be used as a hash function and equal to compare
+ * elements.
  */
 struct hashmap *hashmap_new(size_t capacity, hash_equal_fn_t equal, hash_fn_t hash);
 
@@ -49,7 +66,7 @@ struct hashmap *hashmap_new(size_t capacity, hash_equal_fn_t equal, hash_fn_t ha
  * @brief Put an element into the hashmap, if it isn't already in the hashmap.
  *
  * @returns true if the element was added or false if the element was already
- * in the hashmap.
+ * in the hashmap. NULL can't be added to the hashmap.
  */
 bool hashmap_put(struct hashmap *hashmap, void *data);
 
@@ -82,6 +99,11 @@ void hashmap_free(struct hashmap *hashmap);
  */
 void hashmap_free_hash_and_data(struct hashmap *hashmap, free_data_fn_t free_data);
 
+/**
+ * @brief Get the number of elements in the hashmap.
+ */
+size_t hashmap_len(struct hashmap *hashmap);
+
 /**
  * @brief Hash function helper to calculate a good hash to be used with strings.
  */
@@ -95,15 +117,15 @@ void hashmap_print(struct hashmap *hashmap, void(print_data)(void *data));
 /**
  * @brief Loop through all elements in the hashmap.
  *
+ * Elements can't be added or removed from the hashmap inside the loop.
+ *
  * @param hashmap The hashmap to iterate.
  * @param i will be set with the current position on the hash table.
- * @param l will be set with the current list element.
  * @param out_data will be set with the data of the current element.
  */
-#define HASHMAP_FOREACH(hashmap, i, l, out_data)                         \
-	for (i = 0; i < HASH_SIZE(hashmap->mask_bits); i++)              \
-		for (l = hashmap->map[i], out_data = l ? l->data : NULL; \
-		     l && (out_data = l->data); l = l->next)
+#define HASHMAP_FOREACH(hashmap, i, out_data)      \
+	for (i = 0; i < (hashmap)->size; i++)      \
+		if ((out_data = (hashmap)->slots[i].data) != NULL)
 
 #ifdef __cplusplus
 }
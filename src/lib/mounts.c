@@ -0,0 +1,278 @@
+/*
+ *   Software Updater - client side
+ *
+ *      Copyright (c) 2019 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "mounts.h"
+#include "macros.h"
+#include "strings.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+/* Compare paths one component at a time, so '/' comes before any other
+ * character and "/a/b" sorts before "/a-b" */
+static int path_cmp(const char *a, const char *b)
+{
+	for (; *a && *a == *b; a++, b++) {
+	}
+
+	if (*a == *b) {
+		return 0;
+	}
+	if (*a == '\0') {
+		return -1;
+	}
+	if (*b == '\0') {
+		return 1;
+	}
+	if (*a == '/') {
+		return -1;
+	}
+	if (*b == '/') {
+		return 1;
+	}
+
+	return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+}
+
+/* Check if 'path' is 'mount' or a path under it */
+static bool is_path_in_mount(const char *mount, const char *path)
+{
+	size_t len = strlen(mount);
+
+	if (strncmp(mount, path, len) != 0) {
+		return false;
+	}
+
+	return path[len] == '\0' || path[len] == '/' || (len > 0 && mount[len - 1] == '/');
+}
+
+/* Decode the octal escape sequences used in mountinfo for spaces, tabs,
+ * new lines and backslashes, in place */
+static void unescape(char *str)
+{
+	char *out = str;
+
+	for (; *str; str++) {
+		if (str[0] == '\\' &&
+		    str[1] >= '0' && str[1] <= '3' &&
+		    str[2] >= '0' && str[2] <= '7' &&
+		    str[3] >= '0' && str[3] <= '7') {
+			*out++ = (str[1] - '0') << 6 | (str[2] - '0') << 3 | (str[3] - '0');
+			str += 3;
+		} else {
+			*out++ = *str;
+		}
+	}
+	*out = '\0';
+}
+
+/* Parse one line of mountinfo, like:
+ * 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw */
+static bool parse_line(char *line, struct mount_entry *entry)
+{
+	unsigned int major, minor;
+	char *path, *end;
+	int len = 0;
+
+	if (sscanf(line, "%d %d %u:%u %*s %n", &entry->id, &entry->parent_id, &major, &minor, &len) != 4 || len == 0) {
+		return false;
+	}
+
+	path = line + len;
+	end = strpbrk(path, " \n");
+	if (end) {
+		*end = '\0';
+	}
+	if (path[0] != '/') {
+		return false;
+	}
+
+	unescape(path);
+	entry->path = strdup_or_die(path);
+	entry->dev = makedev(major, minor);
+
+	return true;
+}
+
+struct sort_entry {
+	struct mount_entry entry;
+	size_t order;
+};
+
+static int sort_entry_cmp(const void *a, const void *b)
+{
+	const struct sort_entry *ea = a;
+	const struct sort_entry *eb = b;
+	int ret;
+
+	ret = path_cmp(ea->entry.path, eb->entry.path);
+	if (ret) {
+		return ret;
+	}
+
+	return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+/* Sort the entries, keep only the last mount on each path and link each
+ * entry to the closest one above it */
+static void build_table(struct mount_table *table, struct sort_entry *sorted, size_t len)
+{
+	size_t *stack;
+	size_t stack_len = 0;
+	size_t i;
+
+	qsort(sorted, len, sizeof(struct sort_entry), sort_entry_cmp);
+
+	table->entries = malloc((len + 1) * sizeof(struct mount_entry));
+	ON_NULL_ABORT(table->entries);
+	stack = malloc((len + 1) * sizeof(size_t));
+	ON_NULL_ABORT(stack);
+
+	for (i = 0; i < len; i++) {
+		struct mount_entry *entry;
+
+		/* Mounts on the same path are sorted by mount order */
+		if (i + 1 < len && strcmp(sorted[i].entry.path, sorted[i + 1].entry.path) == 0) {
+			free(sorted[i].entry.path);
+			continue;
+		}
+
+		entry = &table->entries[table->len];
+		*entry = sorted[i].entry;
+
+		/* Mount points under a directory are right after it, so the
+		 * parents of this entry are all in the stack */
+		while (stack_len > 0 && !is_path_in_mount(table->entries[stack[stack_len - 1]].path, entry->path)) {
+			stack_len--;
+		}
+		entry->parent = stack_len > 0 ? stack[stack_len - 1] : MOUNT_NO_PARENT;
+		stack[stack_len++] = table->len;
+		table->len++;
+	}
+
+	free(stack);
+}
+
+struct mount_table *mount_table_load(const char *filename)
+{
+	struct mount_table *table;
+	struct sort_entry *sorted = NULL;
+	size_t len = 0, size = 0;
+	char *line = NULL;
+	size_t n = 0;
+	FILE *file;
+
+	file = fopen(filename, "re");
+	if (!file) {
+		return NULL;
+	}
+
+	while (getline(&line, &n, file) >= 0) {
+		if (len == size) {
+			size = size ? size * 2 : 64;
+			sorted = realloc(sorted, size * sizeof(struct sort_entry));
+			ON_NULL_ABORT(sorted);
+		}
+
+		if (parse_line(line, &sorted[len].entry)) {
+			sorted[len].order = len;
+			len++;
+		}
+	}
+	free(line);
+	fclose(file);
+
+	table = calloc(1, sizeof(struct mount_table));
+	ON_NULL_ABORT(table);
+	build_table(table, sorted, len);
+	free(sorted);
+
+	return table;
+}
+
+void mount_table_free(struct mount_table *table)
+{
+	size_t i;
+
+	if (!table) {
+		return;
+	}
+
+	for (i = 0; i < table->len; i++) {
+		free(table->entries[i].path);
+	}
+	free(table->entries);
+	free(table);
+}
+
+/* Find the last entry that is not after 'path', or MOUNT_NO_PARENT */
+static size_t lower_bound(const struct mount_table *table, const char *path)
+{
+	size_t lo = 0, hi = table->len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (path_cmp(table->entries[mid].path, path) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo > 0 ? lo - 1 : MOUNT_NO_PARENT;
+}
+
+const struct mount_entry *mount_table_find(const struct mount_table *table, const char *path)
+{
+	size_t i;
+
+	if (!table) {
+		return NULL;
+	}
+
+	i = lower_bound(table, path);
+	if (i != MOUNT_NO_PARENT && strcmp(table->entries[i].path, path) == 0) {
+		return &table->entries[i];
+	}
+
+	return NULL;
+}
+
+const struct mount_entry *mount_table_find_containing(const struct mount_table *table, const char *path)
+{
+	size_t i;
+
+	if (!table) {
+		return NULL;
+	}
+
+	/* Entries between the deepest mount above path and path itself are
+	 * all under that mount, so it's one of the parents of this entry */
+	for (i = lower_bound(table, path); i != MOUNT_NO_PARENT; i = table->entries[i].parent) {
+		if (is_path_in_mount(table->entries[i].path, path)) {
+			return &table->entries[i];
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,83 @@
+#ifndef __INCLUDE_GUARD_MOUNTS_H
+#define __INCLUDE_GUARD_MOUNTS_H
+
+/**
+ * @file
+ * @brief Table of the mount points of the system.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Index used when a mount has no parent in the table. */
+#define MOUNT_NO_PARENT ((size_t)-1)
+
+/** @brief One mount point, as read from mountinfo. */
+struct mount_entry {
+	/** @brief Mount point, with escape sequences decoded. */
+	char *path;
+	/** @brief Unique id of the mount. */
+	int id;
+	/** @brief Id of the parent mount. */
+	int parent_id;
+	/** @brief Device of the file system mounted. */
+	dev_t dev;
+	/** @brief Index of the closest mount point above this one in the
+	 * table, or MOUNT_NO_PARENT. */
+	size_t parent;
+};
+
+/**
+ * @brief The mount points, sorted by path.
+ *
+ * Paths are compared one component at a time, so all mount points under a
+ * directory come right after it. When more than one file system is mounted
+ * on the same path only the last one, which is the one visible, is kept.
+ */
+struct mount_table {
+	struct mount_entry *entries;
+	size_t len;
+};
+
+/**
+ * @brief Load the mount table from a mountinfo file, like
+ * /proc/self/mountinfo.
+ *
+ * @returns The table or NULL if the file can't be read.
+ * @note Free the table with mount_table_free()
+ */
+struct mount_table *mount_table_load(const char *filename);
+
+/**
+ * @brief Free the mount table.
+ */
+void mount_table_free(struct mount_table *table);
+
+/**
+ * @brief Find the mount point at 'path'.
+ *
+ * @returns The mount or NULL if 'path' isn't a mount point.
+ */
+const struct mount_entry *mount_table_find(const struct mount_table *table, const char *path);
+
+/**
+ * @brief Find the mount point of the file system 'path' is on, which is
+ * either 'path' itself or the deepest mount point above it.
+ *
+ * 'path' doesn't need to exist. No memory is allocated and the time taken
+ * is logarithmic in the number of mounts.
+ *
+ * @returns The mount or NULL if no mount point contains 'path'.
+ */
+const struct mount_entry *mount_table_find_containing(const struct mount_table *table, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,6 +17,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "sys.h"
 #include "list.h"
 #include "log.h"
@@ -147,6 +149,54 @@ long get_available_space(const char *path)
 	return stat.f_bsize * stat.f_bavail;
 }
 
+long get_available_memory(void)
+{
+	char line[256];
+	long pages, page_size;
+	long mem = -1;
+	FILE *f;
+
+	/* MemAvailable also accounts for memory that can be reclaimed */
+	f = fopen("/proc/meminfo", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "MemAvailable: %ld kB", &mem) == 1) {
+				mem *= 1024;
+				break;
+			}
+		}
+		fclose(f);
+	}
+
+	if (mem >= 0) {
+		return mem;
+	}
+
+	pages = sysconf(_SC_AVPHYS_PAGES);
+	page_size = sysconf(_SC_PAGESIZE);
+	if (pages < 0 || page_size < 0) {
+		return -1;
+	}
+
+	return pages * page_size;
+}
+
+void sync_filesystem(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		sync();
+		return;
+	}
+
+	if (syncfs(fd) < 0) {
+		sync();
+	}
+	close(fd);
+}
+
 int copy_all(const char *src, const char *dst)
 {
 	return run_command_quiet("/bin/cp", "-a", src, dst, NULL);
@@ -27,6 +27,18 @@ extern "C" {
  */
 long get_available_space(const char *path);
 
+/**
+ * @brief Return the memory available for new processes in bytes, or -1 if
+ * it can't be determined.
+ */
+long get_available_memory(void);
+
+/**
+ * @brief Commit the filesystem containing path to disk, or all filesystems
+ * if that's not possible.
+ */
+void sync_filesystem(const char *path);
+
 /**
  * @brief Runs a command redirecting the standard and error outputs redirected
  * to /dev/null.
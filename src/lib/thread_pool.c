@@ -22,65 +22,506 @@
 
 #define _GNU_SOURCE
 
-#include <errno.h>
-#include <fcntl.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "log.h"
 #include "macros.h"
 #include "thread_pool.h"
 
 /*
- * To keep this thread pool implementation simple, pipes were used instead of
- * mutex locks using the fact that read() and write() operations are thread safe.
- * So in order to schedule a task to be executed we just need to write() a task
- * in to the pipe and the first thread to read() that data will execute the
- * processing.
+ * Each thread has its own deque of tasks (Chase-Lev work stealing deque).
+ * Tasks scheduled by a task running in the pool are pushed to the deque of
+ * the thread running it and the owner takes tasks from the bottom without
+ * locks. Idle threads steal tasks from the top of the other deques.
+ *
+ * Tasks scheduled from outside the pool are added to a shared queue protected
+ * by a mutex. Threads move them to their own deques in batches, where they
+ * can be stolen by other threads.
+ *
+ * Threads without work sleep on a condition variable. Threads waiting for
+ * tasks to complete with tp_wait() or tp_group_wait() also run tasks while
+ * they wait.
  */
 
-struct tp {
-	int num_threads;
-	int pipe_fds[2];
-	pthread_t threads[];
-};
+/* Initial number of tasks in a deque, grows as needed */
+#define DEQUE_INITIAL_SIZE 256
+
+/* Maximum number of tasks moved from the shared queue to a deque at once */
+#define INJECT_BATCH 32
+
+#define CACHE_LINE 64
 
 struct task {
 	tp_task_run_t run;
 	void *data;
+	struct tp_group *group;
+};
+
+struct deque_array {
+	int64_t size;
+	struct deque_array *prev; /* previous arrays, freed with the deque */
+	struct task tasks[];
+};
+
+struct deque {
+	int64_t top __attribute__((aligned(CACHE_LINE)));
+	int64_t bottom __attribute__((aligned(CACHE_LINE)));
+	struct deque_array *array;
+};
+
+struct worker {
+	struct deque deque;
+	struct tp *tp;
+	pthread_t thread;
+	uint32_t seed; /* used to pick a random victim to steal from */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct tp_group {
+	struct tp *tp;
+	unsigned long pending;
+};
+
+struct tp {
+	int num_threads;
+	unsigned long pending; /* tasks scheduled and not completed */
+	unsigned int sleeping; /* threads waiting on cond */
+	bool stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* Ring buffer of tasks scheduled from outside the pool */
+	struct task *inject;
+	size_t inject_head;
+	size_t inject_count;
+	size_t inject_size;
+
+	struct worker *workers;
+};
+
+/* Worker running in the current thread, if any */
+static __thread struct worker *current_worker;
+
+static struct deque_array *deque_array_new(int64_t size)
+{
+	struct deque_array *array;
+
+	array = malloc(sizeof(struct deque_array) + size * sizeof(struct task));
+	ON_NULL_ABORT(array);
+	array->size = size;
+	array->prev = NULL;
+
+	return array;
+}
+
+/* Tasks are read by thieves while the owner may write them, so access all
+ * fields atomically. The values read are only used if the thief wins the race
+ * to take the task. */
+static inline void task_store(struct deque_array *array, int64_t i, const struct task *task)
+{
+	struct task *t = &array->tasks[i & (array->size - 1)];
+
+	__atomic_store_n(&t->run, task->run, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->data, task->data, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->group, task->group, __ATOMIC_RELAXED);
+}
+
+static inline void task_load(struct deque_array *array, int64_t i, struct task *task)
+{
+	struct task *t = &array->tasks[i & (array->size - 1)];
+
+	task->run = __atomic_load_n(&t->run, __ATOMIC_RELAXED);
+	task->data = __atomic_load_n(&t->data, __ATOMIC_RELAXED);
+	task->group = __atomic_load_n(&t->group, __ATOMIC_RELAXED);
+}
+
+static void deque_init(struct deque *deque)
+{
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->array = deque_array_new(DEQUE_INITIAL_SIZE);
+}
+
+static void deque_free(struct deque *deque)
+{
+	struct deque_array *array, *prev;
+
+	for (array = deque->array; array; array = prev) {
+		prev = array->prev;
+		free(array);
+	}
+}
+
+/* Only called by the owner */
+static void deque_push(struct deque *deque, const struct task *task)
+{
+	struct deque_array *array, *new_array;
+	int64_t b, t, i;
+
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+	if (b - t > array->size - 1) {
+		/* Thieves may still be reading the old array, so keep it */
+		new_array = deque_array_new(array->size * 2);
+		for (i = t; i < b; i++) {
+			struct task tmp;
+
+			task_load(array, i, &tmp);
+			task_store(new_array, i, &tmp);
+		}
+		new_array->prev = array;
+		__atomic_store_n(&deque->array, new_array, __ATOMIC_RELEASE);
+		array = new_array;
+	}
+
+	task_store(array, b, task);
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/* Only called by the owner */
+static bool deque_take(struct deque *deque, struct task *task)
+{
+	struct deque_array *array;
+	int64_t b, t;
+	bool found = true;
+
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		/* Empty */
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	task_load(array, b, task);
+	if (t == b) {
+		/* Last task, race with thieves */
+		if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+						 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			found = false;
+		}
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+
+	return found;
+}
+
+enum steal_result {
+	STEAL_EMPTY,
+	STEAL_ABORT, /* lost a race, the deque may still have tasks */
+	STEAL_SUCCESS,
 };
 
+static enum steal_result deque_steal(struct deque *deque, struct task *task)
+{
+	struct deque_array *array;
+	int64_t b, t;
+
+	t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b) {
+		return STEAL_EMPTY;
+	}
+
+	array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+	task_load(array, t, task);
+	if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return STEAL_ABORT;
+	}
+
+	return STEAL_SUCCESS;
+}
+
+static bool deque_is_empty(struct deque *deque)
+{
+	int64_t t, b;
+
+	t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	return t >= b;
+}
+
+/* Must be called with tp->lock held */
+static bool has_work(struct tp *tp)
+{
+	int i;
+
+	if (tp->inject_count > 0) {
+		return true;
+	}
+
+	for (i = 0; i < tp->num_threads; i++) {
+		if (!deque_is_empty(&tp->workers[i].deque)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Wake up one sleeping thread after a task was added */
+static void notify(struct tp *tp)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&tp->sleeping, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&tp->lock);
+		pthread_cond_signal(&tp->cond);
+		pthread_mutex_unlock(&tp->lock);
+	}
+}
+
+/* Must be called with tp->lock held */
+static void inject_push(struct tp *tp, const struct task *task)
+{
+	if (tp->inject_count == tp->inject_size) {
+		struct task *inject;
+		size_t size = tp->inject_size ? tp->inject_size * 2 : DEQUE_INITIAL_SIZE;
+		size_t i;
+
+		inject = malloc(size * sizeof(struct task));
+		ON_NULL_ABORT(inject);
+		for (i = 0; i < tp->inject_count; i++) {
+			inject[i] = tp->inject[(tp->inject_head + i) % tp->inject_size];
+		}
+		free(tp->inject);
+		tp->inject = inject;
+		tp->inject_head = 0;
+		tp->inject_size = size;
+	}
+
+	tp->inject[(tp->inject_head + tp->inject_count) % tp->inject_size] = *task;
+	__atomic_store_n(&tp->inject_count, tp->inject_count + 1, __ATOMIC_RELAXED);
+}
+
+/* Take a task from the shared queue. Workers move a batch of tasks to their
+ * own deque, so other threads can steal them. */
+static bool inject_take(struct tp *tp, struct worker *self, struct task *task)
+{
+	size_t batch, i;
+
+	if (__atomic_load_n(&tp->inject_count, __ATOMIC_RELAXED) == 0) {
+		return false;
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	if (tp->inject_count == 0) {
+		pthread_mutex_unlock(&tp->lock);
+		return false;
+	}
+
+	/* Leave some tasks for the other threads */
+	batch = 1;
+	if (self) {
+		batch = (tp->inject_count + tp->num_threads - 1) / tp->num_threads;
+		if (batch > INJECT_BATCH) {
+			batch = INJECT_BATCH;
+		}
+	}
+
+	*task = tp->inject[tp->inject_head];
+	for (i = 1; i < batch; i++) {
+		deque_push(&self->deque, &tp->inject[(tp->inject_head + i) % tp->inject_size]);
+	}
+	tp->inject_head = (tp->inject_head + batch) % tp->inject_size;
+	__atomic_store_n(&tp->inject_count, tp->inject_count - batch, __ATOMIC_RELAXED);
+
+	if (batch > 1 && tp->sleeping > 0) {
+		pthread_cond_signal(&tp->cond);
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	return true;
+}
+
+static bool steal(struct tp *tp, struct worker *self, struct task *task)
+{
+	enum steal_result result;
+	uint32_t start = 0;
+	int i;
+
+	if (self) {
+		/* xorshift */
+		self->seed ^= self->seed << 13;
+		self->seed ^= self->seed >> 17;
+		self->seed ^= self->seed << 5;
+		start = self->seed;
+	}
+
+	do {
+		result = STEAL_EMPTY;
+		for (i = 0; i < tp->num_threads; i++) {
+			struct worker *victim = &tp->workers[(start + i) % tp->num_threads];
+			enum steal_result r;
+
+			if (victim == self) {
+				continue;
+			}
+
+			r = deque_steal(&victim->deque, task);
+			if (r == STEAL_SUCCESS) {
+				return true;
+			}
+			if (r == STEAL_ABORT) {
+				result = STEAL_ABORT;
+			}
+		}
+	} while (result == STEAL_ABORT);
+
+	return false;
+}
+
+static bool get_task(struct tp *tp, struct task *task)
+{
+	struct worker *self = current_worker;
+
+	if (self && self->tp != tp) {
+		/* Waiting on another pool from one of our tasks */
+		self = NULL;
+	}
+
+	if (self && deque_take(&self->deque, task)) {
+		return true;
+	}
+
+	return inject_take(tp, self, task) || steal(tp, self, task);
+}
+
+static void task_done(struct tp *tp, struct tp_group *group)
+{
+	bool wake = false;
+
+	if (group && __atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		wake = true;
+	}
+	if (__atomic_sub_fetch(&tp->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		wake = true;
+	}
+
+	if (wake) {
+		pthread_mutex_lock(&tp->lock);
+		pthread_cond_broadcast(&tp->cond);
+		pthread_mutex_unlock(&tp->lock);
+	}
+}
+
+static void run_task(struct tp *tp, struct task *task)
+{
+	task->run(task->data);
+	task_done(tp, task->group);
+}
+
+/* Sleep until there's work to do, the pool stops or pending (if not NULL)
+ * gets to zero. */
+static void idle_wait(struct tp *tp, unsigned long *pending)
+{
+	pthread_mutex_lock(&tp->lock);
+	__atomic_add_fetch(&tp->sleeping, 1, __ATOMIC_SEQ_CST);
+	/* Pairs with the fence in notify(), so either we see the new task or
+	 * the thread that added it sees us sleeping */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!has_work(tp) && !tp->stop &&
+	    (!pending || __atomic_load_n(pending, __ATOMIC_ACQUIRE) > 0)) {
+		pthread_cond_wait(&tp->cond, &tp->lock);
+	}
+
+	__atomic_sub_fetch(&tp->sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&tp->lock);
+}
+
 static void *thread_run(void *data)
 {
-	int *fd;
-	ssize_t r;
+	struct worker *self = data;
+	struct tp *tp = self->tp;
 	struct task task;
 
-	fd = data;
+	current_worker = self;
 
 	while (1) {
-		r = read(*fd, &task, sizeof(task));
-		if (r == 0) {
-			// EOF: Close thread
-			return NULL;
-		} else if (r < 0 || r != sizeof(task)) {
-			if (errno == EINTR) {
-				// Not an error, we can continue
-				continue;
-			}
-			error("Thread communication failed: %d - %s\n",
-			      errno, strerror(errno));
-			return NULL;
+		if (get_task(tp, &task)) {
+			run_task(tp, &task);
+			continue;
 		}
 
-		// Run task
-		task.run(task.data);
+		pthread_mutex_lock(&tp->lock);
+		if (tp->stop && !has_work(tp)) {
+			pthread_mutex_unlock(&tp->lock);
+			break;
+		}
+		pthread_mutex_unlock(&tp->lock);
+
+		idle_wait(tp, NULL);
 	}
+
+	current_worker = NULL;
 	return NULL;
 }
 
+static int schedule(struct tp *tp, struct tp_group *group, tp_task_run_t run, void *data)
+{
+	struct worker *self = current_worker;
+	struct task task;
+
+	if (tp->num_threads == 0) {
+		// Run task
+		run(data);
+		return 0;
+	}
+
+	task.run = run;
+	task.data = data;
+	task.group = group;
+
+	if (group) {
+		__atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&tp->pending, 1, __ATOMIC_RELAXED);
+
+	if (self && self->tp == tp) {
+		deque_push(&self->deque, &task);
+		notify(tp);
+		return 0;
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	inject_push(tp, &task);
+	if (tp->sleeping > 0) {
+		pthread_cond_signal(&tp->cond);
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	return 0;
+}
+
+/* Run tasks until pending gets to zero */
+static void wait_pending(struct tp *tp, unsigned long *pending)
+{
+	struct task task;
+
+	while (__atomic_load_n(pending, __ATOMIC_ACQUIRE) > 0) {
+		if (get_task(tp, &task)) {
+			run_task(tp, &task);
+			continue;
+		}
+
+		idle_wait(tp, pending);
+	}
+}
+
 struct tp *tp_start(int num_threads)
 {
 	int i;
@@ -91,7 +532,7 @@ struct tp *tp_start(int num_threads)
 		return NULL;
 	}
 
-	tp = calloc(1, sizeof(struct tp) + num_threads * sizeof(pthread_t *));
+	tp = calloc(1, sizeof(struct tp));
 	ON_NULL_ABORT(tp);
 
 	tp->num_threads = num_threads;
@@ -100,17 +541,23 @@ struct tp *tp_start(int num_threads)
 		return tp;
 	}
 
-	// Create threads communication
-	if (pipe2(tp->pipe_fds, O_DIRECT | O_CLOEXEC) < 0) {
-		debug("No support for pipe2(..., O_DIRECT | O_CLOEXEC) syscall\n");
-		debug("Error %d - %s\n", errno, strerror(errno));
-		goto error;
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_cond_init(&tp->cond, NULL);
+
+	tp->workers = aligned_alloc(CACHE_LINE, num_threads * sizeof(struct worker));
+	ON_NULL_ABORT(tp->workers);
+	memset(tp->workers, 0, num_threads * sizeof(struct worker));
+	for (i = 0; i < num_threads; i++) {
+		deque_init(&tp->workers[i].deque);
+		tp->workers[i].tp = tp;
+		tp->workers[i].seed = i + 1;
 	}
 
 	// Create threads
 	for (i = 0; i < num_threads; i++) {
-		if (pthread_create(&tp->threads[i], NULL, thread_run, &tp->pipe_fds[0]) != 0) {
-			tp->num_threads = i;
+		int ret = pthread_create(&tp->workers[i].thread, NULL, thread_run, &tp->workers[i]);
+		if (ret != 0) {
+			debug("Thread creation failed: %d - %s\n", ret, strerror(ret));
 			goto error_threads;
 		}
 	}
@@ -118,43 +565,35 @@ struct tp *tp_start(int num_threads)
 	return tp;
 
 error_threads:
-	tp_complete(tp);
-	return NULL;
-
-error:
+	pthread_mutex_lock(&tp->lock);
+	tp->stop = true;
+	pthread_cond_broadcast(&tp->cond);
+	pthread_mutex_unlock(&tp->lock);
+	while (i > 0) {
+		pthread_join(tp->workers[--i].thread, NULL);
+	}
+	for (i = 0; i < num_threads; i++) {
+		deque_free(&tp->workers[i].deque);
+	}
+	free(tp->workers);
+	pthread_cond_destroy(&tp->cond);
+	pthread_mutex_destroy(&tp->lock);
 	free(tp);
 	return NULL;
 }
 
 int tp_task_schedule(struct tp *tp, tp_task_run_t run, void *data)
 {
-	int r = -1;
-	struct task task;
-
-	if (tp->num_threads == 0) {
-		// Run task
-		run(data);
-		return 0;
-	}
-
-	// Use threads
-	task.run = run;
-	task.data = data;
+	return schedule(tp, NULL, run, data);
+}
 
-	while (r < 0) {
-		r = write(tp->pipe_fds[1], &task, sizeof(task));
-		if (r < 0) {
-			if (errno == EINTR) {
-				// Not an error, we can continue
-				continue;
-			}
-			error("Thread pool task scheduling failed: %d - %s\n",
-			      errno, strerror(errno));
-			return r;
-		}
+void tp_wait(struct tp *tp)
+{
+	if (!tp || tp->num_threads == 0) {
+		return;
 	}
 
-	return 0;
+	wait_pending(tp, &tp->pending);
 }
 
 void tp_complete(struct tp *tp)
@@ -168,14 +607,24 @@ void tp_complete(struct tp *tp)
 		goto free_tp;
 	}
 
-	// Close pipe so threads will get an EOF when all tasks are completed
-	close(tp->pipe_fds[1]);
+	tp_wait(tp);
+
+	pthread_mutex_lock(&tp->lock);
+	tp->stop = true;
+	pthread_cond_broadcast(&tp->cond);
+	pthread_mutex_unlock(&tp->lock);
 
 	for (i = 0; i < tp->num_threads; i++) {
-		pthread_join(tp->threads[i], NULL);
+		pthread_join(tp->workers[i].thread, NULL);
 	}
 
-	close(tp->pipe_fds[0]);
+	for (i = 0; i < tp->num_threads; i++) {
+		deque_free(&tp->workers[i].deque);
+	}
+	free(tp->workers);
+	free(tp->inject);
+	pthread_cond_destroy(&tp->cond);
+	pthread_mutex_destroy(&tp->lock);
 
 free_tp:
 	free(tp);
@@ -190,3 +639,38 @@ int tp_get_num_threads(struct tp *tp)
 
 	return tp->num_threads;
 }
+
+struct tp_group *tp_group_new(struct tp *tp)
+{
+	struct tp_group *group;
+
+	group = calloc(1, sizeof(struct tp_group));
+	ON_NULL_ABORT(group);
+	group->tp = tp;
+
+	return group;
+}
+
+int tp_group_task_schedule(struct tp_group *group, tp_task_run_t run, void *data)
+{
+	return schedule(group->tp, group, run, data);
+}
+
+void tp_group_wait(struct tp_group *group)
+{
+	if (!group || group->tp->num_threads == 0) {
+		return;
+	}
+
+	wait_pending(group->tp, &group->pending);
+}
+
+void tp_group_free(struct tp_group *group)
+{
+	if (!group) {
+		return;
+	}
+
+	tp_group_wait(group);
+	free(group);
+}
@@ -11,6 +11,9 @@
 /** @brief Internal information about the thread pool. */
 struct tp;
 
+/** @brief A set of tasks that can be waited for with tp_group_wait(). */
+struct tp_group;
+
 /**
  * Thread task function type definition.
  */
@@ -28,12 +31,22 @@ struct tp *tp_start(int num_threads);
 /**
  * @brief Schedule a task to be run in this thread pool.
  *
+ * Tasks can also be scheduled by other tasks running in the same pool.
+ *
  * @param tp The thread pool
  * @param run Callback to be executed in a new thread.
  * @param data Data informed to callback.
  */
 int tp_task_schedule(struct tp *tp, tp_task_run_t run, void *data);
 
+/**
+ * @brief Wait for all scheduled tasks to be completed, without stopping the
+ * threads.
+ *
+ * The calling thread runs scheduled tasks while it waits.
+ */
+void tp_wait(struct tp *tp);
+
 /**
  * @brief Wait for all scheduled tasks to be completed, finishes all threads and
  * release all memory used by the thread pool.
@@ -45,6 +58,31 @@ void tp_complete(struct tp *tp);
  */
 int tp_get_num_threads(struct tp *tp);
 
-//TODO: Implement a tp_wait() function
+/**
+ * @brief Create a new group of tasks for this thread pool.
+ * @note Free group with tp_group_free()
+ */
+struct tp_group *tp_group_new(struct tp *tp);
+
+/**
+ * @brief Schedule a task to be run in the thread pool of this group.
+ * @param group The group the task belongs to
+ * @param run Callback to be executed in a new thread.
+ * @param data Data informed to callback.
+ */
+int tp_group_task_schedule(struct tp_group *group, tp_task_run_t run, void *data);
+
+/**
+ * @brief Wait for all tasks scheduled in this group to be completed.
+ *
+ * Other tasks in the pool may still be running. The calling thread runs
+ * scheduled tasks while it waits, so it can be called from a task.
+ */
+void tp_group_wait(struct tp_group *group);
+
+/**
+ * @brief Wait for the tasks in the group and release its memory.
+ */
+void tp_group_free(struct tp_group *group);
 
 #endif
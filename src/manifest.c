@@ -36,6 +36,8 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "lib/thread_pool.h"
+#include "manifest_cache.h"
 #include "signature.h"
 #include "swupd.h"
 #include "swupd_build_variant.h"
@@ -43,6 +45,9 @@
 
 #define MANIFEST_LINE_MAXLEN 8192
 
+/* Maximum number of bundle manifests downloaded at the same time */
+#define MAX_XFER 15
+
 /* sort by full path filename */
 int file_sort_filename(const void *a, const void *b)
 {
@@ -80,13 +85,17 @@ int file_sort_filename_reverse(const void *a, const void *b)
 int file_sort_hash(const void *a, const void *b)
 {
 	struct file *A, *B;
-	int ret;
+	uint64_t prefix_a, prefix_b;
 	A = (struct file *)a;
 	B = (struct file *)b;
 
-	ret = strcmp(A->hash, B->hash);
+	prefix_a = hash_prefix(&A->hash);
+	prefix_b = hash_prefix(&B->hash);
+	if (prefix_a != prefix_b) {
+		return prefix_a < prefix_b ? -1 : 1;
+	}
 
-	return ret;
+	return memcmp(A->hash.bytes, B->hash.bytes, SWUPD_DIGEST_LEN);
 }
 
 static struct manifest *manifest_from_file(int version, char *component, bool header_only, bool is_mix)
@@ -132,47 +141,40 @@ static struct manifest *manifest_from_file(int version, char *component, bool he
 	return manifest;
 }
 
-static int try_manifest_delta_download(int from, int to, char *component)
+static bool manifest_delta_supported(int from, int to, const char *component)
 {
-	char *from_manifest = NULL;
-	char *to_manifest = NULL;
-	char *manifest_delta = NULL;
-	char *to_dir = NULL;
-	char *url = NULL;
-	int ret = 0;
-
 	if (from <= 0 || from > to) {
 		// We don't have deltas for going back
-		return -1;
+		return false;
 	}
 
 	if (strcmp(component, "MoM") == 0) {
 		// We don't do MoM deltas.
-		return -1;
+		return false;
 	}
 
 	if (strcmp(component, "full") == 0) {
 		// We don't do full manifest deltas.
-		return -1;
+		return false;
 	}
 
+	return true;
+}
+
+/* Apply the manifest delta already downloaded to the state directory */
+static int apply_manifest_delta(int from, int to, const char *component)
+{
+	char *from_manifest = NULL;
+	char *to_manifest = NULL;
+	char *manifest_delta = NULL;
+	char *to_dir = NULL;
+	int ret;
+
 	string_or_die(&from_manifest, "%s/%i/Manifest.%s", state_dir, from, component);
 	string_or_die(&to_manifest, "%s/%i/Manifest.%s", state_dir, to, component);
 	string_or_die(&manifest_delta, "%s/Manifest-%s-delta-from-%i-to-%i", state_dir, component, from, to);
 	string_or_die(&to_dir, "%s/%i", state_dir, to);
 
-	if (!file_exists(manifest_delta)) {
-		string_or_die(&url, "%s/%i/Manifest-%s-delta-from-%i", content_url, to, component, from);
-		ret = swupd_curl_get_file(url, manifest_delta);
-		free_string(&url);
-		if (ret != 0) {
-			unlink(manifest_delta);
-			goto out;
-		}
-	}
-
-	/* Now apply the manifest delta */
-
 	mkdir_p(to_dir); // Create destination dir if necessary
 	ret = apply_bsdiff_delta(from_manifest, to_manifest, manifest_delta);
 	if (ret != 0) {
@@ -194,6 +196,36 @@ out:
 	return ret;
 }
 
+static int try_manifest_delta_download(int from, int to, char *component)
+{
+	char *manifest_delta = NULL;
+	char *url = NULL;
+	int ret = 0;
+
+	if (!manifest_delta_supported(from, to, component)) {
+		return -1;
+	}
+
+	string_or_die(&manifest_delta, "%s/Manifest-%s-delta-from-%i-to-%i", state_dir, component, from, to);
+
+	if (!file_exists(manifest_delta)) {
+		string_or_die(&url, "%s/%i/Manifest-%s-delta-from-%i", content_url, to, component, from);
+		ret = swupd_curl_get_file(url, manifest_delta);
+		free_string(&url);
+		if (ret != 0) {
+			unlink(manifest_delta);
+			goto out;
+		}
+	}
+
+	/* Now apply the manifest delta */
+	ret = apply_manifest_delta(from, to, component);
+
+out:
+	free_string(&manifest_delta);
+	return ret;
+}
+
 /* TODO: This should deal with nested manifests better */
 static int retrieve_manifest(int previous_version, int version, char *component, bool is_mix)
 {
@@ -288,9 +320,10 @@ static void set_untracked_manifest_files(struct manifest *manifest)
 
 /* Removes the extracted Manifest.<bundle> and accompanying tar file, cache file, and
  * the signature file */
-static void remove_manifest_files(char *filename, int version, char *hash)
+static void remove_manifest_files(char *filename, int version, const union swupd_hash *hash)
 {
 	char *file;
+	char hex[SWUPD_HASH_LEN];
 
 	warn("Removing corrupt Manifest.%s artifacts and re-downloading...\n", filename);
 	string_or_die(&file, "%s/%i/Manifest.%s", state_dir, version, filename);
@@ -303,7 +336,11 @@ static void remove_manifest_files(char *filename, int version, char *hash)
 	unlink(file);
 	free_string(&file);
 	if (hash != NULL) {
-		string_or_die(&file, "%s/%i/Manifest.%s.%s", state_dir, version, filename, hash);
+		hash_to_hex(hash, hex);
+		string_or_die(&file, "%s/%i/Manifest.%s.%s", state_dir, version, filename, hex);
+		unlink(file);
+		free_string(&file);
+		string_or_die(&file, "%s/%i/Manifest.%s.%s" MANIFEST_CACHE_SUFFIX, state_dir, version, filename, hex);
 		unlink(file);
 		free_string(&file);
 	}
@@ -450,6 +487,66 @@ retry_load:
 	return manifest;
 }
 
+/* The pre-parsed manifest cache is named after the manifest hash in the MoM */
+static char *manifest_cache_filename(int version, struct file *file)
+{
+	char hash[SWUPD_HASH_LEN];
+	char *filename;
+
+	hash_to_hex(&file->hash, hash);
+	string_or_die(&filename, "%s/%i/Manifest.%s.%s" MANIFEST_CACHE_SUFFIX, state_dir, version, file->filename, hash);
+
+	return filename;
+}
+
+static bool manifest_cache_exists(int version, struct file *file)
+{
+	char *filename;
+	bool ret;
+
+	filename = manifest_cache_filename(version, file);
+	ret = file_exists(filename);
+	free_string(&filename);
+
+	return ret;
+}
+
+static struct manifest *load_cached_manifest(int version, struct file *file, bool header_only)
+{
+	struct manifest *manifest;
+	char *filename;
+
+	/* Mix manifests are local, there's no need to cache them */
+	if (file->is_mix) {
+		return NULL;
+	}
+
+	filename = manifest_cache_filename(version, file);
+	manifest = manifest_cache_load(file->filename, filename, header_only);
+	free_string(&filename);
+
+	if (manifest && manifest->version != version) {
+		free_manifest(manifest);
+		return NULL;
+	}
+
+	return manifest;
+}
+
+/* Save a manifest that was just parsed and verified */
+static void store_cached_manifest(int version, struct file *file, struct manifest *manifest)
+{
+	char *filename;
+
+	if (file->is_mix) {
+		return;
+	}
+
+	filename = manifest_cache_filename(version, file);
+	manifest_cache_store(manifest, filename);
+	free_string(&filename);
+}
+
 /* Loads the MANIFEST for bundle associated with FILE at VERSION, referenced by
  * the given MOM manifest.
  *
@@ -465,6 +562,11 @@ struct manifest *load_manifest(int version, struct file *file, struct manifest *
 	int prev_version;
 	bool retried = false;
 
+	manifest = load_cached_manifest(version, file, header_only);
+	if (manifest) {
+		goto out;
+	}
+
 retry_load:
 	prev_version = file->peer ? file->peer->last_change : 0;
 	ret = retrieve_manifest(prev_version, version, file->filename, file->is_mix);
@@ -482,7 +584,7 @@ retry_load:
 
 	if (ret != 0) {
 		if (retried == false) {
-			remove_manifest_files(file->filename, version, file->hash);
+			remove_manifest_files(file->filename, version, &file->hash);
 			retried = true;
 			goto retry_load;
 		}
@@ -496,7 +598,7 @@ retry_load:
 
 	if (manifest == NULL) {
 		if (retried == false) {
-			remove_manifest_files(file->filename, version, file->hash);
+			remove_manifest_files(file->filename, version, &file->hash);
 			retried = true;
 			goto retry_load;
 		}
@@ -507,6 +609,11 @@ retry_load:
 		return NULL;
 	}
 
+	if (!header_only) {
+		store_cached_manifest(version, file, manifest);
+	}
+
+out:
 	set_untracked_manifest_files(manifest);
 
 	return manifest;
@@ -576,7 +683,7 @@ struct list *create_update_list(struct manifest *server)
 		    file->is_file == file->peer->is_file &&
 		    file->is_dir == file->peer->is_dir &&
 		    file->is_link == file->peer->is_link &&
-		    hash_equal(file->hash, file->peer->hash)) {
+		    hash_equal(&file->hash, &file->peer->hash)) {
 			if (file->last_change == file->peer->last_change) {
 				/* Nothing to do; the file did not change */
 				continue;
@@ -735,14 +842,317 @@ void link_submanifests(struct manifest *m1, struct manifest *m2, struct list *su
 	}
 }
 
+/* A bundle manifest being loaded by load_bundle_manifests() */
+struct bundle_manifest {
+	struct file *file;
+	struct manifest *mom;
+	struct manifest *manifest;
+	bool header_only;
+	int from; /* version of the manifest delta being downloaded, or 0 */
+	manifest_process_fn process; /* called from the thread pool, if set */
+	void *data;
+	size_t index;
+	bool processed;
+};
+
+static bool bundle_manifest_exists(struct bundle_manifest *bundle)
+{
+	char *filename;
+	bool ret;
+
+	string_or_die(&filename, "%s/%i/Manifest.%s", state_dir, bundle->file->last_change, bundle->file->filename);
+	ret = file_exists(filename);
+	free_string(&filename);
+
+	return ret;
+}
+
+static bool bundle_manifest_download_successful(void *data)
+{
+	struct bundle_manifest *bundle = data;
+	struct file *file = bundle->file;
+	char *filename, *dir;
+
+	/* Failures are not fatal, load_manifest() retries them later */
+	if (bundle->from) {
+		apply_manifest_delta(bundle->from, file->last_change, file->filename);
+		return true;
+	}
+
+	string_or_die(&dir, "%s/%i", state_dir, file->last_change);
+	string_or_die(&filename, "%s/%i/Manifest.%s.tar", state_dir, file->last_change, file->filename);
+	if (archives_extract_to(filename, dir) == 0) {
+		unlink(filename);
+	}
+	free_string(&filename);
+	free_string(&dir);
+
+	return true;
+}
+
+static bool bundle_manifest_download_error(UNUSED_PARAM enum download_status status, UNUSED_PARAM void *data)
+{
+	/* Don't retry, load_manifest() tries again later */
+	return true;
+}
+
+/*
+ * Download the manifests of all bundles that are not in the state directory
+ * yet, in parallel. Manifest deltas are tried first, then the full manifest
+ * of the bundles still missing is downloaded.
+ */
+static void download_bundle_manifests(struct bundle_manifest *bundles, size_t count)
+{
+	struct swupd_curl_parallel_handle *download_handle;
+	char *url, *filename;
+	size_t i;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		bool deltas = pass == 0;
+
+		download_handle = NULL;
+		for (i = 0; i < count; i++) {
+			struct bundle_manifest *bundle = &bundles[i];
+			struct file *file = bundle->file;
+			int from = file->peer ? file->peer->last_change : 0;
+
+			if (file->is_mix || bundle_manifest_exists(bundle) ||
+			    manifest_cache_exists(file->last_change, file)) {
+				continue;
+			}
+
+			if (deltas) {
+				if (!manifest_delta_supported(from, file->last_change, file->filename)) {
+					continue;
+				}
+
+				string_or_die(&filename, "%s/Manifest-%s-delta-from-%i-to-%i", state_dir, file->filename, from, file->last_change);
+				if (file_exists(filename)) {
+					apply_manifest_delta(from, file->last_change, file->filename);
+					free_string(&filename);
+					continue;
+				}
+				string_or_die(&url, "%s/%i/Manifest-%s-delta-from-%i", content_url, file->last_change, file->filename, from);
+				bundle->from = from;
+			} else {
+				char *dir;
+
+				string_or_die(&dir, "%s/%i", state_dir, file->last_change);
+				mkdir_p(dir);
+				free_string(&dir);
+
+				string_or_die(&filename, "%s/%i/Manifest.%s.tar", state_dir, file->last_change, file->filename);
+				string_or_die(&url, "%s/%i/Manifest.%s.tar", content_url, file->last_change, file->filename);
+				bundle->from = 0;
+			}
+
+			/* Only set up curl if there's something to download */
+			if (!download_handle) {
+				download_handle = swupd_curl_parallel_download_start(get_max_xfer(MAX_XFER));
+				if (!download_handle) {
+					free_string(&url);
+					free_string(&filename);
+					return;
+				}
+				swupd_curl_parallel_download_set_callbacks(download_handle, bundle_manifest_download_successful, bundle_manifest_download_error, NULL);
+			}
+
+			swupd_curl_parallel_download_enqueue(download_handle, url, filename, NULL, bundle);
+			free_string(&url);
+			free_string(&filename);
+		}
+
+		/* Download failures are handled by load_manifest() */
+		if (download_handle) {
+			swupd_curl_parallel_download_end(download_handle, NULL);
+		}
+	}
+}
+
+/* Verify and parse a bundle manifest already in the state directory */
+static void load_bundle_manifest(struct bundle_manifest *bundle)
+{
+	struct file *file = bundle->file;
+
+	bundle->manifest = load_cached_manifest(file->last_change, file, bundle->header_only);
+	if (bundle->manifest) {
+		set_untracked_manifest_files(bundle->manifest);
+		return;
+	}
+
+	if (file->is_mix || !bundle_manifest_exists(bundle)) {
+		return;
+	}
+
+	if (!bundle->header_only && verify_bundle_hash(bundle->mom, file) != 0) {
+		return;
+	}
+
+	bundle->manifest = manifest_from_file(file->last_change, file->filename, bundle->header_only, false);
+	if (bundle->manifest && !bundle->header_only) {
+		store_cached_manifest(file->last_change, file, bundle->manifest);
+	}
+	set_untracked_manifest_files(bundle->manifest);
+}
+
+static void parse_bundle_manifest(void *data)
+{
+	struct bundle_manifest *bundle = data;
+
+	load_bundle_manifest(bundle);
+
+	/* Don't keep the manifest once it was processed, so only the
+	 * manifests being processed are in memory */
+	if (bundle->manifest && bundle->process) {
+		bundle->process(bundle->manifest, bundle->index, bundle->data);
+		free_manifest(bundle->manifest);
+		bundle->manifest = NULL;
+		bundle->processed = true;
+	}
+}
+
+/*
+ * Create the bundle_manifest array for all bundles in FILES, download the
+ * missing manifests in parallel and parse them on a thread pool. Entries
+ * that couldn't be loaded have a NULL manifest.
+ */
+static struct bundle_manifest *load_bundle_manifests_parallel(struct manifest *mom, struct list *files, bool header_only, manifest_process_fn process, void *data, size_t *count)
+{
+	struct bundle_manifest *bundles;
+	struct list *iter;
+	struct tp *tp;
+	size_t i;
+
+	*count = list_len(files);
+	if (*count == 0) {
+		return NULL;
+	}
+
+	bundles = calloc(*count, sizeof(struct bundle_manifest));
+	ON_NULL_ABORT(bundles);
+
+	for (i = 0, iter = list_head(files); iter; iter = iter->next, i++) {
+		bundles[i].file = iter->data;
+		bundles[i].mom = mom;
+		bundles[i].header_only = header_only;
+		bundles[i].process = process;
+		bundles[i].data = data;
+		bundles[i].index = i;
+	}
+
+	download_bundle_manifests(bundles, *count);
+
+	tp = tp_start(get_max_jobs());
+	if (!tp) {
+		warn("Unable to create a thread pool - loading manifests synchronously\n");
+		tp = tp_start(0);
+		ON_NULL_ABORT(tp);
+	}
+	for (i = 0; i < *count; i++) {
+		if (tp_task_schedule(tp, parse_bundle_manifest, &bundles[i]) != 0) {
+			/* Not able to use the thread pool, so do it ourselves */
+			parse_bundle_manifest(&bundles[i]);
+		}
+	}
+	tp_complete(tp);
+
+	return bundles;
+}
+
+/* Load the manifests of the bundles in FILES concurrently. Manifests that fail
+ * to load are left out of the returned list, use load_manifest() to retry
+ * them and report errors. */
+struct list *load_manifests(struct manifest *mom, struct list *files, bool header_only)
+{
+	struct bundle_manifest *bundles;
+	struct list *manifests = NULL;
+	size_t count, i;
+
+	bundles = load_bundle_manifests_parallel(mom, files, header_only, NULL, NULL, &count);
+	for (i = 0; i < count; i++) {
+		if (bundles[i].manifest) {
+			manifests = list_prepend_data(manifests, bundles[i].manifest);
+		}
+	}
+	free(bundles);
+
+	return manifests;
+}
+
+int process_manifests(struct manifest *mom, struct list *files, manifest_process_fn process, void *data)
+{
+	struct bundle_manifest *bundles;
+	size_t count, i;
+	int failed = 0;
+
+	bundles = load_bundle_manifests_parallel(mom, files, false, process, data, &count);
+	for (i = 0; i < count; i++) {
+		struct file *file = bundles[i].file;
+		struct manifest *manifest;
+
+		if (bundles[i].processed) {
+			continue;
+		}
+
+		/* Retry the ones that failed here, so errors are reported */
+		manifest = load_manifest(file->last_change, file, mom, false, NULL);
+		if (!manifest) {
+			failed++;
+			continue;
+		}
+		process(manifest, i, data);
+		free_manifest(manifest);
+	}
+
+	free(bundles);
+	return failed;
+}
+
+/*
+ * Load the manifests of all bundles in FILES, referenced by MOM. Manifests
+ * that can't be loaded in parallel are retried with load_manifest(), so
+ * errors are handled the same way.
+ *
+ * Returns the list of manifests, in the reverse order of FILES, or NULL on
+ * errors.
+ */
+static struct list *load_bundle_manifests(struct manifest *mom, struct list *files, int *err)
+{
+	struct bundle_manifest *bundles;
+	struct list *manifests = NULL;
+	size_t count, i;
+
+	bundles = load_bundle_manifests_parallel(mom, files, false, NULL, NULL, &count);
+	for (i = 0; i < count; i++) {
+		struct file *file = bundles[i].file;
+
+		if (!bundles[i].manifest) {
+			bundles[i].manifest = load_manifest(file->last_change, file, mom, false, err);
+		}
+		if (!bundles[i].manifest) {
+			for (; i < count; i++) {
+				free_manifest(bundles[i].manifest);
+			}
+			list_free_list_and_data(manifests, free_manifest_data);
+			manifests = NULL;
+			break;
+		}
+		manifests = list_prepend_data(manifests, bundles[i].manifest);
+	}
+
+	free(bundles);
+	return manifests;
+}
+
 /* if component is specified explicitly, pull in submanifest only for that
  * if component is not specified, pull in any tracked component submanifest */
 struct list *recurse_manifest(struct manifest *manifest, struct list *subs, const char *component, bool server, int *err)
 {
 	struct list *bundles = NULL;
+	struct list *files = NULL;
 	struct list *list;
 	struct file *file;
-	struct manifest *sub;
 
 	manifest->contentsize = 0;
 	list = manifest->manifests;
@@ -758,17 +1168,69 @@ struct list *recurse_manifest(struct manifest *manifest, struct list *subs, cons
 			continue;
 		}
 
-		sub = load_manifest(file->last_change, file, manifest, false, err);
-		if (!sub) {
-			list_free_list_and_data(bundles, free_manifest_data);
+		files = list_append_data(files, file);
+	}
+
+	if (files) {
+		files = list_head(files);
+		bundles = load_bundle_manifests(manifest, files, err);
+		list_free_list(files);
+	}
+
+	return bundles;
+}
+
+/* Pick which of two entries with the same filename, from different bundles,
+ * is kept in the consolidated list of files. Returns NULL when the entries
+ * are inconsistent and both have to be excluded. */
+static struct file *consolidate_file_pair(struct file *file1, struct file *file2)
+{
+	/* If both files are present, this is the most common case. */
+	if (!file1->is_deleted && !file2->is_deleted) {
+
+		/* If the hashes don't match, we have an inconsistency in the
+		 * manifest. Exclude both from the list. */
+		if (!hash_equal(&file1->hash, &file2->hash)) {
+			char hash1[SWUPD_HASH_LEN], hash2[SWUPD_HASH_LEN];
+
+			hash_to_hex(&file1->hash, hash1);
+			hash_to_hex(&file2->hash, hash2);
+			telemetry(TELEMETRY_CRIT,
+				  "inconsistent-file-hash",
+				  "filename=%s\n"
+				  "hash1=%s\n"
+				  "version1=%d\n"
+				  "hash2=%s\n"
+				  "version2=%d\n",
+				  file1->filename,
+				  hash1,
+				  file1->last_change,
+				  hash2,
+				  file2->last_change);
 			return NULL;
 		}
-		if (sub != NULL) {
-			bundles = list_prepend_data(bundles, sub);
+
+		/* Prefer the tracked one, since that will prevent download a file
+		 * that is already in the system. Then prefer the older version
+		 * since it is more likely it will contain a fullfile for it in case
+		 * we need to download. */
+		if (file1->is_tracked && !file2->is_tracked) {
+			return file1;
 		}
+		if (!file1->is_tracked && file2->is_tracked) {
+			return file2;
+		}
+		return file1->last_change <= file2->last_change ? file1 : file2;
 	}
 
-	return bundles;
+	/* If both files are deleted, pick the newer deletion. This will make an
+	 * update not ignore a new deletion. */
+	if (file1->is_deleted && file2->is_deleted) {
+		return file1->last_change > file2->last_change ? file1 : file2;
+	}
+
+	/* Otherwise, pick the present file. */
+	return file2->is_deleted ? file1 : file2;
 }
 
 /* Takes the combination of files from several manifests and remove duplicated
@@ -777,7 +1239,7 @@ struct list *recurse_manifest(struct manifest *manifest, struct list *subs, cons
 struct list *consolidate_files(struct list *files)
 {
 	struct list *list, *next, *tmp;
-	struct file *file1, *file2;
+	struct file *file1, *file2, *keep;
 
 	files = list_sort(files, file_sort_filename);
 
@@ -788,7 +1250,7 @@ struct list *consolidate_files(struct list *files)
 	 * "list" and "next" point to the first and second in a series of perhaps
 	 * many objects referring to the same filename.  As we determine which file out
 	 * of multiples to keep in our consolidated, deduplicated, filename sorted list
-	 * there are Manifest invariants to maintain.
+	 * there are Manifest invariants to maintain, see consolidate_file_pair().
 	 * Note that "file" may be a file, directory or symlink.
 	 */
 	list = list_head(files);
@@ -806,73 +1268,284 @@ struct list *consolidate_files(struct list *files)
 			continue;
 		}
 
-		/* From here on, file1 and file2 have a filename match. */
-
-		/* If both files are present, this is the most common case. */
-		if (!file1->is_deleted && !file2->is_deleted) {
-
-			/* If the hashes don't match, we have an inconsistency in the
-			 * manifest. Exclude both from the list. */
-			if (!hash_equal(file1->hash, file2->hash)) {
-				tmp = next->next;
-				list_free_item(list, NULL);
-				list_free_item(next, NULL);
-				list = tmp;
-				telemetry(TELEMETRY_CRIT,
-					  "inconsistent-file-hash",
-					  "filename=%s\n"
-					  "hash1=%s\n"
-					  "version1=%d\n"
-					  "hash2=%s\n"
-					  "version2=%d\n",
-					  file1->filename,
-					  file1->hash,
-					  file1->last_change,
-					  file2->hash,
-					  file2->last_change);
-				continue;
-			}
+		keep = consolidate_file_pair(file1, file2);
+		if (!keep) {
+			tmp = next->next;
+			list_free_item(list, NULL);
+			list_free_item(next, NULL);
+			list = tmp;
+		} else if (keep == file1) {
+			list_free_item(next, NULL);
+		} else {
+			list_free_item(list, NULL);
+			list = next;
+		}
+	}
 
-			/* Prefer the tracked one, since that will prevent download a file
-			 * that is already in the system. Then prefer the older version
-			 * since it is more likely it will contain a fullfile for it in case
-			 * we need to download. */
-			if (file1->is_tracked && !file2->is_tracked) {
-				list_free_item(next, NULL);
-			} else if (!file1->is_tracked && file2->is_tracked) {
-				list_free_item(list, NULL);
-				list = next;
-			} else if (file1->last_change <= file2->last_change) {
-				list_free_item(next, NULL);
-			} else {
-				list_free_item(list, NULL);
-				list = next;
-			}
+	return list;
+}
+
+/* Minimum number of files in each filename range consolidated in parallel */
+#define CONSOLIDATE_RANGE_MIN_FILES 50000
+
+/* The files of one bundle, sorted by filename, being merged */
+struct merge_source {
+	struct file **files;
+	size_t pos; /* next file to be merged */
+	size_t end; /* end of the filename range being merged */
+	size_t order; /* position of the bundle, used to break ties */
+};
+
+/* A filename range of the consolidated list of files */
+struct merge_range {
+	struct merge_source *sources;
+	size_t count;
+	struct list *files; /* consolidated files in this range */
+};
+
+static int file_ptr_sort_filename(const void *a, const void *b)
+{
+	return file_sort_filename(*(struct file *const *)a, *(struct file *const *)b);
+}
+
+static int merge_source_cmp(const struct merge_source *a, const struct merge_source *b)
+{
+	int ret;
+
+	ret = file_sort_filename(a->files[a->pos], b->files[b->pos]);
+	if (ret) {
+		return ret;
+	}
+
+	return a->order < b->order ? -1 : 1;
+}
+
+static void merge_heap_sift_down(struct merge_source **heap, size_t len, size_t i)
+{
+	struct merge_source *tmp;
+	size_t child;
+
+	while ((child = 2 * i + 1) < len) {
+		if (child + 1 < len && merge_source_cmp(heap[child + 1], heap[child]) < 0) {
+			child++;
+		}
+		if (merge_source_cmp(heap[i], heap[child]) < 0) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Index of the first file in FILES with a filename not lower than NAME */
+static size_t files_lower_bound(struct file **files, size_t len, const char *name)
+{
+	size_t lo = 0, hi = len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (strcmp(files[mid]->filename, name) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/* Merge the files of all bundles in a filename range using a min heap with one
+ * entry per bundle. Entries with the same filename come out of the heap next
+ * to each other and are consolidated as they are merged. */
+static void merge_range_run(void *data)
+{
+	struct merge_range *range = data;
+	struct merge_source **heap;
+	struct merge_source *source;
+	struct list *head = NULL, *tail = NULL;
+	struct file *file, *keep = NULL;
+	size_t len = 0, i;
+
+	heap = malloc(range->count * sizeof(struct merge_source *));
+	ON_NULL_ABORT(heap);
+
+	for (i = 0; i < range->count; i++) {
+		if (range->sources[i].pos < range->sources[i].end) {
+			heap[len++] = &range->sources[i];
+		}
+	}
+	for (i = len / 2; i > 0; i--) {
+		merge_heap_sift_down(heap, len, i - 1);
+	}
+
+	while (len > 0) {
+		source = heap[0];
+		file = source->files[source->pos++];
+		if (source->pos == source->end) {
+			heap[0] = heap[--len];
+		}
+		merge_heap_sift_down(heap, len, 0);
+
+		/* After an inconsistency excluded both entries, the next entry
+		 * with the same filename is consolidated with the remaining ones,
+		 * like consolidate_files() does */
+		if (keep && strcmp(keep->filename, file->filename) == 0) {
+			keep = consolidate_file_pair(keep, file);
 			continue;
 		}
 
-		/* If both files are deleted, pick the newer deletion. This will make an
-		 * update not ignore a new deletion. */
-		if (file1->is_deleted && file2->is_deleted) {
-			if (file1->last_change > file2->last_change) {
-				list_free_item(next, NULL);
-			} else {
-				list_free_item(list, NULL);
-				list = next;
+		if (keep) {
+			tail = list_append_data(tail, keep);
+			if (!head) {
+				head = tail;
 			}
+		}
+		keep = file;
+	}
+
+	if (keep) {
+		tail = list_append_data(tail, keep);
+		if (!head) {
+			head = tail;
+		}
+	}
+
+	range->files = head;
+	free(heap);
+}
+
+/* Same as consolidate_files(files_from_bundles(bundles)), but the files of each
+ * bundle, which are already sorted by filename, are merged instead of sorting
+ * a list with the files of all bundles. Large merges are split in filename
+ * ranges that are consolidated in parallel. */
+struct list *consolidate_bundle_files(struct list *bundles)
+{
+	struct merge_source *sources;
+	struct merge_range *ranges;
+	struct file ***owned;
+	struct list *iter, *files = NULL;
+	struct manifest *bundle;
+	struct tp *tp;
+	size_t *lens;
+	size_t count = 0, num_owned = 0, total = 0, largest = 0;
+	size_t num_ranges, i, r;
+
+	i = list_len(bundles);
+	if (i == 0) {
+		return NULL;
+	}
+
+	sources = calloc(i, sizeof(struct merge_source));
+	ON_NULL_ABORT(sources);
+	lens = calloc(i, sizeof(size_t));
+	ON_NULL_ABORT(lens);
+	owned = calloc(i, sizeof(struct file **));
+	ON_NULL_ABORT(owned);
+
+	for (iter = list_head(bundles); iter; iter = iter->next) {
+		bundle = iter->data;
+		if (!bundle || !bundle->files) {
 			continue;
 		}
 
-		/* Otherwise, pick the present file. */
-		if (file2->is_deleted) {
-			list_free_item(next, NULL);
+		if (bundle->files_by_name) {
+			sources[count].files = bundle->files_by_name;
+			lens[count] = bundle->files_by_name_len;
 		} else {
-			list_free_item(list, NULL);
-			list = next;
+			struct list *f;
+			struct file **array;
+			size_t len = list_len(bundle->files);
+
+			/* The list was changed after parsing, so sort it here */
+			array = malloc(len * sizeof(struct file *));
+			ON_NULL_ABORT(array);
+			len = 0;
+			for (f = list_head(bundle->files); f; f = f->next) {
+				array[len++] = f->data;
+			}
+			qsort(array, len, sizeof(struct file *), file_ptr_sort_filename);
+
+			sources[count].files = owned[num_owned++] = array;
+			lens[count] = len;
 		}
+
+		sources[count].order = count;
+		total += lens[count];
+		if (lens[count] > lens[largest]) {
+			largest = count;
+		}
+		count++;
 	}
 
-	return list;
+	num_ranges = total / CONSOLIDATE_RANGE_MIN_FILES;
+	if (num_ranges > (size_t)get_max_jobs()) {
+		num_ranges = get_max_jobs();
+	}
+	if (num_ranges < 1) {
+		num_ranges = 1;
+	}
+
+	/* Ranges are split by filenames evenly spaced in the largest bundle, so
+	 * all entries with the same filename are in the same range */
+	ranges = calloc(num_ranges, sizeof(struct merge_range));
+	ON_NULL_ABORT(ranges);
+	for (r = 0; r < num_ranges; r++) {
+		ranges[r].count = count;
+		ranges[r].sources = malloc(count * sizeof(struct merge_source));
+		ON_NULL_ABORT(ranges[r].sources);
+
+		for (i = 0; i < count; i++) {
+			struct merge_source *source = &ranges[r].sources[i];
+
+			*source = sources[i];
+			source->pos = 0;
+			source->end = lens[i];
+			if (r > 0) {
+				source->pos = ranges[r - 1].sources[i].end;
+			}
+			if (r < num_ranges - 1) {
+				const char *name = sources[largest].files[(r + 1) * lens[largest] / num_ranges]->filename;
+
+				source->end = files_lower_bound(source->files, lens[i], name);
+			}
+		}
+	}
+
+	if (num_ranges == 1) {
+		merge_range_run(&ranges[0]);
+	} else {
+		tp = tp_start(get_max_jobs());
+		if (!tp) {
+			warn("Unable to create a thread pool - consolidating files synchronously\n");
+			tp = tp_start(0);
+			ON_NULL_ABORT(tp);
+		}
+		for (r = 0; r < num_ranges; r++) {
+			if (tp_task_schedule(tp, merge_range_run, &ranges[r]) != 0) {
+				/* Not able to use the thread pool, so do it ourselves */
+				merge_range_run(&ranges[r]);
+			}
+		}
+		tp_complete(tp);
+	}
+
+	for (r = num_ranges; r > 0; r--) {
+		files = list_concat(ranges[r - 1].files, files);
+		free(ranges[r - 1].sources);
+	}
+
+	for (i = 0; i < num_owned; i++) {
+		free(owned[i]);
+	}
+	free(owned);
+	free(ranges);
+	free(lens);
+	free(sources);
+
+	return files;
 }
 
 /*
@@ -1076,6 +1749,11 @@ void deduplicate_files_from_manifest(struct manifest **m1, struct manifest *m2)
 	int count = 0;
 
 	bmanifest = *m1;
+	/* files will be removed from the list, so the index is no longer valid */
+	free(bmanifest->files_by_name);
+	bmanifest->files_by_name = NULL;
+	bmanifest->files_by_name_len = 0;
+
 	iter1 = preserver = list_head(bmanifest->files);
 	iter2 = list_head(m2->files);
 
@@ -1128,12 +1806,23 @@ struct file *search_bundle_in_manifest(struct manifest *manifest, const char *bu
 	return NULL;
 }
 
-/* This performs a linear search through the files list. */
+/* This performs a binary search in the files sorted by name when they are
+ * available, or a linear search through the files list otherwise. */
 struct file *search_file_in_manifest(struct manifest *manifest, const char *filename)
 {
 	struct list *iter = NULL;
 	struct file *file;
 
+	if (manifest->files_by_name) {
+		struct file key = { 0 };
+		struct file **found;
+
+		key.filename = (char *)filename;
+		found = bsearch(&key, manifest->files_by_name, manifest->files_by_name_len,
+				sizeof(struct file *), bsearch_file_helper);
+		return found ? *found : NULL;
+	}
+
 	iter = list_head(manifest->files);
 	while (iter) {
 		file = iter->data;
@@ -1213,7 +1902,7 @@ int enforce_compliant_manifest(struct file **a, struct file **b, int searchsize,
 			if (is_version_data(a[i]->filename)) {
 				continue;
 			}
-			if (hash_equal(a[i]->hash, (*found)->hash)) {
+			if (hash_equal(&a[i]->hash, &(*found)->hash)) {
 				continue;
 			}
 			error("Conflict found for file: %s\n", a[i]->filename);
@@ -9,6 +9,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -28,6 +29,13 @@ struct manifest {
 	struct list *files;     /* struct file for files */
 	struct list *manifests; /* struct file for possible manifests */
 
+	// File table, the storage used by the entries in the lists above
+	struct file *file_table;      /* all entries parsed, in a single array */
+	size_t file_table_len;
+	char *filenames;	      /* all filenames parsed, in a single buffer */
+	struct file **files_by_name;  /* files sorted by name, NULL if files changed */
+	size_t files_by_name_len;
+
 	// Helper data
 	struct list *submanifests; /* struct manifest for subscribed manifests */
 	unsigned int is_mix : 1;
@@ -41,6 +49,13 @@ struct manifest {
  */
 struct manifest *manifest_parse(const char *component, const char *filename, bool header_only);
 
+/**
+ * @brief Same as manifest_parse(), but reading the manifest with stdio.
+ *
+ * Used when the manifest can't be mapped in memory.
+ */
+struct manifest *manifest_parse_stdio(const char *component, const char *filename, bool header_only);
+
 /**
  * @brief Free manifest pointed by @c data.
  *
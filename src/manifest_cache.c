@@ -0,0 +1,379 @@
+/*
+ *   Software Updater - client side
+ *
+ *      Copyright © 2019 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "manifest.h"
+#include "manifest_cache.h"
+#include "swupd.h"
+
+/*
+ * The manifest cache is the parsed form of a bundle manifest, so loading it
+ * doesn't require any parsing. It's written next to the manifest once the
+ * manifest is verified and its name includes the manifest hash from the MoM,
+ * so a cache is only used for the exact manifest it was created from.
+ *
+ * The file is position independent: a header, followed by the file entries,
+ * the offsets of the includes and the strings. Entries refer to strings by
+ * their offset in the strings area. Files are saved in the order of the files
+ * list, which is sorted by name, followed by the manifests list.
+ */
+
+#define MANIFEST_CACHE_MAGIC "SWUPDMC"
+#define MANIFEST_CACHE_VERSION 1
+
+enum manifest_cache_flags {
+	CACHE_IS_FILE = 1 << 0,
+	CACHE_IS_DIR = 1 << 1,
+	CACHE_IS_LINK = 1 << 2,
+	CACHE_IS_DELETED = 1 << 3,
+	CACHE_IS_GHOSTED = 1 << 4,
+	CACHE_IS_MANIFEST = 1 << 5,
+	CACHE_IS_CONFIG = 1 << 6,
+	CACHE_IS_STATE = 1 << 7,
+	CACHE_IS_BOOT = 1 << 8,
+	CACHE_IS_EXPERIMENTAL = 1 << 9,
+	CACHE_IS_MIX = 1 << 10,
+	CACHE_IS_TRACKED = 1 << 11,
+};
+
+struct manifest_cache_header {
+	char magic[8];
+	uint32_t version;
+	int32_t manifest_version;
+	int32_t manifest_file_version;
+	uint32_t is_mix;
+	uint64_t filecount;
+	uint64_t contentsize;
+	uint32_t files_len;
+	uint32_t manifests_len;
+	uint32_t includes_len;
+	uint32_t strings_len;
+};
+
+struct manifest_cache_entry {
+	union swupd_hash hash;
+	uint32_t filename;
+	int32_t last_change;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+static uint32_t file_to_flags(const struct file *file)
+{
+	uint32_t flags = 0;
+
+	flags |= file->is_file ? CACHE_IS_FILE : 0;
+	flags |= file->is_dir ? CACHE_IS_DIR : 0;
+	flags |= file->is_link ? CACHE_IS_LINK : 0;
+	flags |= file->is_deleted ? CACHE_IS_DELETED : 0;
+	flags |= file->is_ghosted ? CACHE_IS_GHOSTED : 0;
+	flags |= file->is_manifest ? CACHE_IS_MANIFEST : 0;
+	flags |= file->is_config ? CACHE_IS_CONFIG : 0;
+	flags |= file->is_state ? CACHE_IS_STATE : 0;
+	flags |= file->is_boot ? CACHE_IS_BOOT : 0;
+	flags |= file->is_experimental ? CACHE_IS_EXPERIMENTAL : 0;
+	flags |= file->is_mix ? CACHE_IS_MIX : 0;
+	flags |= file->is_tracked ? CACHE_IS_TRACKED : 0;
+
+	return flags;
+}
+
+static void flags_to_file(uint32_t flags, struct file *file)
+{
+	file->is_file = (flags & CACHE_IS_FILE) != 0;
+	file->is_dir = (flags & CACHE_IS_DIR) != 0;
+	file->is_link = (flags & CACHE_IS_LINK) != 0;
+	file->is_deleted = (flags & CACHE_IS_DELETED) != 0;
+	file->is_ghosted = (flags & CACHE_IS_GHOSTED) != 0;
+	file->is_manifest = (flags & CACHE_IS_MANIFEST) != 0;
+	file->is_config = (flags & CACHE_IS_CONFIG) != 0;
+	file->is_state = (flags & CACHE_IS_STATE) != 0;
+	file->is_boot = (flags & CACHE_IS_BOOT) != 0;
+	file->is_experimental = (flags & CACHE_IS_EXPERIMENTAL) != 0;
+	file->is_mix = (flags & CACHE_IS_MIX) != 0;
+	file->is_tracked = (flags & CACHE_IS_TRACKED) != 0;
+}
+
+/* Check that the header describes a file of exactly 'size' bytes */
+static bool check_header(const struct manifest_cache_header *header, size_t size)
+{
+	uint64_t expected;
+
+	if (memcmp(header->magic, MANIFEST_CACHE_MAGIC, sizeof(MANIFEST_CACHE_MAGIC)) != 0 ||
+	    header->version != MANIFEST_CACHE_VERSION) {
+		return false;
+	}
+
+	expected = sizeof(struct manifest_cache_header);
+	expected += ((uint64_t)header->files_len + header->manifests_len) * sizeof(struct manifest_cache_entry);
+	expected += (uint64_t)header->includes_len * sizeof(uint32_t);
+	expected += header->strings_len;
+
+	return expected == size;
+}
+
+static struct manifest *load_from_map(const char *component, const char *data, size_t size, bool header_only)
+{
+	const struct manifest_cache_header *header = (const struct manifest_cache_header *)data;
+	const struct manifest_cache_entry *entries;
+	const uint32_t *includes;
+	const char *strings;
+	struct manifest *manifest;
+	size_t entries_len, i;
+
+	if (size < sizeof(struct manifest_cache_header) || !check_header(header, size)) {
+		return NULL;
+	}
+
+	entries_len = (size_t)header->files_len + header->manifests_len;
+	entries = (const struct manifest_cache_entry *)(header + 1);
+	includes = (const uint32_t *)(entries + entries_len);
+	strings = (const char *)(includes + header->includes_len);
+
+	/* All strings are NUL terminated, so any offset in range is valid */
+	if (header->strings_len == 0 || strings[header->strings_len - 1] != '\0') {
+		return NULL;
+	}
+	for (i = 0; i < header->includes_len; i++) {
+		if (includes[i] >= header->strings_len) {
+			return NULL;
+		}
+	}
+
+	manifest = calloc(1, sizeof(struct manifest));
+	ON_NULL_ABORT(manifest);
+
+	manifest->manifest_version = header->manifest_version;
+	manifest->version = header->manifest_file_version;
+	manifest->filecount = header->filecount;
+	manifest->contentsize = header->contentsize;
+	manifest->component = strdup_or_die(component);
+
+	/* Same order as the parser, which prepends includes */
+	for (i = header->includes_len; i > 0; i--) {
+		manifest->includes = list_prepend_data(manifest->includes, strdup_or_die(strings + includes[i - 1]));
+	}
+
+	if (header_only) {
+		return manifest;
+	}
+
+	manifest->is_mix = header->is_mix != 0;
+
+	manifest->filenames = malloc(header->strings_len);
+	ON_NULL_ABORT(manifest->filenames);
+	memcpy(manifest->filenames, strings, header->strings_len);
+
+	if (entries_len > 0) {
+		manifest->file_table = calloc(entries_len, sizeof(struct file));
+		ON_NULL_ABORT(manifest->file_table);
+	}
+	if (header->files_len > 0) {
+		manifest->files_by_name = malloc(header->files_len * sizeof(struct file *));
+		ON_NULL_ABORT(manifest->files_by_name);
+		manifest->files_by_name_len = header->files_len;
+	}
+
+	for (i = 0; i < entries_len; i++) {
+		struct file *file = &manifest->file_table[i];
+
+		if (entries[i].filename >= header->strings_len) {
+			free_manifest(manifest);
+			return NULL;
+		}
+
+		file->in_file_table = 1;
+		file->filename = manifest->filenames + entries[i].filename;
+		hash_assign(&entries[i].hash, &file->hash);
+		file->last_change = entries[i].last_change;
+		flags_to_file(entries[i].flags, file);
+
+		if (i < header->files_len) {
+			manifest->files_by_name[i] = file;
+		}
+		manifest->file_table_len++;
+	}
+
+	for (i = header->files_len; i > 0; i--) {
+		manifest->files = list_prepend_data(manifest->files, &manifest->file_table[i - 1]);
+	}
+	for (i = entries_len; i > header->files_len; i--) {
+		manifest->manifests = list_prepend_data(manifest->manifests, &manifest->file_table[i - 1]);
+	}
+
+	return manifest;
+}
+
+struct manifest *manifest_cache_load(const char *component, const char *filename, bool header_only)
+{
+	struct manifest *manifest;
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+
+	manifest = load_from_map(component, data, st.st_size, header_only);
+	munmap(data, st.st_size);
+
+	if (!manifest) {
+		debug("Ignoring invalid manifest cache %s\n", filename);
+	}
+
+	return manifest;
+}
+
+static uint32_t add_string(char *strings, size_t *strings_len, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	uint32_t offset = *strings_len;
+
+	memcpy(strings + *strings_len, str, len);
+	*strings_len += len;
+
+	return offset;
+}
+
+static void fill_entry(struct manifest_cache_entry *entry, struct file *file, char *strings, size_t *strings_len)
+{
+	hash_assign(&file->hash, &entry->hash);
+	entry->filename = add_string(strings, strings_len, file->filename);
+	entry->last_change = file->last_change;
+	entry->flags = file_to_flags(file);
+}
+
+void manifest_cache_store(struct manifest *manifest, const char *filename)
+{
+	struct manifest_cache_header *header;
+	struct manifest_cache_entry *entries;
+	uint32_t *includes;
+	char *strings;
+	char *data = NULL;
+	char *tmp_filename = NULL;
+	struct list *iter;
+	size_t files_len, manifests_len, includes_len;
+	size_t strings_size = 0, strings_len = 0;
+	size_t size, i;
+	ssize_t written;
+	int fd;
+
+	files_len = list_len(manifest->files);
+	manifests_len = list_len(manifest->manifests);
+	includes_len = list_len(manifest->includes);
+
+	for (iter = manifest->files; iter; iter = iter->next) {
+		strings_size += strlen(((struct file *)iter->data)->filename) + 1;
+	}
+	for (iter = manifest->manifests; iter; iter = iter->next) {
+		strings_size += strlen(((struct file *)iter->data)->filename) + 1;
+	}
+	for (iter = manifest->includes; iter; iter = iter->next) {
+		strings_size += strlen(iter->data) + 1;
+	}
+	if (strings_size == 0 || strings_size > UINT32_MAX) {
+		return;
+	}
+
+	size = sizeof(struct manifest_cache_header);
+	size += (files_len + manifests_len) * sizeof(struct manifest_cache_entry);
+	size += includes_len * sizeof(uint32_t);
+	size += strings_size;
+
+	data = calloc(1, size);
+	ON_NULL_ABORT(data);
+
+	header = (struct manifest_cache_header *)data;
+	entries = (struct manifest_cache_entry *)(header + 1);
+	includes = (uint32_t *)(entries + files_len + manifests_len);
+	strings = (char *)(includes + includes_len);
+
+	memcpy(header->magic, MANIFEST_CACHE_MAGIC, sizeof(MANIFEST_CACHE_MAGIC));
+	header->version = MANIFEST_CACHE_VERSION;
+	header->manifest_version = manifest->manifest_version;
+	header->manifest_file_version = manifest->version;
+	header->is_mix = manifest->is_mix;
+	header->filecount = manifest->filecount;
+	header->contentsize = manifest->contentsize;
+	header->files_len = files_len;
+	header->manifests_len = manifests_len;
+	header->includes_len = includes_len;
+	header->strings_len = strings_size;
+
+	i = 0;
+	for (iter = manifest->files; iter; iter = iter->next) {
+		fill_entry(&entries[i++], iter->data, strings, &strings_len);
+	}
+	for (iter = manifest->manifests; iter; iter = iter->next) {
+		fill_entry(&entries[i++], iter->data, strings, &strings_len);
+	}
+	i = 0;
+	for (iter = manifest->includes; iter; iter = iter->next) {
+		includes[i++] = add_string(strings, &strings_len, iter->data);
+	}
+
+	/* Write to a temporary file, so an incomplete cache is never used */
+	string_or_die(&tmp_filename, "%s.new", filename);
+	fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		goto out;
+	}
+
+	for (i = 0; i < size; i += written) {
+		written = write(fd, data + i, size - i);
+		if (written < 0) {
+			if (errno == EINTR) {
+				written = 0;
+				continue;
+			}
+			break;
+		}
+	}
+
+	if (close(fd) != 0 || i != size || rename(tmp_filename, filename) != 0) {
+		unlink(tmp_filename);
+	}
+
+out:
+	free_string(&tmp_filename);
+	free(data);
+}
@@ -0,0 +1,41 @@
+#ifndef __INCLUDE_GUARD_MANIFEST_CACHE_H
+#define __INCLUDE_GUARD_MANIFEST_CACHE_H
+
+/**
+ * @file
+ * @brief Pre-parsed binary form of manifests, saved in the state directory.
+ */
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct manifest;
+
+/** @brief Suffix of the manifest cache files, after the bundle manifest hash. */
+#define MANIFEST_CACHE_SUFFIX ".cache"
+
+/**
+ * @brief Load the manifest saved by manifest_cache_store() in 'filename' and
+ * set its name to 'component'.
+ * @param header_only If set don't load manifest files.
+ *
+ * @returns The manifest or NULL if the cache doesn't exist or is invalid.
+ */
+struct manifest *manifest_cache_load(const char *component, const char *filename, bool header_only);
+
+/**
+ * @brief Save 'manifest' in binary form to 'filename'.
+ *
+ * The manifest must be as returned by the manifest parser. Errors are
+ * ignored, the manifest is parsed again next time.
+ */
+void manifest_cache_store(struct manifest *manifest, const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,8 +19,13 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "manifest.h"
 #include "swupd.h"
@@ -33,34 +38,337 @@
 
 #define MANIFEST_HEADER "MANIFEST\t"
 
-struct manifest *manifest_parse(const char *component, const char *filename, bool header_only)
+// Number of entries allocated at once in the file table
+#define FILE_TABLE_STEP 1024
+
+// Shortest possible file entry: flags, hash, version and separators
+#define MANIFEST_ENTRY_MINLEN (4 + 1 + (SWUPD_HASH_LEN - 1) + 1 + 1 + 1 + 1)
+
+static int cmp_file_ptr_filename(const void *a, const void *b)
+{
+	return strcmp((*(struct file **)a)->filename, (*(struct file **)b)->filename);
+}
+
+/*
+ * Create the files and manifests lists using the entries in the file table.
+ * Files are kept in a separate array sorted by name and the files list is
+ * created in that order.
+ */
+static void build_file_lists(struct manifest *manifest)
+{
+	struct file **files;
+	size_t i, count = 0;
+
+	files = malloc(manifest->file_table_len * sizeof(struct file *));
+	ON_NULL_ABORT(files);
+
+	for (i = 0; i < manifest->file_table_len; i++) {
+		struct file *file = &manifest->file_table[i];
+
+		if (file->is_manifest) {
+			manifest->manifests = list_prepend_data(manifest->manifests, file);
+		} else {
+			files[count++] = file;
+		}
+	}
+
+	if (count == 0) {
+		free(files);
+		return;
+	}
+
+	qsort(files, count, sizeof(struct file *), cmp_file_ptr_filename);
+	for (i = count; i > 0; i--) {
+		manifest->files = list_prepend_data(manifest->files, files[i - 1]);
+	}
+
+	manifest->files_by_name = files;
+	manifest->files_by_name_len = count;
+}
+
+/*
+ * Source of the manifest being parsed. Manifests are mapped in memory, so
+ * entries are parsed in place and only the filenames are copied. The stdio
+ * stream is only used when the manifest can't be mapped.
+ */
+struct manifest_reader {
+	FILE *stream;
+	const char *data;
+	const char *pos;
+	const char *end;
+	size_t size;
+};
+
+/* Same as fgets(), so headers are handled the same way in both readers */
+static bool read_header_line(struct manifest_reader *reader, char *line)
 {
-	FILE *infile;
-	char line[MANIFEST_LINE_MAXLEN], *c, *c2;
-	int count = 0;
-	int deleted = 0;
+	const char *nl;
+	size_t len;
+
+	if (reader->stream) {
+		return fgets(line, MANIFEST_LINE_MAXLEN, reader->stream) != NULL;
+	}
+
+	if (reader->pos >= reader->end) {
+		return false;
+	}
+
+	len = reader->end - reader->pos;
+	if (len > MANIFEST_LINE_MAXLEN - 1) {
+		len = MANIFEST_LINE_MAXLEN - 1;
+	}
+	nl = memchr(reader->pos, '\n', len);
+	if (nl) {
+		len = nl - reader->pos + 1;
+	}
+
+	memcpy(line, reader->pos, len);
+	line[len] = '\0';
+	reader->pos += len;
+
+	return true;
+}
+
+/*
+ * Get the next file entry, without the line break. 'buf' is only used by the
+ * stdio reader. Returns 1 on success, 0 at the end of the manifest and -1
+ * if the line is malformed.
+ */
+static int read_entry_line(struct manifest_reader *reader, char *buf, const char **line, size_t *len)
+{
+	const char *nl;
+	size_t max;
+
+	if (reader->stream) {
+		if (fgets(buf, MANIFEST_LINE_MAXLEN, reader->stream) == NULL) {
+			return 0;
+		}
+
+		nl = strchr(buf, '\n');
+		if (!nl || nl == buf) {
+			return -1;
+		}
+
+		*line = buf;
+		*len = nl - buf;
+		return 1;
+	}
+
+	if (reader->pos >= reader->end) {
+		return 0;
+	}
+
+	max = reader->end - reader->pos;
+	if (max > MANIFEST_LINE_MAXLEN - 1) {
+		max = MANIFEST_LINE_MAXLEN - 1;
+	}
+
+	nl = memchr(reader->pos, '\n', max);
+	if (!nl || nl == reader->pos) {
+		return -1;
+	}
+
+	/* Lines with a NUL character are rejected by the stdio reader too */
+	*len = nl - reader->pos;
+	if (strnlen(reader->pos, *len) != *len) {
+		return -1;
+	}
+
+	*line = reader->pos;
+	reader->pos = nl + 1;
+	return 1;
+}
+
+/* Parse one header line, with the line break already removed */
+static bool parse_header_line(struct manifest *manifest, const char *component, const char *filename, char *line)
+{
+	char *c;
 	int err;
-	struct manifest *manifest;
-	struct list *includes = NULL;
-	unsigned long long filecount = 0;
-	unsigned long long contentsize = 0;
 
-	infile = fopen(filename, "rbm");
-	if (infile == NULL) {
-		return NULL;
+	// Look for separator
+	c = strchr(line, '\t');
+	if (c) {
+		c++;
+	} else {
+		return false;
 	}
 
+	if (strncmp_const(line, "version:\t") == 0) {
+		err = strtoi_err(c, &manifest->version);
+		if (err != 0) {
+			error("Invalid manifest version on %s\n", filename);
+			return false;
+		}
+	} else if (strncmp_const(line, "filecount:\t") == 0) {
+		errno = 0;
+		manifest->filecount = strtoull(c, NULL, 10);
+		if (manifest->filecount > 4000000) {
+			/* Note on the number 4,000,000. We want this
+			 * to be big enough to allow Manifest.Full to
+			 * pass (currently about 450,000 March 18) but
+			 * small enough that when multiplied by
+			 * sizeof(struct file) it fits into
+			 * size_t. For a system with size_t being a 32
+			 * bit value, this constrains it to be less
+			 * than about 6,000,000, but close to infinity
+			 * for systems with 64 bit size_t.
+			 */
+			error("Preposterous (%llu) number of files in %s Manifest, more than 4 million skipping\n",
+			      (unsigned long long)manifest->filecount, component);
+			return false;
+		} else if (errno != 0) {
+			error("Loaded incompatible manifest filecount\n");
+			return false;
+		}
+	} else if (strncmp_const(line, "contentsize:\t") == 0) {
+		errno = 0;
+		manifest->contentsize = strtoull(c, NULL, 10);
+		if (manifest->contentsize > 2000000000000UL) {
+			error("Preposterous (%llu) size of files in %s Manifest, more than 2TB skipping\n",
+			      (unsigned long long)manifest->contentsize, component);
+			return false;
+		} else if (errno != 0) {
+			error("Loaded incompatible manifest contentsize\n");
+			return false;
+		}
+	} else if (strncmp_const(line, "includes:\t") == 0) {
+		manifest->includes = list_prepend_data(manifest->includes, strdup_or_die(c));
+	}
+
+	return true;
+}
+
+/*
+ * Parse the file entry in 'line', which has 'len' characters and no line
+ * break, into 'file'. The filename is appended to the manifest filenames
+ * buffer and its offset is stored in file->filename.
+ *
+ * Returns 1 on success, 0 if the entry should be ignored and -1 on errors.
+ */
+static int parse_file_line(struct manifest *manifest, struct file *file, const char *line, size_t len, size_t *filenames_len)
+{
+	const char *end = line + len;
+	const char *c, *c2;
+	char *endptr;
+	char flags[4] = { 0 };
+	int err;
+
+	// Look for separator
+	c = memchr(line, '\t', len);
+	if (c) {
+		c++;
+	} else {
+		return -1;
+	}
+
+	memcpy(flags, line, len < sizeof(flags) ? len : sizeof(flags));
+
+	if (flags[0] == 'F') {
+		file->is_file = 1;
+	} else if (flags[0] == 'D') {
+		file->is_dir = 1;
+	} else if (flags[0] == 'L') {
+		file->is_link = 1;
+	} else if (flags[0] == 'M') {
+		file->is_manifest = 1;
+	} else if (flags[0] == 'I') {
+		/* ignore this file for future iterative manifest feature */
+		return 0;
+	}
+
+	if (flags[1] == 'd') {
+		file->is_deleted = 1;
+	} else if (flags[1] == 'g') {
+		file->is_deleted = 1;
+		file->is_ghosted = 1;
+	} else if (flags[1] == 'e') {
+		file->is_experimental = 1;
+	}
+
+	if (flags[2] == 'C') {
+		file->is_config = 1;
+	} else if (flags[2] == 's') {
+		file->is_state = 1;
+	} else if (flags[2] == 'b') {
+		file->is_boot = 1;
+	}
+
+	if (flags[3] == 'r') {
+		/* rename flag is ignored */
+	} else if (flags[3] == 'm') {
+		file->is_mix = 1;
+		manifest->is_mix = 1;
+	}
+
+	c2 = memchr(c, '\t', end - c);
+	if (!c2) {
+		return -1;
+	}
+
+	/* Stops at the separator if the hash is too short */
+	if (!hash_from_hex(c, &file->hash)) {
+		return -1;
+	}
+
+	c = c2 + 1;
+	c2 = memchr(c, '\t', end - c);
+	if (!c2) {
+		return -1;
+	}
+
+	/* The version isn't NUL terminated, so don't let strtol() skip
+	 * whitespace past the separator */
+	while (c < c2 && isspace(*c)) {
+		c++;
+	}
+	if (c == c2) {
+		file->last_change = 0;
+		err = 0;
+	} else {
+		err = strtoi_err_endptr(c, &endptr, &file->last_change);
+		if (err == 0 && endptr != c2 && !isspace(*endptr)) {
+			err = -EINVAL;
+		}
+	}
+	if (file->last_change <= 0 || err != 0) {
+		error("Loaded incompatible manifest last change\n");
+		return -1;
+	}
+
+	c = c2 + 1;
+
+	/* Filenames are stored as offsets until the table stops growing */
+	len = end - c;
+	memcpy(manifest->filenames + *filenames_len, c, len);
+	manifest->filenames[*filenames_len + len] = '\0';
+	file->filename = (char *)(uintptr_t)*filenames_len;
+	*filenames_len += len + 1;
+
+	if (!file->is_manifest) {
+		file->is_tracked = 1;
+	}
+
+	return 1;
+}
+
+static struct manifest *parse(const char *component, const char *filename, struct manifest_reader *reader, bool header_only)
+{
+	char line[MANIFEST_LINE_MAXLEN], *c;
+	int err;
+	struct manifest *manifest;
+	size_t table_size = 0;
+	size_t filenames_len = 0;
+
 	manifest = calloc(1, sizeof(struct manifest));
 	ON_NULL_ABORT(manifest);
 
 	/* line 1: MANIFEST\t<version> */
-	line[0] = 0;
-	if (fgets(line, MANIFEST_LINE_MAXLEN, infile) == NULL) {
-		goto err_close;
+	if (!read_header_line(reader, line)) {
+		goto err;
 	}
 
 	if (strncmp_const(line, MANIFEST_HEADER) != 0) {
-		goto err_close;
+		goto err;
 	}
 
 	c = line + strlen_const(MANIFEST_HEADER);
@@ -68,21 +376,15 @@ struct manifest *manifest_parse(const char *component, const char *filename, boo
 
 	if (manifest->manifest_version <= 0 || err != 0) {
 		error("Loaded incompatible manifest version\n");
-		goto err_close;
+		goto err;
 	}
 
-	line[0] = 0;
-	while (strncmp_const(line, "\n") != 0) {
-		/* read the header */
-		line[0] = 0;
-		if (fgets(line, MANIFEST_LINE_MAXLEN, infile) == NULL) {
-			break;
-		}
-
+	/* read the header */
+	while (read_header_line(reader, line)) {
 		// Remove line break
 		c = strchr(line, '\n');
 		if (!c) {
-			goto err_close;
+			goto err;
 		}
 		*c = 0;
 
@@ -90,181 +392,132 @@ struct manifest *manifest_parse(const char *component, const char *filename, boo
 			break;
 		}
 
-		// Look for separator
-		c = strchr(line, '\t');
-		if (c) {
-			c++;
-		} else {
-			goto err_close;
-		}
-
-		if (strncmp_const(line, "version:\t") == 0) {
-			err = strtoi_err(c, &manifest->version);
-			if (err != 0) {
-				error("Invalid manifest version on %s\n", filename);
-				goto err_close;
-			}
-		} else if (strncmp_const(line, "filecount:\t") == 0) {
-			errno = 0;
-			filecount = strtoull(c, NULL, 10);
-			if (filecount > 4000000) {
-				/* Note on the number 4,000,000. We want this
-				 * to be big enough to allow Manifest.Full to
-				 * pass (currently about 450,000 March 18) but
-				 * small enough that when multiplied by
-				 * sizeof(struct file) it fits into
-				 * size_t. For a system with size_t being a 32
-				 * bit value, this constrains it to be less
-				 * than about 6,000,000, but close to infinity
-				 * for systems with 64 bit size_t.
-				 */
-				error("Preposterous (%llu) number of files in %s Manifest, more than 4 million skipping\n",
-				      filecount, component);
-				goto err_close;
-			} else if (errno != 0) {
-				error("Loaded incompatible manifest filecount\n");
-				goto err_close;
-			}
-		} else if (strncmp_const(line, "contentsize:\t") == 0) {
-			errno = 0;
-			contentsize = strtoull(c, NULL, 10);
-			if (contentsize > 2000000000000UL) {
-				error("Preposterous (%llu) size of files in %s Manifest, more than 2TB skipping\n",
-				      contentsize, component);
-				goto err_close;
-			} else if (errno != 0) {
-				error("Loaded incompatible manifest contentsize\n");
-				goto err_close;
-			}
-		} else if (strncmp_const(line, "includes:\t") == 0) {
-			includes = list_prepend_data(includes, strdup_or_die(c));
+		if (!parse_header_line(manifest, component, filename, line)) {
+			goto err;
 		}
 	}
 
 	manifest->component = strdup_or_die(component);
-	manifest->filecount = filecount;
-	manifest->contentsize = contentsize;
-	manifest->includes = includes;
 
 	if (header_only) {
-		fclose(infile);
 		return manifest;
 	}
 
-	/* empty line */
-	while (!feof(infile)) {
+	/* The manifest size is an upper bound for the size of all filenames */
+	manifest->filenames = malloc(reader->size + 1);
+	ON_NULL_ABORT(manifest->filenames);
+
+	/* Pre-size the file table using the header, but don't trust it more
+	 * than what could fit in the manifest */
+	table_size = manifest->filecount;
+	if (table_size > reader->size / MANIFEST_ENTRY_MINLEN + 1) {
+		table_size = reader->size / MANIFEST_ENTRY_MINLEN + 1;
+	}
+	if (table_size > 0) {
+		manifest->file_table = malloc(table_size * sizeof(struct file));
+		ON_NULL_ABORT(manifest->file_table);
+	}
+
+	for (;;) {
 		struct file *file;
+		const char *entry;
+		size_t len;
 
-		if (fgets(line, MANIFEST_LINE_MAXLEN, infile) == NULL) {
+		err = read_entry_line(reader, line, &entry, &len);
+		if (err == 0) {
 			break;
+		} else if (err < 0) {
+			goto err;
 		}
 
-		// Remove line break
-		c = strchr(line, '\n');
-		if (!c || c == line) {
-			goto err_close;
+		if (manifest->file_table_len == table_size) {
+			table_size += FILE_TABLE_STEP;
+			manifest->file_table = realloc(manifest->file_table, table_size * sizeof(struct file));
+			ON_NULL_ABORT(manifest->file_table);
 		}
-		*c = 0;
-
-		// Look for separator
-		c = strchr(line, '\t');
-		if (c) {
-			c++;
-		} else {
-			goto err_close;
+		file = &manifest->file_table[manifest->file_table_len];
+		memset(file, 0, sizeof(struct file));
+		file->in_file_table = 1;
+
+		err = parse_file_line(manifest, file, entry, len, &filenames_len);
+		if (err < 0) {
+			goto err;
+		} else if (err > 0) {
+			manifest->file_table_len++;
 		}
+	}
 
-		file = calloc(1, sizeof(struct file));
-		ON_NULL_ABORT(file);
-
-		if (line[0] == 'F') {
-			file->is_file = 1;
-		} else if (line[0] == 'D') {
-			file->is_dir = 1;
-		} else if (line[0] == 'L') {
-			file->is_link = 1;
-		} else if (line[0] == 'M') {
-			file->is_manifest = 1;
-		} else if (line[0] == 'I') {
-			/* ignore this file for future iterative manifest feature */
-			free(file);
-			continue;
-		}
+	for (size_t i = 0; i < manifest->file_table_len; i++) {
+		struct file *file = &manifest->file_table[i];
 
-		if (line[1] == 'd') {
-			file->is_deleted = 1;
-			deleted++;
-		} else if (line[1] == 'g') {
-			file->is_deleted = 1;
-			file->is_ghosted = 1;
-			deleted++;
-		} else if (line[1] == 'e') {
-			file->is_experimental = 1;
-		}
+		file->filename = manifest->filenames + (uintptr_t)file->filename;
+	}
+	build_file_lists(manifest);
 
-		if (line[2] == 'C') {
-			file->is_config = 1;
-		} else if (line[2] == 's') {
-			file->is_state = 1;
-		} else if (line[2] == 'b') {
-			file->is_boot = 1;
-		}
+	return manifest;
 
-		if (line[3] == 'r') {
-			/* rename flag is ignored */
-		} else if (line[3] == 'm') {
-			file->is_mix = 1;
-			manifest->is_mix = 1;
-		}
+err:
+	free_manifest(manifest);
+	return NULL;
+}
 
-		c2 = strchr(c, '\t');
-		if (c2) {
-			*c2 = 0;
-			c2++;
-		} else {
-			free(file);
-			goto err_close;
-		}
+struct manifest *manifest_parse_stdio(const char *component, const char *filename, bool header_only)
+{
+	struct manifest_reader reader = { 0 };
+	struct manifest *manifest;
+	struct stat st;
 
-		hash_assign(c, file->hash);
+	reader.stream = fopen(filename, "rbm");
+	if (reader.stream == NULL) {
+		return NULL;
+	}
 
-		c = c2;
-		c2 = strchr(c, '\t');
-		if (c2) {
-			*c2 = 0;
-			c2++;
-		} else {
-			free(file);
-			goto err_close;
-		}
+	if (fstat(fileno(reader.stream), &st) != 0) {
+		fclose(reader.stream);
+		return NULL;
+	}
+	reader.size = st.st_size;
 
-		err = strtoi_err(c, &file->last_change);
-		if (file->last_change <= 0 || err != 0) {
-			error("Loaded incompatible manifest last change\n");
-			free(file);
-			goto err_close;
-		}
+	manifest = parse(component, filename, &reader, header_only);
+	fclose(reader.stream);
 
-		c = c2;
+	return manifest;
+}
 
-		file->filename = strdup_or_die(c);
+struct manifest *manifest_parse(const char *component, const char *filename, bool header_only)
+{
+	struct manifest_reader reader = { 0 };
+	struct manifest *manifest;
+	struct stat st;
+	void *data;
+	int fd;
 
-		if (file->is_manifest) {
-			manifest->manifests = list_prepend_data(manifest->manifests, file);
-		} else {
-			file->is_tracked = 1;
-			manifest->files = list_prepend_data(manifest->files, file);
-		}
-		count++;
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
 	}
 
-	fclose(infile);
-	return manifest;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return manifest_parse_stdio(component, filename, header_only);
+	}
 
-err_close:
-	free_manifest(manifest);
-	fclose(infile);
-	return NULL;
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return manifest_parse_stdio(component, filename, header_only);
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	reader.data = data;
+	reader.pos = data;
+	reader.end = reader.data + st.st_size;
+	reader.size = st.st_size;
+
+	manifest = parse(component, filename, &reader, header_only);
+	munmap(data, st.st_size);
+
+	return manifest;
 }
 
 void free_manifest_data(void *data)
@@ -289,6 +542,15 @@ void free_manifest(struct manifest *manifest)
 	} else {
 		list_free_list_and_data(manifest->files, free_file_data);
 	}
+
+	/* Entries that were already removed from the lists may still have
+	 * data to be released */
+	for (size_t i = 0; i < manifest->file_table_len; i++) {
+		free_file_data(&manifest->file_table[i]);
+	}
+	free(manifest->file_table);
+	free(manifest->filenames);
+	free(manifest->files_by_name);
 	if (manifest->includes) {
 		list_free_list_and_data(manifest->includes, free);
 	}
@@ -31,6 +31,7 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "download_size.h"
 #include "signature.h"
 #include "swupd.h"
 #include "swupd_build_variant.h"
@@ -153,16 +154,41 @@ static int download_pack(struct swupd_curl_parallel_handle *download_handle, int
 	return err;
 }
 
+/*
+ * A pack from version 0 has all files of the bundle, so the content size of
+ * the bundle manifest, which is the size of the files uncompressed, can be
+ * used as an estimate of its size.
+ */
+static uint64_t pack_estimate_size(struct sub *sub, struct manifest *mom)
+{
+	struct list *list;
+
+	if (sub->oldversion != 0) {
+		return 0;
+	}
+
+	for (list = mom->submanifests; list; list = list->next) {
+		struct manifest *manifest = list->data;
+
+		if (strcmp(manifest->component, sub->component) == 0) {
+			return manifest->contentsize;
+		}
+	}
+
+	return 0;
+}
+
 static double packs_query_total_download_size(struct list *subs, struct manifest *mom)
 {
-	long size = 0;
-	long total_size = 0;
+	double total_size;
 	struct sub *sub = NULL;
 	struct list *list = NULL;
 	struct file *bundle = NULL;
-	char *url = NULL;
+	struct download_size *ds;
+	char *name = NULL;
 	int count = 0;
 
+	ds = download_size_new();
 	for (list = list_head(subs); list; list = list->next) {
 		sub = list->data;
 
@@ -170,29 +196,28 @@ static double packs_query_total_download_size(struct list *subs, struct manifest
 		bundle = search_bundle_in_manifest(mom, sub->component);
 		if (!bundle) {
 			debug("The manifest for bundle %s was not found in the MoM", sub->component);
+			download_size_free(ds);
 			return -SWUPD_INVALID_BUNDLE;
 		}
 		if (bundle->is_mix) {
 			continue;
 		}
 
-		string_or_die(&url, "%s/%i/pack-%s-from-%i.tar", content_url, sub->version, sub->component, sub->oldversion);
-		size = swupd_curl_query_content_size(url);
-		if (size != -1) {
-			total_size += size;
-		} else {
-			debug("The pack header for bundle %s could not be downloaded\n", sub->component);
-			free_string(&url);
-			return -SWUPD_COULDNT_DOWNLOAD_FILE;
-		}
-
+		string_or_die(&name, "pack-%s-from-%i.tar", sub->component, sub->oldversion);
+		download_size_add(ds, sub->version, name, pack_estimate_size(sub, mom));
+		free_string(&name);
 		count++;
-		debug("Pack: %s (%.2lf Mb)\n", url, (double)size / 1000000);
-		free_string(&url);
+	}
+
+	total_size = download_size_total(ds);
+	download_size_free(ds);
+	if (total_size < 0) {
+		debug("The size of the packs to download could not be found\n");
+		return -SWUPD_COULDNT_DOWNLOAD_FILE;
 	}
 
 	debug("Number of packs to download: %d\n", count);
-	debug("Total size of packs to be downloaded: %.2lf Mb\n", (double)total_size / 1000000);
+	debug("Total size of packs to be downloaded: %.2lf Mb\n", total_size / 1000000);
 	return total_size;
 }
 
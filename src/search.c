@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +34,9 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "download_size.h"
+#include "lib/hashmap.h"
+#include "search_index.h"
 #include "swupd.h"
 
 /*
@@ -71,6 +75,7 @@ static regex_t regexp_comp;
 // Context
 static struct list *bundle_size_cache = NULL;
 static struct list *manifest_header_cache = NULL;
+static struct search_index *search_index = NULL;
 
 static int bundle_cmp(const void *bundle, const void *bundle_name)
 {
@@ -272,23 +277,25 @@ static bool file_matches(const char *filename, const char *search_term)
 	return regexec(&regexp_comp, filename, 0, NULL, 0) == 0;
 }
 
-static int search_in_manifest(struct manifest *mom, struct file *manifest_file, const char *search_term)
-{
-	struct list *l;
-	int count = 0;
-	struct manifest *m;
-	struct list *files = NULL;
+/* Matches found in a bundle by search_manifest() */
+struct bundle_results {
+	struct file *bundle;
+	struct list *files;
+	struct list *tail;
+	int count;
+};
 
-	// If manifest was not downloaded in download_all_manifests, skip this
-	// to avoid trying to download it again
-	if (!list_search(manifest_header_cache, manifest_file->filename, manifest_str_cmp)) {
-		return -ENOENT;
-	}
+struct search_context {
+	const char *search_term;
+	struct bundle_results *results;
+};
 
-	m = load_manifest(manifest_file->last_change, manifest_file, mom, false, NULL);
-	if (!m) {
-		return -ENOENT;
-	}
+/* Find the matches in one bundle, called from the thread pool */
+static void search_manifest(struct manifest *m, size_t index, void *data)
+{
+	struct search_context *ctx = data;
+	struct bundle_results *results = &ctx->results[index];
+	struct list *l;
 
 	for (l = m->files; l; l = l->next) {
 		struct file *file = l->data;
@@ -305,47 +312,169 @@ static int search_in_manifest(struct manifest *mom, struct file *manifest_file,
 			continue;
 		}
 
-		if (file_matches(file->filename, search_term)) {
-			if (count == 0) {
-				print_bundle(manifest_file);
-			}
-			count++;
-
-			// Print now or save to sort and print later?
-			if (sort == SORT_TYPE_ALPHA) {
-				files = list_prepend_data(files, file->filename);
-			} else {
-				if (count > num_results) {
-					break;
+		if (file_matches(file->filename, ctx->search_term)) {
+			results->count++;
+
+			// Keep only what is going to be printed, unless the
+			// results still need to be sorted
+			if (sort == SORT_TYPE_ALPHA || results->count <= num_results) {
+				results->tail = list_append_data(results->tail, strdup_or_die(file->filename));
+				if (!results->files) {
+					results->files = results->tail;
 				}
-				print_result(m->component, file->filename);
 			}
 		}
 	}
+}
 
-	// Sort and print results if postponed
-	if (sort == SORT_TYPE_ALPHA) {
-		files = list_sort(files, list_strcmp);
-		for (l = files; l; l = l->next) {
-			if (count > num_results) {
-				break;
-			}
-			print_result(m->component, l->data);
+/* Search all bundles in parallel and print the results in the order of
+ * mom->manifests */
+static int search_in_manifests(struct manifest *mom, const char *search_term)
+{
+	struct search_context ctx;
+	struct list *files = NULL;
+	struct list *l;
+	size_t count = 0, i;
+	int found = 0;
+	int ret = 0;
+
+	// If manifest was not downloaded in download_all_manifests, skip this
+	// to avoid trying to download it again
+	for (l = mom->manifests; l; l = l->next) {
+		struct file *file = l->data;
+
+		if (!list_search(manifest_header_cache, file->filename, manifest_str_cmp)) {
+			ret = -ENOENT;
+			continue;
+		}
+		files = list_append_data(files, file);
+		count++;
+	}
+	files = list_head(files);
+
+	ctx.search_term = search_term;
+	ctx.results = calloc(count + 1, sizeof(struct bundle_results));
+	ON_NULL_ABORT(ctx.results);
+	for (i = 0, l = files; l; l = l->next, i++) {
+		ctx.results[i].bundle = l->data;
+	}
+
+	if (process_manifests(mom, files, search_manifest, &ctx) != 0) {
+		ret = -ENOENT;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct bundle_results *results = &ctx.results[i];
+		int printed = 0;
+
+		if (results->count == 0) {
+			continue;
 		}
+
+		if (sort == SORT_TYPE_ALPHA) {
+			results->files = list_sort(results->files, list_strcmp);
+		}
+
+		print_bundle(results->bundle);
+		for (l = results->files; l && printed < num_results; l = l->next, printed++) {
+			print_result(results->bundle->filename, l->data);
+		}
+		found += results->count;
+		list_free_list_and_data(results->files, free);
 	}
 
+	free(ctx.results);
 	list_free_list(files);
-	free_manifest(m);
 
-	return count;
+	return ret < 0 ? ret : found;
+}
+
+struct index_results {
+	const char *search_term;
+	uint32_t bundles_len;
+	struct list **files;
+	struct list **tails;
+	int *counts;
+};
+
+static void index_match(const char *filename, const uint32_t *bundles, uint32_t bundles_len, void *data)
+{
+	struct index_results *results = data;
+	uint32_t i;
+
+	if (!is_path_in_search_type(filename) || !file_matches(filename, results->search_term)) {
+		return;
+	}
+
+	for (i = 0; i < bundles_len; i++) {
+		uint32_t id = bundles[i];
+
+		/* Files are reported sorted, so just keep the order */
+		results->tails[id] = list_append_data(results->tails[id], (void *)filename);
+		if (!results->files[id]) {
+			results->files[id] = results->tails[id];
+		}
+		results->counts[id]++;
+	}
+}
+
+/* Search using the index, printing results in the same order of
+ * search_in_manifest() */
+static int search_in_index(struct manifest *mom, const char *search_term)
+{
+	struct index_results results;
+	struct list *literals, *l, *f;
+	int found = 0;
+	uint32_t i;
+
+	if (regexp) {
+		literals = search_index_regex_literals(search_term);
+	} else {
+		literals = list_prepend_data(NULL, strdup_or_die(search_term));
+	}
+
+	results.search_term = search_term;
+	results.bundles_len = search_index_bundles_len(search_index);
+	results.files = calloc(results.bundles_len + 1, sizeof(struct list *));
+	ON_NULL_ABORT(results.files);
+	results.tails = calloc(results.bundles_len + 1, sizeof(struct list *));
+	ON_NULL_ABORT(results.tails);
+	results.counts = calloc(results.bundles_len + 1, sizeof(int));
+	ON_NULL_ABORT(results.counts);
+
+	search_index_query(search_index, literals, index_match, &results);
+
+	for (l = mom->manifests; l; l = l->next) {
+		struct file *bundle = l->data;
+		int count = 0;
+		int id;
+
+		id = search_index_bundle_id(search_index, bundle->filename);
+		if (id < 0 || results.counts[id] == 0) {
+			continue;
+		}
+
+		print_bundle(bundle);
+		for (f = results.files[id]; f && count < num_results; f = f->next, count++) {
+			print_result(bundle->filename, f->data);
+		}
+		found += results.counts[id];
+	}
+
+	for (i = 0; i < results.bundles_len; i++) {
+		list_free_list(results.files[i]);
+	}
+	free(results.counts);
+	free(results.tails);
+	free(results.files);
+	list_free_list_and_data(literals, free);
+
+	return found;
 }
 
 static int do_search(struct manifest *mom, const char *search_term)
 {
-	struct list *l;
 	int ret = 0;
-	int found = 0;
-	int err;
 	int regexp_err;
 
 	if (sort == SORT_TYPE_ALPHA_BUNDLES_ONLY || sort == SORT_TYPE_ALPHA) {
@@ -367,16 +496,10 @@ static int do_search(struct manifest *mom, const char *search_term)
 		info("File results may be truncated\n");
 	}
 
-	for (l = mom->manifests; l; l = l->next) {
-		struct file *file = l->data;
-		err = search_in_manifest(mom, file, search_term);
-
-		// Save error, but don't abort
-		if (err < 0) {
-			ret = err;
-		} else {
-			found += err;
-		}
+	if (search_index) {
+		ret = search_in_index(mom, search_term);
+	} else {
+		ret = search_in_manifests(mom, search_term);
 	}
 
 	if (regexp) {
@@ -384,17 +507,18 @@ static int do_search(struct manifest *mom, const char *search_term)
 	}
 
 error:
-	return ret < 0 ? ret : found;
+	return ret;
 }
 
 static double query_total_download_size(struct list *list)
 {
-	double ret;
-	double size_sum = 0;
+	double size_sum;
+	struct download_size *ds;
 	struct file *file = NULL;
 	char *untard_file = NULL;
-	char *url = NULL;
+	char *name = NULL;
 
+	ds = download_size_new();
 	while (list) {
 		file = list->data;
 		list = list->next;
@@ -404,24 +528,21 @@ static double query_total_download_size(struct list *list)
 
 		if (access(untard_file, F_OK) == -1) {
 			/* Does not exist client-side. Must download */
-			string_or_die(&url, "%s/%i/Manifest.%s.tar", content_url,
-				      file->last_change, file->filename);
-
-			ret = swupd_curl_query_content_size(url);
-			free_string(&url);
-			if (ret != -1) {
-				/* Convert file size from bytes to MB */
-				ret = ret / 1000000;
-				size_sum += ret;
-			} else {
-				free_string(&untard_file);
-				return ret;
-			}
+			string_or_die(&name, "Manifest.%s.tar", file->filename);
+			download_size_add(ds, file->last_change, name, 0);
+			free_string(&name);
 		}
 		free_string(&untard_file);
 	}
 
-	return size_sum;
+	size_sum = download_size_total(ds);
+	download_size_free(ds);
+	if (size_sum < 0) {
+		return size_sum;
+	}
+
+	/* Convert file size from bytes to MB */
+	return size_sum / 1000000;
 }
 
 /* download_manifests()
@@ -434,7 +555,7 @@ static enum swupd_code download_all_manifests(struct manifest *mom, struct list
 	int ret = 0;
 	int failed_count = 0;
 	double size;
-	unsigned int complete = 0;
+	unsigned int complete;
 	unsigned int total;
 
 	size = query_total_download_size(mom->manifests);
@@ -444,11 +565,24 @@ static enum swupd_code download_all_manifests(struct manifest *mom, struct list
 		info("Downloading Clear Linux manifests (%.2f MB)\n", size);
 	}
 
+	/* Download and parse the headers concurrently */
 	total = list_len(mom->manifests);
+	*manifest_list = load_manifests(mom, mom->manifests, true);
+	complete = list_len(*manifest_list);
+	progress_report(complete, total);
+	if (complete == total) {
+		return ret;
+	}
+
+	/* Retry the ones that failed one at a time, reporting errors */
 	for (list = mom->manifests; list; list = list->next) {
 		struct file *file = list->data;
 		int manifest_err;
 
+		if (list_search(*manifest_list, file->filename, manifest_str_cmp)) {
+			continue;
+		}
+
 		/* Do download */
 		manifest = load_manifest(file->last_change, file, mom, true, &manifest_err);
 		complete++;
@@ -464,9 +598,9 @@ static enum swupd_code download_all_manifests(struct manifest *mom, struct list
 			if (manifest_err == -EIO) {
 				break;
 			}
+		} else {
+			*manifest_list = list_prepend_data(*manifest_list, manifest);
 		}
-
-		*manifest_list = list_prepend_data(*manifest_list, manifest);
 		progress_report(complete, total);
 	}
 
@@ -477,6 +611,92 @@ static enum swupd_code download_all_manifests(struct manifest *mom, struct list
 	return ret;
 }
 
+/* Identifies the bundle manifests of the MoM, to check if the search index
+ * was created from the same manifests */
+static uint64_t mom_fingerprint(struct manifest *mom)
+{
+	char hash[SWUPD_HASH_LEN];
+	char *str = NULL;
+	uint64_t fingerprint = 0;
+	struct list *l;
+
+	for (l = mom->manifests; l; l = l->next) {
+		struct file *file = l->data;
+
+		hash_to_hex(&file->hash, hash);
+		string_or_die(&str, "%s %s", file->filename, hash);
+		fingerprint += hashmap_hash_from_string(str);
+		free_string(&str);
+	}
+
+	return fingerprint;
+}
+
+struct index_context {
+	struct search_index_builder *builder;
+	pthread_mutex_t lock;
+};
+
+/* Add the files of a bundle to the index, called from the thread pool */
+static void index_manifest(struct manifest *m, size_t index, void *data)
+{
+	struct index_context *ctx = data;
+	struct list *l;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (l = m->files; l; l = l->next) {
+		struct file *file = l->data;
+
+		if ((file->is_file || file->is_link) && !file->is_deleted) {
+			search_index_builder_add_file(ctx->builder, index, file->filename);
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Load the search index of this MoM, creating it if needed. The index is
+ * only created when all bundle manifests are available. */
+static struct search_index *load_search_index(struct manifest *mom)
+{
+	struct index_context ctx;
+	struct search_index *index = NULL;
+	uint64_t fingerprint;
+	char *filename = NULL;
+	struct list *l;
+
+	fingerprint = mom_fingerprint(mom);
+	string_or_die(&filename, "%s/%i/%s", state_dir, mom->version, SEARCH_INDEX_FILENAME);
+
+	index = search_index_load(filename, mom->version, fingerprint);
+	if (index) {
+		goto out;
+	}
+
+	/* Bundle ids are the positions in mom->manifests */
+	ctx.builder = search_index_builder_new();
+	pthread_mutex_init(&ctx.lock, NULL);
+	for (l = mom->manifests; l; l = l->next) {
+		struct file *file = l->data;
+
+		search_index_builder_add_bundle(ctx.builder, file->filename);
+	}
+
+	if (process_manifests(mom, mom->manifests, index_manifest, &ctx) != 0) {
+		debug("Search index not created, some manifests are missing\n");
+	} else if (search_index_builder_write(ctx.builder, filename, mom->version, fingerprint)) {
+		index = search_index_load(filename, mom->version, fingerprint);
+	} else {
+		debug("Unable to save search index %s\n", filename);
+	}
+
+	pthread_mutex_destroy(&ctx.lock);
+	search_index_builder_free(ctx.builder);
+
+out:
+	free_string(&filename);
+	return index;
+}
+
 static void print_help(void)
 {
 	print("Usage:\n");
@@ -633,6 +853,11 @@ enum swupd_code search_main(int argc, char **argv)
 		goto clean_exit;
 	}
 
+	/* The index can't be used if any manifest is missing */
+	if (ret == 0) {
+		search_index = load_search_index(mom);
+	}
+
 	if (init) {
 		info("Successfully retrieved manifests. Exiting\n");
 		ret = SWUPD_OK;
@@ -651,6 +876,7 @@ enum swupd_code search_main(int argc, char **argv)
 	}
 
 clean_exit:
+	search_index_free(search_index);
 	free_manifest(mom);
 	list_free_list_and_data(bundle_size_cache, bundle_size_free);
 	list_free_list_and_data(manifest_header_cache, free_manifest_data);
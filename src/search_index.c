@@ -0,0 +1,957 @@
+/*
+ *   Software Updater - client side
+ *
+ *      Copyright © 2019 Intel Corporation.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 2 or later of the License.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lib/hashmap.h"
+#include "search_index.h"
+#include "swupd.h"
+
+/*
+ * The search index has a dictionary with the filenames of all bundles, sorted
+ * by name, and the ids of the bundles each file is part of. For each trigram
+ * (3 consecutive bytes, with ASCII letters in lower case) found in any
+ * filename there's a posting list with the ids of the files that contain it.
+ * A file can only contain a string if it contains all trigrams of that
+ * string, so a query only needs to check the files in the intersection of
+ * the posting lists.
+ *
+ * The file is position independent and used directly from a memory map:
+ * a header, followed by the trigrams table (sorted by trigram), the files,
+ * the bundles (sorted by name), the bundle ids of each file, the posting
+ * lists and the strings. Posting lists are sorted, stored as the difference
+ * from the previous id and encoded as LEB128 variable length integers.
+ */
+
+#define SEARCH_INDEX_MAGIC "SWUPDSI"
+#define SEARCH_INDEX_VERSION 1
+
+#define TRIGRAM_LEN 3
+
+struct search_index_header {
+	char magic[8];
+	uint32_t version;
+	int32_t mom_version;
+	uint64_t fingerprint;
+	uint32_t trigrams_len;
+	uint32_t files_len;
+	uint32_t bundles_len;
+	uint32_t file_bundles_len;
+	uint64_t postings_size;
+	uint64_t strings_size;
+};
+
+struct search_index_trigram {
+	uint32_t trigram;
+	uint32_t count;
+	uint64_t postings;
+};
+
+struct search_index_file {
+	uint32_t filename;
+	uint32_t bundles;
+	uint32_t bundles_len;
+};
+
+struct search_index {
+	void *data;
+	size_t size;
+	const struct search_index_header *header;
+	const struct search_index_trigram *trigrams;
+	const struct search_index_file *files;
+	const uint32_t *bundles;
+	const uint32_t *file_bundles;
+	const uint8_t *postings;
+	const char *strings;
+};
+
+/* A file being added to the index */
+struct builder_file {
+	char *filename;
+	size_t hash_key;
+	uint32_t *bundles;
+	uint32_t bundles_len;
+	uint32_t bundles_size;
+};
+
+/* Posting list of one trigram being created */
+struct builder_postings {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	uint32_t count;
+	uint32_t last; /* last file id added plus one */
+};
+
+struct search_index_builder {
+	struct hashmap *files;
+	struct list *bundles;
+	uint32_t bundles_len;
+};
+
+static inline uint8_t fold_case(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static inline uint32_t get_trigram(const char *str)
+{
+	return (uint32_t)fold_case(str[0]) << 16 | (uint32_t)fold_case(str[1]) << 8 | fold_case(str[2]);
+}
+
+static bool builder_file_equal(const void *a, const void *b)
+{
+	const struct builder_file *fa = a;
+	const struct builder_file *fb = b;
+
+	return fa->hash_key == fb->hash_key && strcmp(fa->filename, fb->filename) == 0;
+}
+
+static size_t builder_file_hash(const void *data)
+{
+	return ((const struct builder_file *)data)->hash_key;
+}
+
+static void builder_file_free(void *data)
+{
+	struct builder_file *file = data;
+
+	free(file->filename);
+	free(file->bundles);
+	free(file);
+}
+
+struct search_index_builder *search_index_builder_new(void)
+{
+	struct search_index_builder *builder;
+
+	builder = calloc(1, sizeof(struct search_index_builder));
+	ON_NULL_ABORT(builder);
+	builder->files = hashmap_new(0, builder_file_equal, builder_file_hash);
+
+	return builder;
+}
+
+uint32_t search_index_builder_add_bundle(struct search_index_builder *builder, const char *bundle)
+{
+	builder->bundles = list_append_data(builder->bundles, strdup_or_die(bundle));
+
+	return builder->bundles_len++;
+}
+
+void search_index_builder_add_file(struct search_index_builder *builder, uint32_t bundle, const char *filename)
+{
+	struct builder_file key, *file;
+
+	key.filename = (char *)filename;
+	key.hash_key = hashmap_hash_from_string(filename);
+	file = hashmap_get(builder->files, &key);
+	if (!file) {
+		file = calloc(1, sizeof(struct builder_file));
+		ON_NULL_ABORT(file);
+		file->filename = strdup_or_die(filename);
+		file->hash_key = key.hash_key;
+		hashmap_put(builder->files, file);
+	} else if (file->bundles_len > 0 && file->bundles[file->bundles_len - 1] == bundle) {
+		return;
+	}
+
+	if (file->bundles_len == file->bundles_size) {
+		file->bundles_size = file->bundles_size ? file->bundles_size * 2 : 1;
+		file->bundles = realloc(file->bundles, file->bundles_size * sizeof(uint32_t));
+		ON_NULL_ABORT(file->bundles);
+	}
+	file->bundles[file->bundles_len++] = bundle;
+}
+
+void search_index_builder_free(struct search_index_builder *builder)
+{
+	if (!builder) {
+		return;
+	}
+
+	hashmap_free_hash_and_data(builder->files, builder_file_free);
+	list_free_list_and_data(builder->bundles, free);
+	free(builder);
+}
+
+static int cmp_builder_file(const void *a, const void *b)
+{
+	return strcmp((*(struct builder_file *const *)a)->filename, (*(struct builder_file *const *)b)->filename);
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a;
+	uint32_t ub = *(const uint32_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+struct bundle_name {
+	const char *name;
+	uint32_t id;
+};
+
+static int cmp_bundle_name(const void *a, const void *b)
+{
+	return strcmp(((const struct bundle_name *)a)->name, ((const struct bundle_name *)b)->name);
+}
+
+static void postings_add(struct builder_postings *postings, uint32_t id)
+{
+	uint32_t delta;
+
+	/* Trigram repeated in the same file */
+	if (postings->last == id + 1) {
+		return;
+	}
+
+	delta = postings->count ? id - (postings->last - 1) : id;
+	if (postings->size - postings->len < 5) {
+		postings->size = postings->size ? postings->size * 2 : 16;
+		postings->data = realloc(postings->data, postings->size);
+		ON_NULL_ABORT(postings->data);
+	}
+
+	while (delta >= 0x80) {
+		postings->data[postings->len++] = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	postings->data[postings->len++] = delta;
+
+	postings->last = id + 1;
+	postings->count++;
+}
+
+/* Posting lists of all trigrams, indexed by the first two bytes and then by
+ * the last one, so they are iterated in trigram order. */
+struct builder_trigrams {
+	struct builder_postings **table[1 << 16];
+};
+
+static struct builder_postings *get_postings(struct builder_trigrams *trigrams, uint32_t trigram)
+{
+	struct builder_postings **block = trigrams->table[trigram >> 8];
+
+	if (!block) {
+		block = calloc(1 << 8, sizeof(struct builder_postings *));
+		ON_NULL_ABORT(block);
+		trigrams->table[trigram >> 8] = block;
+	}
+
+	if (!block[trigram & 0xff]) {
+		block[trigram & 0xff] = calloc(1, sizeof(struct builder_postings));
+		ON_NULL_ABORT(block[trigram & 0xff]);
+	}
+
+	return block[trigram & 0xff];
+}
+
+static void free_trigrams(struct builder_trigrams *trigrams)
+{
+	size_t i, j;
+
+	for (i = 0; i < (1 << 16); i++) {
+		if (!trigrams->table[i]) {
+			continue;
+		}
+		for (j = 0; j < (1 << 8); j++) {
+			if (trigrams->table[i][j]) {
+				free(trigrams->table[i][j]->data);
+				free(trigrams->table[i][j]);
+			}
+		}
+		free(trigrams->table[i]);
+	}
+	free(trigrams);
+}
+
+static bool write_index(FILE *f, struct search_index_header *header, struct builder_trigrams *trigrams,
+			struct builder_file **files, struct bundle_name *bundles)
+{
+	struct search_index_trigram entry;
+	struct search_index_file file;
+	uint64_t postings = 0;
+	uint32_t strings = 0, file_bundles = 0;
+	size_t i, j;
+
+	if (fwrite(header, sizeof(*header), 1, f) != 1) {
+		return false;
+	}
+
+	for (i = 0; i < (1 << 16); i++) {
+		if (!trigrams->table[i]) {
+			continue;
+		}
+		for (j = 0; j < (1 << 8); j++) {
+			struct builder_postings *p = trigrams->table[i][j];
+
+			if (!p) {
+				continue;
+			}
+			entry.trigram = i << 8 | j;
+			entry.count = p->count;
+			entry.postings = postings;
+			postings += p->len;
+			if (fwrite(&entry, sizeof(entry), 1, f) != 1) {
+				return false;
+			}
+		}
+	}
+
+	/* Bundle names first in the strings, then filenames */
+	for (i = 0; i < header->bundles_len; i++) {
+		strings += strlen(bundles[i].name) + 1;
+	}
+	for (i = 0; i < header->files_len; i++) {
+		file.filename = strings;
+		file.bundles = file_bundles;
+		file.bundles_len = files[i]->bundles_len;
+		strings += strlen(files[i]->filename) + 1;
+		file_bundles += files[i]->bundles_len;
+		if (fwrite(&file, sizeof(file), 1, f) != 1) {
+			return false;
+		}
+	}
+
+	strings = 0;
+	for (i = 0; i < header->bundles_len; i++) {
+		if (fwrite(&strings, sizeof(strings), 1, f) != 1) {
+			return false;
+		}
+		strings += strlen(bundles[i].name) + 1;
+	}
+
+	for (i = 0; i < header->files_len; i++) {
+		if (fwrite(files[i]->bundles, sizeof(uint32_t), files[i]->bundles_len, f) != files[i]->bundles_len) {
+			return false;
+		}
+	}
+
+	for (i = 0; i < (1 << 16); i++) {
+		if (!trigrams->table[i]) {
+			continue;
+		}
+		for (j = 0; j < (1 << 8); j++) {
+			struct builder_postings *p = trigrams->table[i][j];
+
+			if (p && fwrite(p->data, 1, p->len, f) != p->len) {
+				return false;
+			}
+		}
+	}
+
+	for (i = 0; i < header->bundles_len; i++) {
+		if (fputs(bundles[i].name, f) == EOF || fputc('\0', f) == EOF) {
+			return false;
+		}
+	}
+	for (i = 0; i < header->files_len; i++) {
+		if (fputs(files[i]->filename, f) == EOF || fputc('\0', f) == EOF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool search_index_builder_write(struct search_index_builder *builder, const char *filename, int version, uint64_t fingerprint)
+{
+	struct search_index_header header = { 0 };
+	struct builder_trigrams *trigrams;
+	struct builder_file **files, *file;
+	struct bundle_name *bundles;
+	uint32_t *bundle_ids;
+	struct list *iter;
+	char *tmp_filename = NULL;
+	uint64_t strings_size = 0, file_bundles_len = 0;
+	size_t files_len, i, j;
+	bool ret = false;
+	FILE *f;
+
+	/* Bundles are saved sorted by name, so ids change */
+	bundles = calloc(builder->bundles_len + 1, sizeof(struct bundle_name));
+	ON_NULL_ABORT(bundles);
+	bundle_ids = calloc(builder->bundles_len + 1, sizeof(uint32_t));
+	ON_NULL_ABORT(bundle_ids);
+	for (i = 0, iter = list_head(builder->bundles); iter; iter = iter->next, i++) {
+		bundles[i].name = iter->data;
+		bundles[i].id = i;
+		strings_size += strlen(iter->data) + 1;
+	}
+	qsort(bundles, builder->bundles_len, sizeof(struct bundle_name), cmp_bundle_name);
+	for (i = 0; i < builder->bundles_len; i++) {
+		bundle_ids[bundles[i].id] = i;
+	}
+
+	files_len = hashmap_len(builder->files);
+	files = malloc((files_len + 1) * sizeof(struct builder_file *));
+	ON_NULL_ABORT(files);
+	j = 0;
+	HASHMAP_FOREACH(builder->files, i, file)
+	{
+		files[j++] = file;
+	}
+	qsort(files, files_len, sizeof(struct builder_file *), cmp_builder_file);
+
+	trigrams = calloc(1, sizeof(struct builder_trigrams));
+	ON_NULL_ABORT(trigrams);
+
+	for (i = 0; i < files_len; i++) {
+		const char *name = files[i]->filename;
+		size_t len = strlen(name);
+
+		for (j = 0; j < files[i]->bundles_len; j++) {
+			files[i]->bundles[j] = bundle_ids[files[i]->bundles[j]];
+		}
+		qsort(files[i]->bundles, files[i]->bundles_len, sizeof(uint32_t), cmp_uint32);
+		file_bundles_len += files[i]->bundles_len;
+		strings_size += len + 1;
+
+		for (j = 0; j + TRIGRAM_LEN <= len; j++) {
+			postings_add(get_postings(trigrams, get_trigram(name + j)), i);
+		}
+	}
+
+	if (strings_size > UINT32_MAX || file_bundles_len > UINT32_MAX) {
+		goto out;
+	}
+
+	memcpy(header.magic, SEARCH_INDEX_MAGIC, sizeof(SEARCH_INDEX_MAGIC));
+	header.version = SEARCH_INDEX_VERSION;
+	header.mom_version = version;
+	header.fingerprint = fingerprint;
+	header.files_len = files_len;
+	header.bundles_len = builder->bundles_len;
+	header.file_bundles_len = file_bundles_len;
+	header.strings_size = strings_size;
+	for (i = 0; i < (1 << 16); i++) {
+		if (!trigrams->table[i]) {
+			continue;
+		}
+		for (j = 0; j < (1 << 8); j++) {
+			if (trigrams->table[i][j]) {
+				header.trigrams_len++;
+				header.postings_size += trigrams->table[i][j]->len;
+			}
+		}
+	}
+
+	/* Write to a temporary file, so an incomplete index is never used */
+	string_or_die(&tmp_filename, "%s.new", filename);
+	f = fopen(tmp_filename, "we");
+	if (!f) {
+		goto out;
+	}
+
+	ret = write_index(f, &header, trigrams, files, bundles);
+	if (fclose(f) != 0) {
+		ret = false;
+	}
+	if (!ret || rename(tmp_filename, filename) != 0) {
+		unlink(tmp_filename);
+		ret = false;
+	}
+
+out:
+	free_string(&tmp_filename);
+	free_trigrams(trigrams);
+	free(files);
+	free(bundle_ids);
+	free(bundles);
+
+	return ret;
+}
+
+/* Check that the header describes a file of exactly 'size' bytes */
+static bool check_header(const struct search_index_header *header, size_t size)
+{
+	uint64_t expected;
+
+	if (memcmp(header->magic, SEARCH_INDEX_MAGIC, sizeof(SEARCH_INDEX_MAGIC)) != 0 ||
+	    header->version != SEARCH_INDEX_VERSION) {
+		return false;
+	}
+
+	expected = sizeof(struct search_index_header);
+	expected += (uint64_t)header->trigrams_len * sizeof(struct search_index_trigram);
+	expected += (uint64_t)header->files_len * sizeof(struct search_index_file);
+	expected += (uint64_t)header->bundles_len * sizeof(uint32_t);
+	expected += (uint64_t)header->file_bundles_len * sizeof(uint32_t);
+	expected += header->postings_size;
+	expected += header->strings_size;
+
+	return expected == size;
+}
+
+/* Check all offsets, so the index can be used without any other check */
+static bool check_index(struct search_index *index)
+{
+	const struct search_index_header *header = index->header;
+	uint64_t postings = 0;
+	uint32_t i;
+
+	/* All strings are NUL terminated, so any offset in range is valid */
+	if (header->strings_size == 0 || index->strings[header->strings_size - 1] != '\0') {
+		return false;
+	}
+
+	for (i = 0; i < header->trigrams_len; i++) {
+		if (index->trigrams[i].postings < postings ||
+		    index->trigrams[i].postings > header->postings_size ||
+		    (i > 0 && index->trigrams[i].trigram <= index->trigrams[i - 1].trigram)) {
+			return false;
+		}
+		postings = index->trigrams[i].postings;
+	}
+
+	for (i = 0; i < header->bundles_len; i++) {
+		if (index->bundles[i] >= header->strings_size ||
+		    (i > 0 && strcmp(index->strings + index->bundles[i - 1], index->strings + index->bundles[i]) >= 0)) {
+			return false;
+		}
+	}
+
+	for (i = 0; i < header->files_len; i++) {
+		const struct search_index_file *file = &index->files[i];
+
+		if (file->filename >= header->strings_size ||
+		    file->bundles > header->file_bundles_len ||
+		    file->bundles_len > header->file_bundles_len - file->bundles) {
+			return false;
+		}
+	}
+
+	for (i = 0; i < header->file_bundles_len; i++) {
+		if (index->file_bundles[i] >= header->bundles_len) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct search_index *search_index_load(const char *filename, int version, uint64_t fingerprint)
+{
+	struct search_index *index;
+	const struct search_index_header *header;
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct search_index_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+
+	header = data;
+	if (!check_header(header, st.st_size) ||
+	    header->mom_version != version || header->fingerprint != fingerprint) {
+		munmap(data, st.st_size);
+		debug("Ignoring search index %s\n", filename);
+		return NULL;
+	}
+
+	index = calloc(1, sizeof(struct search_index));
+	ON_NULL_ABORT(index);
+	index->data = data;
+	index->size = st.st_size;
+	index->header = header;
+	index->trigrams = (const struct search_index_trigram *)(header + 1);
+	index->files = (const struct search_index_file *)(index->trigrams + header->trigrams_len);
+	index->bundles = (const uint32_t *)(index->files + header->files_len);
+	index->file_bundles = index->bundles + header->bundles_len;
+	index->postings = (const uint8_t *)(index->file_bundles + header->file_bundles_len);
+	index->strings = (const char *)(index->postings + header->postings_size);
+
+	if (!check_index(index)) {
+		debug("Ignoring invalid search index %s\n", filename);
+		search_index_free(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+void search_index_free(struct search_index *index)
+{
+	if (!index) {
+		return;
+	}
+
+	munmap(index->data, index->size);
+	free(index);
+}
+
+uint32_t search_index_bundles_len(struct search_index *index)
+{
+	return index->header->bundles_len;
+}
+
+int search_index_bundle_id(struct search_index *index, const char *bundle)
+{
+	uint32_t lo = 0, hi = index->header->bundles_len;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(index->strings + index->bundles[mid], bundle);
+
+		if (cmp == 0) {
+			return mid;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return -1;
+}
+
+static const struct search_index_trigram *find_trigram(struct search_index *index, uint32_t trigram)
+{
+	uint32_t lo = 0, hi = index->header->trigrams_len;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (index->trigrams[mid].trigram == trigram) {
+			return &index->trigrams[mid];
+		}
+		if (index->trigrams[mid].trigram < trigram) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+/* Iterator over a posting list */
+struct postings_iter {
+	const uint8_t *pos;
+	const uint8_t *end;
+	uint32_t files_len;
+	uint32_t remaining;
+	uint32_t id;
+	bool first;
+};
+
+static void postings_iter_init(struct search_index *index, const struct search_index_trigram *trigram, struct postings_iter *iter)
+{
+	uint64_t end = index->header->postings_size;
+
+	if (trigram + 1 < index->trigrams + index->header->trigrams_len) {
+		end = trigram[1].postings;
+	}
+
+	iter->pos = index->postings + trigram->postings;
+	iter->end = index->postings + end;
+	iter->files_len = index->header->files_len;
+	iter->remaining = trigram->count;
+	iter->id = 0;
+	iter->first = true;
+}
+
+/* Get the next file id of the list, false at the end or on invalid data */
+static bool postings_iter_next(struct postings_iter *iter, uint32_t *id)
+{
+	uint64_t delta = 0;
+	unsigned int shift = 0;
+
+	if (iter->remaining == 0) {
+		return false;
+	}
+
+	while (iter->pos < iter->end && shift < 35) {
+		uint8_t byte = *iter->pos++;
+
+		delta |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			delta += iter->first ? 0 : iter->id;
+			if (delta >= iter->files_len || (!iter->first && delta == iter->id)) {
+				break;
+			}
+			iter->first = false;
+			iter->id = delta;
+			iter->remaining--;
+			*id = iter->id;
+			return true;
+		}
+		shift += 7;
+	}
+
+	iter->remaining = 0;
+	return false;
+}
+
+static void add_trigrams(struct list *literals, uint32_t **trigrams, size_t *len)
+{
+	size_t size = 0;
+	struct list *iter;
+
+	for (iter = list_head(literals); iter; iter = iter->next) {
+		const char *str = iter->data;
+		size_t str_len = strlen(str);
+		size_t i;
+
+		for (i = 0; i + TRIGRAM_LEN <= str_len; i++) {
+			if (*len == size) {
+				size = size ? size * 2 : 16;
+				*trigrams = realloc(*trigrams, size * sizeof(uint32_t));
+				ON_NULL_ABORT(*trigrams);
+			}
+			(*trigrams)[(*len)++] = get_trigram(str + i);
+		}
+	}
+}
+
+static int cmp_trigram_count(const void *a, const void *b)
+{
+	const struct search_index_trigram *ta = *(const struct search_index_trigram *const *)a;
+	const struct search_index_trigram *tb = *(const struct search_index_trigram *const *)b;
+
+	return ta->count < tb->count ? -1 : ta->count > tb->count;
+}
+
+static void report_file(struct search_index *index, uint32_t id, search_index_match_fn match, void *data)
+{
+	const struct search_index_file *file = &index->files[id];
+
+	match(index->strings + file->filename, index->file_bundles + file->bundles, file->bundles_len, data);
+}
+
+void search_index_query(struct search_index *index, struct list *literals, search_index_match_fn match, void *data)
+{
+	const struct search_index_trigram **lists = NULL;
+	struct postings_iter iter;
+	uint32_t *trigrams = NULL;
+	uint32_t *candidates = NULL;
+	size_t trigrams_len = 0, lists_len = 0;
+	size_t candidates_len = 0, i, j;
+	uint32_t id;
+
+	add_trigrams(literals, &trigrams, &trigrams_len);
+	if (trigrams_len == 0) {
+		/* Nothing to filter, all files may match */
+		for (id = 0; id < index->header->files_len; id++) {
+			report_file(index, id, match, data);
+		}
+		return;
+	}
+
+	qsort(trigrams, trigrams_len, sizeof(uint32_t), cmp_uint32);
+	lists = malloc(trigrams_len * sizeof(struct search_index_trigram *));
+	ON_NULL_ABORT(lists);
+	for (i = 0; i < trigrams_len; i++) {
+		const struct search_index_trigram *trigram;
+
+		if (i > 0 && trigrams[i] == trigrams[i - 1]) {
+			continue;
+		}
+
+		trigram = find_trigram(index, trigrams[i]);
+		if (!trigram) {
+			/* No file has this trigram */
+			goto out;
+		}
+		lists[lists_len++] = trigram;
+	}
+
+	/* Start with the shortest list, so there are less candidates to check
+	 * on the other lists */
+	qsort(lists, lists_len, sizeof(struct search_index_trigram *), cmp_trigram_count);
+
+	candidates = malloc((lists[0]->count + 1) * sizeof(uint32_t));
+	ON_NULL_ABORT(candidates);
+	postings_iter_init(index, lists[0], &iter);
+	while (postings_iter_next(&iter, &id)) {
+		candidates[candidates_len++] = id;
+	}
+
+	for (i = 1; i < lists_len && candidates_len > 0; i++) {
+		size_t kept = 0;
+		bool more;
+
+		postings_iter_init(index, lists[i], &iter);
+		more = postings_iter_next(&iter, &id);
+		for (j = 0; j < candidates_len && more; j++) {
+			while (more && id < candidates[j]) {
+				more = postings_iter_next(&iter, &id);
+			}
+			if (more && id == candidates[j]) {
+				candidates[kept++] = candidates[j];
+			}
+		}
+		candidates_len = kept;
+	}
+
+	for (i = 0; i < candidates_len; i++) {
+		report_file(index, candidates[i], match, data);
+	}
+
+out:
+	free(candidates);
+	free(lists);
+	free(trigrams);
+}
+
+static void add_literal(struct list **literals, char *run, size_t *run_len)
+{
+	if (*run_len >= TRIGRAM_LEN) {
+		run[*run_len] = '\0';
+		*literals = list_prepend_data(*literals, strdup_or_die(run));
+	}
+	*run_len = 0;
+}
+
+struct list *search_index_regex_literals(const char *regex)
+{
+	struct list *literals = NULL;
+	const char *p;
+	char *run;
+	size_t run_len = 0;
+	int depth;
+
+	/* With alternatives no string is required */
+	for (p = regex; *p; p++) {
+		if (*p == '\\' && p[1]) {
+			p++;
+		} else if (*p == '|') {
+			return NULL;
+		}
+	}
+
+	run = malloc(strlen(regex) + 1);
+	ON_NULL_ABORT(run);
+
+	for (p = regex; *p; p++) {
+		switch (*p) {
+		case '\\':
+			/* Only escaped special characters are literals, other
+			 * escapes may be back-references or GNU operators */
+			if (p[1] && strchr(".[]()*+?{}|^$\\/", p[1])) {
+				p++;
+				run[run_len++] = *p;
+			} else {
+				add_literal(&literals, run, &run_len);
+				if (p[1]) {
+					p++;
+				}
+			}
+			break;
+		case '*':
+		case '?':
+		case '{':
+			/* The previous character is optional or repeated */
+			if (run_len > 0) {
+				run_len--;
+			}
+			add_literal(&literals, run, &run_len);
+			if (*p == '{') {
+				while (p[1] && p[1] != '}') {
+					p++;
+				}
+				if (p[1]) {
+					p++;
+				}
+			}
+			break;
+		case '[':
+			/* Bracket expression, skip to its end */
+			add_literal(&literals, run, &run_len);
+			p++;
+			if (*p == '^') {
+				p++;
+			}
+			if (*p == ']') {
+				p++;
+			}
+			while (*p && *p != ']') {
+				if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+					char close = p[1];
+
+					p += 2;
+					while (*p && !(*p == close && p[1] == ']')) {
+						p++;
+					}
+					if (*p) {
+						p++;
+					}
+				}
+				if (*p) {
+					p++;
+				}
+			}
+			if (!*p) {
+				p--;
+			}
+			break;
+		case '(':
+			/* Groups may be optional, skip them */
+			add_literal(&literals, run, &run_len);
+			for (depth = 1; depth > 0 && p[1]; p++) {
+				if (p[1] == '\\' && p[2]) {
+					p++;
+				} else if (p[1] == '(') {
+					depth++;
+				} else if (p[1] == ')') {
+					depth--;
+				}
+			}
+			break;
+		case '+':
+		case '.':
+		case '^':
+		case '$':
+		case ')':
+			add_literal(&literals, run, &run_len);
+			break;
+		default:
+			run[run_len++] = *p;
+		}
+	}
+	add_literal(&literals, run, &run_len);
+
+	free(run);
+
+	return literals;
+}
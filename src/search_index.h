@@ -0,0 +1,118 @@
+#ifndef __INCLUDE_GUARD_SEARCH_INDEX_H
+#define __INCLUDE_GUARD_SEARCH_INDEX_H
+
+/**
+ * @file
+ * @brief Index of the filenames of all bundles of a version, used by search.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Name of the index file, saved in the state directory of a version. */
+#define SEARCH_INDEX_FILENAME "search.index"
+
+/** @brief A search index loaded with search_index_load(). */
+struct search_index;
+
+/** @brief Data used to create a search index. */
+struct search_index_builder;
+
+/**
+ * @brief Callback called for each file of the index that may match a query.
+ *
+ * @param filename The filename
+ * @param bundles Ids of the bundles the file is part of
+ * @param bundles_len Number of bundles in bundles
+ * @param data User's data
+ */
+typedef void (*search_index_match_fn)(const char *filename, const uint32_t *bundles, uint32_t bundles_len, void *data);
+
+/**
+ * @brief Create a new search index builder.
+ * @note Free builder with search_index_builder_free()
+ */
+struct search_index_builder *search_index_builder_new(void);
+
+/**
+ * @brief Add bundle named 'bundle' to the index.
+ *
+ * @returns An id to be used with search_index_builder_add_file(). Ids used
+ * in the index saved are different.
+ */
+uint32_t search_index_builder_add_bundle(struct search_index_builder *builder, const char *bundle);
+
+/**
+ * @brief Add 'filename' as one of the files of bundle 'bundle'.
+ */
+void search_index_builder_add_file(struct search_index_builder *builder, uint32_t bundle, const char *filename);
+
+/**
+ * @brief Save the index to 'filename'.
+ *
+ * @param version The version of the MoM used to create the index
+ * @param fingerprint Identifies the bundle manifests used to create the index
+ *
+ * @returns true if the index was saved.
+ */
+bool search_index_builder_write(struct search_index_builder *builder, const char *filename, int version, uint64_t fingerprint);
+
+/**
+ * @brief Free the search index builder.
+ */
+void search_index_builder_free(struct search_index_builder *builder);
+
+/**
+ * @brief Load the index saved in 'filename'.
+ *
+ * @returns The index or NULL if the index doesn't exist, is invalid or was
+ * created for a different version or fingerprint.
+ */
+struct search_index *search_index_load(const char *filename, int version, uint64_t fingerprint);
+
+/**
+ * @brief Free the search index.
+ */
+void search_index_free(struct search_index *index);
+
+/**
+ * @brief Get the number of bundles in the index.
+ */
+uint32_t search_index_bundles_len(struct search_index *index);
+
+/**
+ * @brief Get the id of the bundle named 'bundle' or -1 if not found.
+ */
+int search_index_bundle_id(struct search_index *index, const char *bundle);
+
+/**
+ * @brief Find the files that contain all strings in 'literals', ignoring
+ * the case of ASCII letters.
+ *
+ * Files are reported to 'match' sorted by name. Some files reported may not
+ * contain the strings, so callers must check the filename again. All files
+ * are reported when there are no literals or they are too short to be
+ * used.
+ */
+void search_index_query(struct search_index *index, struct list *literals, search_index_match_fn match, void *data);
+
+/**
+ * @brief Get the strings that are part of any match of the extended
+ * regular expression 'regex'.
+ *
+ * @returns A list of strings to be used with search_index_query(). Free it
+ * with list_free_list_and_data(list, free).
+ */
+struct list *search_index_regex_literals(const char *regex);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,60 +24,193 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <linux/fs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "swupd.h"
-#include "swupd_build_variant.h"
+#include "xattrs.h"
 
-/* clean then recreate temporary folder for tar renames */
-static int create_staging_renamedir(char *rename_tmpdir)
+/* Copy the content of a regular file, preferring a reflink when the
+ * filesystem supports it */
+static int copy_file_data(int src_fd, int dst_fd, off_t size)
 {
+	ssize_t r;
+	char buf[64 * 1024];
+
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+		return 0;
+	}
+
+	while (size > 0) {
+		r = copy_file_range(src_fd, NULL, dst_fd, NULL, size, 0);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) {
+				/* Not supported for these files, fall back to read/write */
+				break;
+			}
+			return -errno;
+		}
+		if (r == 0) {
+			break;
+		}
+		size -= r;
+	}
+
+	while ((r = read(src_fd, buf, sizeof(buf))) != 0) {
+		char *p = buf;
+
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		while (r > 0) {
+			ssize_t w = write(dst_fd, p, r);
+			if (w < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return -errno;
+			}
+			p += w;
+			r -= w;
+		}
+	}
+
+	return 0;
+}
+
+static int copy_regular_file(const char *src, const char *dst, const struct stat *st)
+{
+	int src_fd, dst_fd;
 	int ret;
 
-	if (rm_rf(rename_tmpdir) != 0) {
-		/* Not fatal but pretty scary, likely to really fail at the
-		 * next command too. Pass for now as printing may just cause
-		 * confusion */
-		;
+	src_fd = open(src, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (src_fd < 0) {
+		return -errno;
 	}
 
-	ret = mkdir(rename_tmpdir, S_IRWXU);
-	if (ret == -1 && errno != EEXIST) {
+	dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (dst_fd < 0) {
 		ret = -errno;
-	} else {
-		ret = 0;
+		close(src_fd);
+		return ret;
+	}
+
+	ret = copy_file_data(src_fd, dst_fd, st->st_size);
+	close(src_fd);
+	if (close(dst_fd) < 0 && ret == 0) {
+		ret = -errno;
+	}
+	if (ret < 0) {
+		unlink(dst);
 	}
 
 	return ret;
 }
 
-/* Do the staging of new files into the filesystem */
-//TODO: "do_staging is currently not able to be run in parallel"
-/* Consider adding a remove_leftovers() that runs in verify/fix in order to
- * allow this function to mkdtemp create folders for parallel build */
-enum swupd_code do_staging(struct file *file, struct manifest *MoM)
+/*
+ * Copy a staged file, directory or symlink to dst keeping its owner,
+ * permissions, extended attributes and timestamps, the same way tar with
+ * --preserve-permissions would. An existing directory in dst is reused.
+ */
+static int copy_with_attributes(const char *src, const char *dst)
+{
+	struct stat st, dst_st;
+	struct timespec times[2];
+	char link_target[PATH_MAX];
+	ssize_t len;
+	int ret;
+
+	if (lstat(src, &st) < 0) {
+		return -errno;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		if (mkdir(dst, S_IRWXU) < 0) {
+			if (errno != EEXIST) {
+				return -errno;
+			}
+			if (lstat(dst, &dst_st) < 0 || !S_ISDIR(dst_st.st_mode)) {
+				return -EEXIST;
+			}
+		}
+	} else if (S_ISREG(st.st_mode)) {
+		ret = copy_regular_file(src, dst, &st);
+		if (ret < 0) {
+			return ret;
+		}
+	} else if (S_ISLNK(st.st_mode)) {
+		len = readlink(src, link_target, sizeof(link_target) - 1);
+		if (len < 0) {
+			return -errno;
+		}
+		link_target[len] = '\0';
+		if (symlink(link_target, dst) < 0) {
+			return -errno;
+		}
+	} else {
+		if (mknod(dst, st.st_mode, st.st_rdev) < 0) {
+			return -errno;
+		}
+	}
+
+	if (fchownat(AT_FDCWD, dst, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0 && errno != EPERM) {
+		return -errno;
+	}
+
+	/* Permissions can't be set on symlinks on Linux, they are always 0777 */
+	if (!S_ISLNK(st.st_mode) && fchmodat(AT_FDCWD, dst, st.st_mode & 07777, 0) < 0) {
+		return -errno;
+	}
+
+	xattrs_copy(src, dst);
+
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Stage a new file into the filesystem. When prestage is true, nothing that
+ * could be visible in the rootfs is changed: directories, missing target
+ * directories and file type changes are left to be handled by do_staging().
+ */
+static enum swupd_code stage_file(struct file *file, struct manifest *MoM, bool prestage)
 {
 	char *statfile = NULL, *tmp = NULL, *tmp2 = NULL;
 	char *dir, *base, *rel_dir;
-	char *tarcommand = NULL;
 	char *original = NULL;
 	char *target = NULL;
 	char *targetpath = NULL;
-	char *rename_target = NULL;
-	char *rename_tmpdir = NULL;
+	char hash[SWUPD_HASH_LEN];
 	char real_path[4096] = { 0 };
 	struct stat s;
 	struct stat buf;
 	int err;
 	int ret;
 
+	if (prestage && !file->is_file && !file->is_link) {
+		return SWUPD_UNEXPECTED_CONDITION;
+	}
+
 	tmp = strdup_or_die(file->filename);
 	tmp2 = strdup_or_die(file->filename);
 
@@ -89,12 +222,17 @@ enum swupd_code do_staging(struct file *file, struct manifest *MoM)
 		rel_dir = dir + 1;
 	}
 
-	string_or_die(&original, "%s/staged/%s", state_dir, file->hash);
+	hash_to_hex(&file->hash, hash);
+	string_or_die(&original, "%s/staged/%s", state_dir, hash);
 
 	/* make sure the directory where the file should be copied to exists
 	 * and is in deed a directory */
 	string_or_die(&targetpath, "%s%s", path_prefix, rel_dir);
 	ret = stat(targetpath, &s);
+	if (prestage && (ret != 0 || !S_ISDIR(s.st_mode))) {
+		ret = SWUPD_COULDNT_CREATE_DIR;
+		goto out;
+	}
 	if ((ret == -1) && (errno == ENOENT)) {
 		if (MoM) {
 			warn("Update target directory does not exist: %s. Trying to fix it\n", targetpath);
@@ -140,6 +278,11 @@ enum swupd_code do_staging(struct file *file, struct manifest *MoM)
 		if ((file->is_dir && !S_ISDIR(s.st_mode)) ||
 		    (file->is_link && !S_ISLNK(s.st_mode)) ||
 		    (file->is_file && !S_ISREG(s.st_mode))) {
+			if (prestage) {
+				ret = SWUPD_UNEXPECTED_CONDITION;
+				goto out;
+			}
+
 			// file type changed, move old out of the way for new
 			ret = swupd_rm(statfile);
 			if (ret < 0) {
@@ -159,38 +302,11 @@ enum swupd_code do_staging(struct file *file, struct manifest *MoM)
 		 * download and the untar happens in the staging subvolume which
 		 * then gets promoted to a "real" usable subvolume.  But for
 		 * a live rootfs the directory needs copied out of staged
-		 * and into the rootfs.  Tar is a way to copy with
-		 * attributes and it includes internal logic that does the
-		 * right thing to overlay a directory onto something
-		 * pre-existing: */
-		/* In order to avoid tar transforms with directories, rename
-		 * the directory before and after the tar command */
-		string_or_die(&rename_tmpdir, "%s/tmprenamedir", state_dir);
-		ret = create_staging_renamedir(rename_tmpdir);
-		if (ret) {
-			ret = SWUPD_COULDNT_CREATE_DIR;
-			goto out;
-		}
-		string_or_die(&rename_target, "%s/%s", rename_tmpdir, base);
-		if (rename(original, rename_target)) {
-			ret = SWUPD_COULDNT_RENAME_DIR;
-			goto out;
-		}
-		string_or_die(&tarcommand, TAR_COMMAND " -C '%s' " TAR_PERM_ATTR_ARGS " -cf - './%s' 2> /dev/null | " TAR_COMMAND " -C '%s%s' " TAR_PERM_ATTR_ARGS " -xf - 2> /dev/null",
-			      rename_tmpdir, base, path_prefix, rel_dir);
-		ret = system(tarcommand);
-		if (ret == -1) {
-			ret = SWUPD_SUBPROCESS_ERROR;
-		}
-		if (WIFEXITED(ret)) {
-			ret = WEXITSTATUS(ret);
-		}
-		free_string(&tarcommand);
-		if (rename(rename_target, original)) {
-			ret = SWUPD_COULDNT_RENAME_DIR;
-			goto out;
-		}
-		if (ret) {
+		 * and into the rootfs, overlaying anything pre-existing: */
+		string_or_die(&statfile, "%s%s/%s", path_prefix, rel_dir, base);
+		ret = copy_with_attributes(original, statfile);
+		if (ret < 0) {
+			debug("Failed to copy %s to %s: %s\n", original, statfile, strerror(-ret));
 			ret = SWUPD_COULDNT_RENAME_DIR;
 			goto out;
 		}
@@ -207,27 +323,10 @@ enum swupd_code do_staging(struct file *file, struct manifest *MoM)
 			ret = link(original, target);
 		}
 		if (ret < 0) {
-			/* either the hardlink failed, or it was undesirable (config), do a tar-tar dance */
-			/* In order to avoid tar transforms, rename the file
-			 * before and after the tar command */
-			string_or_die(&rename_target, "%s/staged/.update.%s", state_dir, base);
-			ret = rename(original, rename_target);
-			if (ret) {
-				ret = SWUPD_COULDNT_RENAME_FILE;
-				goto out;
-			}
-			string_or_die(&tarcommand, TAR_COMMAND " -C '%s/staged' " TAR_PERM_ATTR_ARGS " -cf - '.update.%s' 2> /dev/null | " TAR_COMMAND " -C '%s%s' " TAR_PERM_ATTR_ARGS " -xf - 2> /dev/null",
-				      state_dir, base, path_prefix, rel_dir);
-			ret = system(tarcommand);
-			if (ret == -1) {
-				ret = SWUPD_SUBPROCESS_ERROR;
-			}
-			if (WIFEXITED(ret)) {
-				ret = WEXITSTATUS(ret);
-			}
-			free_string(&tarcommand);
-			ret = rename(rename_target, original);
-			if (ret) {
+			/* either the hardlink failed, or it was undesirable (config), do a copy */
+			ret = copy_with_attributes(original, target);
+			if (ret < 0) {
+				debug("Failed to copy %s to %s: %s\n", original, target, strerror(-ret));
 				ret = SWUPD_COULDNT_RENAME_FILE;
 				goto out;
 			}
@@ -247,31 +346,113 @@ out:
 	free_string(&target);
 	free_string(&targetpath);
 	free_string(&original);
-	free_string(&rename_target);
-	free_string(&rename_tmpdir);
+	free_string(&statfile);
 	free_string(&tmp);
 	free_string(&tmp2);
 
 	return ret;
 }
 
-/* caller should not call this function for do_not_update marked files */
-int rename_staged_file_to_final(struct file *file)
+/* Do the staging of new files into the filesystem */
+enum swupd_code do_staging(struct file *file, struct manifest *MoM)
 {
-	int ret;
+	return stage_file(file, MoM, false);
+}
+
+bool do_prestaging(struct file *file)
+{
+	return stage_file(file, NULL, true) == SWUPD_OK;
+}
+
+/*
+ * Parent directory of the last file renamed, kept open so files in the same
+ * directory are renamed relative to it without resolving the full path again.
+ */
+struct rename_dir {
+	const char *filename;
+	size_t len;
+	int fd;
+};
+
+static void rename_dir_close(struct rename_dir *dir)
+{
+	if (dir->fd >= 0) {
+		close(dir->fd);
+	}
+	dir->filename = NULL;
+	dir->len = 0;
+	dir->fd = -1;
+}
+
+/* Return a fd for the parent directory of filename, reusing the cached one
+ * when possible */
+static int rename_dir_open(struct rename_dir *dir, const char *filename, size_t len)
+{
+	char *path;
+
+	if (dir->fd >= 0 && dir->len == len && strncmp(dir->filename, filename, len) == 0) {
+		return dir->fd;
+	}
+
+	rename_dir_close(dir);
+	string_or_die(&path, "%s%.*s", path_prefix, (int)len, filename);
+	dir->fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	free_string(&path);
+	if (dir->fd < 0) {
+		return -1;
+	}
+
+	dir->filename = filename;
+	dir->len = len;
+	return dir->fd;
+}
+
+static int move_to_lost_and_found(struct file *file)
+{
+	char *lostnfound;
 	char *target;
+	char *base;
+	int ret;
+
+	string_or_die(&lostnfound, "%slost+found", path_prefix);
+	ret = mkdir(lostnfound, S_IRWXU);
+	if ((ret != 0) && (errno != EEXIST)) {
+		free_string(&lostnfound);
+		return ret;
+	}
+	free_string(&lostnfound);
 
+	base = basename(file->filename);
 	string_or_die(&target, "%s%s", path_prefix, file->filename);
+	string_or_die(&lostnfound, "%slost+found/%s", path_prefix, base);
+	/* this will fail if the directory was not already emptied */
+	ret = rename(target, lostnfound);
+	if (ret < 0 && errno != ENOTEMPTY && errno != EEXIST) {
+		error("failed to move %s to lost+found: %s\n",
+		      base, strerror(errno));
+	}
+	free_string(&lostnfound);
+	free_string(&target);
+
+	return ret;
+}
+
+static int rename_staged_file_at(struct file *file, struct rename_dir *dir)
+{
+	int ret;
 
 	if (!file->staging && !file->is_deleted && !file->is_dir) {
-		free_string(&target);
 		return -1;
 	}
 
 	/* Delete files if they are not ghosted and will be garbage collected by
 	 * another process */
 	if (file->is_deleted && !file->is_ghosted) {
+		char *target;
+
+		string_or_die(&target, "%s%s", path_prefix, file->filename);
 		ret = swupd_rm(target);
+		free_string(&target);
 
 		/* don't count missing ones as errors...
 		 * if somebody already deleted them for us then all is well */
@@ -282,7 +463,22 @@ int rename_staged_file_to_final(struct file *file)
 		ret = 0;
 	} else {
 		struct stat stat;
-		ret = lstat(target, &stat);
+		const char *base, *staging_base;
+		int dirfd;
+
+		/* The staged file is created in the same directory as the target */
+		base = strrchr(file->filename, '/');
+		base = base ? base + 1 : file->filename;
+		staging_base = strrchr(file->staging, '/') + 1;
+
+		dirfd = rename_dir_open(dir, file->filename, base - file->filename);
+		if (dirfd < 0) {
+			error("failed to open target directory of %s: %s\n",
+			      file->filename, strerror(errno));
+			return -1;
+		}
+
+		ret = fstatat(dirfd, base, &stat, AT_SYMLINK_NOFOLLOW);
 
 		/* If the file was previously a directory but no longer, then
 		 * we need to move it out of the way.
@@ -291,38 +487,29 @@ int rename_staged_file_to_final(struct file *file)
 		 * change.  But...you never know. */
 
 		if ((ret == 0) && (S_ISDIR(stat.st_mode))) {
-			char *lostnfound;
-			char *base;
-
-			string_or_die(&lostnfound, "%slost+found", path_prefix);
-			ret = mkdir(lostnfound, S_IRWXU);
-			if ((ret != 0) && (errno != EEXIST)) {
-				free_string(&lostnfound);
-				free_string(&target);
-				return ret;
-			}
-			free_string(&lostnfound);
-
-			base = basename(file->filename);
-			string_or_die(&lostnfound, "%slost+found/%s", path_prefix, base);
-			/* this will fail if the directory was not already emptied */
-			ret = rename(target, lostnfound);
-			if (ret < 0 && errno != ENOTEMPTY && errno != EEXIST) {
-				error("failed to move %s to lost+found: %s\n",
-				      base, strerror(errno));
-			}
-			free_string(&lostnfound);
+			ret = move_to_lost_and_found(file);
 		} else {
-			ret = rename(file->staging, target);
+			ret = renameat(dirfd, staging_base, dirfd, base);
 			if (ret < 0) {
 				error("failed to rename staged %s to final: %s\n",
-				      file->hash, strerror(errno));
+				      file->filename, strerror(errno));
 			}
-			unlink(file->staging);
+			unlinkat(dirfd, staging_base, 0);
 		}
 	}
 
-	free_string(&target);
+	return ret;
+}
+
+/* caller should not call this function for do_not_update marked files */
+int rename_staged_file_to_final(struct file *file)
+{
+	struct rename_dir dir = { .fd = -1 };
+	int ret;
+
+	ret = rename_staged_file_at(file, &dir);
+	rename_dir_close(&dir);
+
 	return ret;
 }
 
@@ -330,9 +517,12 @@ int rename_all_files_to_final(struct list *updates)
 {
 	int ret, update_errs = 0, update_good = 0, skip = 0;
 	struct list *list;
+	struct rename_dir dir = { .fd = -1 };
 	unsigned int complete = 0;
 	unsigned int list_length = list_len(updates);
 
+	/* updates are sorted by filename, so files in the same directory are
+	 * renamed one after the other using the same directory fd */
 	list = list_head(updates);
 	while (list) {
 		struct file *file;
@@ -346,7 +536,7 @@ int rename_all_files_to_final(struct list *updates)
 			;
 		}
 
-		ret = rename_staged_file_to_final(file);
+		ret = rename_staged_file_at(file, &dir);
 		if (ret != 0) {
 			update_errs += 1;
 		} else {
@@ -356,6 +546,7 @@ int rename_all_files_to_final(struct list *updates)
 	progress:
 		progress_report(complete, list_length);
 	}
+	rename_dir_close(&dir);
 
 	return update_count - update_good - update_errs - (update_skip - skip);
 }
@@ -15,6 +15,7 @@
 #include "lib/list.h"
 #include "lib/log.h"
 #include "lib/macros.h"
+#include "lib/mounts.h"
 #include "lib/progress.h"
 #include "lib/strings.h"
 #include "lib/sys.h"
@@ -116,10 +117,20 @@ struct update_stat {
 #define DIGEST_LEN_SHA256 64
 /* +1 for null termination */
 #define SWUPD_HASH_LEN (DIGEST_LEN_SHA256 + 1)
+/* Size of a SHA256 digest in binary form */
+#define SWUPD_DIGEST_LEN (DIGEST_LEN_SHA256 / 2)
+
+/* Hashes are kept in binary form and only converted to hex strings when
+ * parsing manifests or building file names and URLs. Comparisons are done
+ * a word at a time. */
+union swupd_hash {
+	unsigned char bytes[SWUPD_DIGEST_LEN];
+	uint64_t words[SWUPD_DIGEST_LEN / sizeof(uint64_t)];
+};
 
 struct file {
 	char *filename;
-	char hash[SWUPD_HASH_LEN];
+	union swupd_hash hash;
 	bool use_xattrs;
 	int last_change;
 	struct update_stat stat;
@@ -139,6 +150,7 @@ struct file {
 	unsigned int is_mix : 1;
 	unsigned int is_experimental : 1;
 	unsigned int do_not_update : 1;
+	unsigned int in_file_table : 1; /* owned by the file table of a manifest */
 
 	struct file *peer; /* same file in another manifest */
 	struct header *header;
@@ -209,12 +221,23 @@ extern int get_current_version(char *path_prefix);
 
 extern bool ignore(struct file *file);
 extern void apply_heuristics(struct file *file);
+extern void heuristics_deinit(void);
 
 extern int file_sort_filename(const void *a, const void *b);
 extern int file_sort_filename_reverse(const void *a, const void *b);
 extern int file_sort_hash(const void *a, const void *b);
 extern struct manifest *load_mom(int version, bool latest, bool mix_exists, int *err);
 extern struct manifest *load_manifest(int version, struct file *file, struct manifest *mom, bool header_only, int *err);
+extern struct list *load_manifests(struct manifest *mom, struct list *files, bool header_only);
+
+/* Callback used by process_manifests(), with the position of the bundle in
+ * the list of files. It's called from many threads at the same time. */
+typedef void (*manifest_process_fn)(struct manifest *manifest, size_t index, void *data);
+
+/* Load the full manifests of the bundles in FILES concurrently and call
+ * PROCESS for each one. Manifests are freed after being processed. Returns
+ * the number of manifests that couldn't be loaded. */
+extern int process_manifests(struct manifest *mom, struct list *files, manifest_process_fn process, void *data);
 extern struct manifest *load_manifest_full(int version, bool mix);
 extern struct list *create_update_list(struct manifest *server);
 extern void link_manifests(struct manifest *m1, struct manifest *m2);
@@ -273,28 +296,34 @@ static inline void account_delta_miss(void)
 
 extern void print_statistics(int version1, int version2);
 
-extern int download_fullfiles(struct list *files, int *num_downloads);
+extern int download_fullfiles(struct list *files, int *num_downloads, bool prestage);
 extern int download_subscribed_packs(struct list *subs, struct manifest *mom, bool required);
 
 extern void apply_deltas(struct manifest *current_manifest);
 extern int untar_full_download(void *data);
 
 extern enum swupd_code do_staging(struct file *file, struct manifest *manifest);
+extern bool do_prestaging(struct file *file);
 extern int rename_all_files_to_final(struct list *updates);
 extern int rename_staged_file_to_final(struct file *file);
 
 extern int update_device_latest_version(int version);
 
 extern size_t get_max_xfer(size_t default_max_xfer);
+extern size_t get_min_xfer(void);
+extern int get_max_jobs(void);
 
 extern void free_subscriptions(struct list **subs);
 extern void read_subscriptions(struct list **subs);
 extern bool component_subscribed(struct list *subs, char *component);
 extern void set_subscription_versions(struct manifest *latest, struct manifest *current, struct list **subs);
 
-extern void hash_assign(const char *src, char *dest);
-extern bool hash_equal(const char *hash1, const char *hash2);
-extern bool hash_is_zeros(char *hash);
+extern void hash_assign(const union swupd_hash *src, union swupd_hash *dest);
+extern bool hash_equal(const union swupd_hash *hash1, const union swupd_hash *hash2);
+extern bool hash_is_zeros(const union swupd_hash *hash);
+extern bool hash_from_hex(const char *hex, union swupd_hash *hash);
+extern void hash_to_hex(const union swupd_hash *hash, char *hex);
+extern uint64_t hash_prefix(const union swupd_hash *hash);
 extern int compute_hash_lazy(struct file *file, char *filename);
 extern enum swupd_code compute_hash(struct file *file, char *filename) __attribute__((warn_unused_result));
 
@@ -303,6 +332,7 @@ extern enum swupd_code compute_hash(struct file *file, char *filename) __attribu
 extern long get_manifest_list_contentsize(struct list *manifests);
 extern struct list *recurse_manifest(struct manifest *manifest, struct list *subs, const char *component, bool server, int *err);
 extern struct list *consolidate_files(struct list *files);
+extern struct list *consolidate_bundle_files(struct list *bundles);
 extern struct list *filter_out_deleted_files(struct list *files);
 extern struct list *filter_out_existing_files(struct list *to_install_files, struct list *installed_files);
 
@@ -317,10 +347,10 @@ void deduplicate_files_from_manifest(struct manifest **m1, struct manifest *m2);
 extern struct file *search_bundle_in_manifest(struct manifest *manifest, const char *bundlename);
 extern struct file *search_file_in_manifest(struct manifest *manifest, const char *filename);
 
-extern char *mounted_dirs;
+extern struct mount_table *mount_table;
 extern char *mk_full_filename(const char *prefix, const char *path);
 extern bool is_directory_mounted(const char *filename);
-extern bool is_under_mounted_directory(const char *filename);
+extern long get_fs_available_space(const char *path);
 extern bool is_populated_dir(char *dirname);
 
 /* filedesc.c */
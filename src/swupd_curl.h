@@ -73,11 +73,6 @@ int swupd_curl_init(void);
  */
 void swupd_curl_deinit(void);
 
-/**
- * @brief Query the file content size of 'url' without downloading the full file.
- */
-double swupd_curl_query_content_size(char *url);
-
 /**
  * @brief Download @c url and save it in @c filename.
  *
@@ -100,6 +95,11 @@ int swupd_curl_get_file_memory(const char *url, struct curl_file_data *file_data
  * Parallel download handler will retry max_retries times to download each file,
  * ading a timeout between each try.
  *
+ * The number of simultaneous downloads is adjusted while files are downloaded,
+ * between get_min_xfer() and max_xfer: it's halved when downloads fail or
+ * become slower to respond and increased by one after a set of downloads
+ * without problems.
+ *
  * @note This function is non-blocking.
  */
 struct swupd_curl_parallel_handle *swupd_curl_parallel_download_start(size_t max_xfer);
@@ -160,6 +160,19 @@ int swupd_curl_parallel_download_enqueue(struct swupd_curl_parallel_handle *hand
  */
 int swupd_curl_parallel_download_end(struct swupd_curl_parallel_handle *handle, int *num_downloads);
 
+/**
+ * @brief Query the content size of 'count' urls, without downloading the files.
+ *
+ * Requests are sent concurrently, with at most max_xfer of them at a time.
+ *
+ * @param sizes Filled with the size of the file of each url, or -1 if it
+ *              couldn't be found.
+ *
+ * @returns The number of sizes that couldn't be found or a negative number on
+ * errors.
+ */
+int swupd_curl_query_content_sizes(char **urls, double *sizes, size_t count, size_t max_xfer);
+
 #ifdef __cplusplus
 }
 #endif
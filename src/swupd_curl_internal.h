@@ -36,6 +36,24 @@ extern CURLcode swupd_download_file_append(struct curl_file *file);
  */
 extern CURLcode swupd_download_file_close(CURLcode curl_ret, struct curl_file *file);
 
+/**
+ * @brief Get a curl handle from the transfer context, without any option set.
+ *
+ * The handle shares DNS cache, TLS sessions and connections with all other
+ * handles and may be reused from a previous download.
+ *
+ * @returns The handle or NULL on errors.
+ * @note Release the handle with swupd_curl_handle_release()
+ */
+extern CURL *swupd_curl_handle_get(void);
+
+/**
+ * @brief Return a handle to the transfer context, so it can be reused.
+ *
+ * The handle must not be part of a multi handle anymore.
+ */
+extern void swupd_curl_handle_release(CURL *curl);
+
 /**
  * @brief Set swupd default basic options to curl handler.
  */
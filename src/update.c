@@ -72,6 +72,94 @@ static int check_manifests_uniqueness(int clrver, int mixver)
 	return ret;
 }
 
+/* Remove the .update files created in the target directories before the
+ * update was aborted */
+static void remove_prestaged_files(struct list *updates)
+{
+	struct list *iter;
+
+	for (iter = list_head(updates); iter; iter = iter->next) {
+		struct file *file = iter->data;
+
+		if (file->staging) {
+			unlink(file->staging);
+			free_string(&file->staging);
+		}
+	}
+}
+
+struct mount_set {
+	const struct mount_entry **mounts;
+	size_t len;
+	size_t alloc;
+};
+
+/* Add the mount 'path' is on to the set, returns false if it's not found */
+static bool mount_set_add(struct mount_set *set, const char *path)
+{
+	const struct mount_entry *mount;
+	size_t i;
+
+	mount = mount_table_find_containing(mount_table, path);
+	if (!mount) {
+		return false;
+	}
+
+	for (i = 0; i < set->len; i++) {
+		if (set->mounts[i] == mount) {
+			return true;
+		}
+	}
+
+	if (set->len == set->alloc) {
+		set->alloc = set->alloc ? set->alloc * 2 : 8;
+		set->mounts = realloc(set->mounts, set->alloc * sizeof(*set->mounts));
+		ON_NULL_ABORT(set->mounts);
+	}
+	set->mounts[set->len++] = mount;
+
+	return true;
+}
+
+/*
+ * Commit to disk all file systems changed by the update: the ones holding the
+ * files in 'updates' and the state directory. If the file systems can't be
+ * found, commit all of them.
+ */
+static void sync_update_filesystems(struct list *updates)
+{
+	struct mount_set set = { 0 };
+	struct list *iter;
+	bool found = mount_table != NULL;
+	size_t i;
+
+	if (found) {
+		found = mount_set_add(&set, state_dir);
+	}
+
+	for (iter = list_head(updates); iter && found; iter = iter->next) {
+		struct file *file = iter->data;
+		char *path;
+
+		if (file->do_not_update) {
+			continue;
+		}
+
+		path = mk_full_filename(path_prefix, file->filename);
+		found = mount_set_add(&set, path);
+		free_string(&path);
+	}
+
+	if (found) {
+		for (i = 0; i < set.len; i++) {
+			sync_filesystem(set.mounts[i]->path);
+		}
+	} else {
+		sync();
+	}
+	free(set.mounts);
+}
+
 static int update_loop(struct list *updates, struct manifest *server_manifest)
 {
 	int ret;
@@ -81,9 +169,13 @@ static int update_loop(struct list *updates, struct manifest *server_manifest)
 
 	step = progress_get_step();
 	progress_set_step(step.current, "download_fullfiles");
-	ret = download_fullfiles(updates, &nonpack);
+
+	/* files are prestaged to their .update name while other files are
+	 * still downloading, this doesn't change any file in use */
+	ret = download_fullfiles(updates, &nonpack, !download_only);
 	if (ret) {
 		error("Could not download all files, aborting update\n");
+		remove_prestaged_files(updates);
 		return ret;
 	}
 
@@ -110,6 +202,11 @@ static int update_loop(struct list *updates, struct manifest *server_manifest)
 			continue;
 		}
 
+		/* already prestaged when its fullfile was downloaded */
+		if (file->staging) {
+			continue;
+		}
+
 		/* for each file: fdatasync to persist changed content over reboot, or maybe a global sync */
 		/* for each file: check hash value; on mismatch delete and queue full download */
 		/* todo: hash check */
@@ -124,8 +221,8 @@ static int update_loop(struct list *updates, struct manifest *server_manifest)
 	/* check policy, and if policy says, "ask", ask the user at this point */
 	/* check for reboot need - if needed, wait for reboot */
 
-	/* sync */
-	sync();
+	/* make sure all staged content is in the disk before the renames */
+	sync_update_filesystems(updates);
 
 	/* rename to apply update */
 	progress_set_step((step.current) + 1, "update_files");
@@ -140,7 +237,7 @@ static int update_loop(struct list *updates, struct manifest *server_manifest)
 	 *       are now sent as tar's so permissions are handled correctly, even
 	 *       if less than efficiently)? */
 
-	sync();
+	sync_update_filesystems(updates);
 
 	/* NOTE: critical section starts when update_loop() calls do_staging() */
 	/*********** critical section ends *************************************/
@@ -360,8 +457,7 @@ version_check:
 	}
 
 	/* consolidate the current collective manifests down into one in memory */
-	current_manifest->files = files_from_bundles(current_manifest->submanifests);
-	current_manifest->files = consolidate_files(current_manifest->files);
+	current_manifest->files = consolidate_bundle_files(current_manifest->submanifests);
 	latest_subs = list_clone(current_subs);
 	set_subscription_versions(server_manifest, current_manifest, &latest_subs);
 	link_submanifests(current_manifest, server_manifest, current_subs, latest_subs, false);
@@ -391,8 +487,7 @@ version_check:
 	}
 
 	/* consolidate the new collective manifests down into one in memory */
-	server_manifest->files = files_from_bundles(server_manifest->submanifests);
-	server_manifest->files = consolidate_files(server_manifest->files);
+	server_manifest->files = consolidate_bundle_files(server_manifest->submanifests);
 	set_subscription_versions(server_manifest, current_manifest, &latest_subs);
 	link_submanifests(current_manifest, server_manifest, current_subs, latest_subs, true);
 
@@ -34,9 +34,15 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "lib/thread_pool.h"
 #include "signature.h"
 #include "swupd.h"
 
+/* Number of files hashed by each thread pool task */
+#define HASH_CHUNK_SIZE 256
+/* Interval used to report progress while waiting for hashing threads (in us) */
+#define HASH_PROGRESS_INTERVAL 10000
+
 static const char picky_whitelist_default[] = "/usr/lib/modules|/usr/lib/kernel|/usr/local|/usr/src";
 
 static bool cmdline_command_verify = false;
@@ -151,12 +157,12 @@ static void print_help(void)
 	print("\n");
 }
 
-static bool hash_needs_work(struct file *file, char *hash)
+static bool hash_needs_work(struct file *file, const union swupd_hash *hash)
 {
 	if (cmdline_option_quick) {
 		return (hash_is_zeros(hash));
 	} else {
-		return (!hash_equal(file->hash, hash));
+		return (!hash_equal(&file->hash, hash));
 	}
 }
 
@@ -176,6 +182,86 @@ static int get_all_files(struct manifest *official_manifest, struct list *subs)
 	return ret;
 }
 
+/*
+ * A chunk of consecutive files to be verified by one thread pool task. Each
+ * task only writes to its own slice of the valid array and increments the
+ * shared complete counter, which is read by the main thread to report progress.
+ */
+struct hash_chunk {
+	struct file **files;
+	bool *valid;
+	size_t count;
+	unsigned int *complete;
+};
+
+static void hash_chunk_run(void *data)
+{
+	struct hash_chunk *chunk = data;
+	size_t i;
+
+	for (i = 0; i < chunk->count; i++) {
+		struct file *f = chunk->files[i];
+		char *fullname;
+
+		fullname = mk_full_filename(path_prefix, f->filename);
+		chunk->valid[i] = cmdline_option_quick ? verify_file_lazy(fullname) : verify_file(f, fullname);
+		free_string(&fullname);
+
+		__atomic_add_fetch(chunk->complete, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Check the hash of COUNT files using a pool of get_max_jobs() threads.
+ * The result for files[i] is stored in valid[i], so callers can process the
+ * results in the original order and the output is deterministic.
+ */
+static void verify_files_parallel(struct file **files, bool *valid, size_t count)
+{
+	struct tp *tp;
+	struct hash_chunk *chunks;
+	size_t num_chunks, i;
+	unsigned int complete = 0;
+
+	if (count == 0) {
+		return;
+	}
+
+	tp = tp_start(get_max_jobs());
+	if (!tp) {
+		warn("Unable to create a thread pool - hashing files synchronously\n");
+		tp = tp_start(0);
+		ON_NULL_ABORT(tp);
+	}
+
+	num_chunks = (count + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+	chunks = calloc(num_chunks, sizeof(struct hash_chunk));
+	ON_NULL_ABORT(chunks);
+
+	for (i = 0; i < num_chunks; i++) {
+		size_t start = i * HASH_CHUNK_SIZE;
+
+		chunks[i].files = &files[start];
+		chunks[i].valid = &valid[start];
+		chunks[i].count = count - start < HASH_CHUNK_SIZE ? count - start : HASH_CHUNK_SIZE;
+		chunks[i].complete = &complete;
+
+		if (tp_task_schedule(tp, hash_chunk_run, &chunks[i]) != 0) {
+			/* Not able to use the thread pool, so do it ourselves */
+			hash_chunk_run(&chunks[i]);
+		}
+	}
+
+	while (__atomic_load_n(&complete, __ATOMIC_RELAXED) < count) {
+		progress_report(__atomic_load_n(&complete, __ATOMIC_RELAXED), count);
+		usleep(HASH_PROGRESS_INTERVAL);
+	}
+	progress_report(count, count);
+
+	tp_complete(tp);
+	free(chunks);
+}
+
 /*
  * Check if the hash of all files in the list matches the system and in this case mark
  * them as do_not_update.
@@ -186,35 +272,44 @@ static int get_all_files(struct manifest *official_manifest, struct list *subs)
 static int check_files_hash(struct list *files)
 {
 	struct list *iter;
-	unsigned int complete = 0;
-	unsigned int total = list_len(files);
+	struct file **to_check;
+	bool *valid;
+	size_t len = list_len(files);
+	size_t count = 0, i;
 	int ret = 1;
 
 	info("Checking for corrupt files\n");
-	iter = list_head(files);
-	while (iter) {
+	if (len == 0) {
+		return ret;
+	}
+
+	to_check = malloc(len * sizeof(struct file *));
+	ON_NULL_ABORT(to_check);
+
+	for (iter = list_head(files); iter; iter = iter->next) {
 		struct file *f = iter->data;
-		char *fullname;
-		bool valid;
 
-		complete++;
-		iter = iter->next;
 		if (f->is_deleted || f->do_not_update) {
-			goto progress;
+			continue;
 		}
+		to_check[count++] = f;
+	}
 
-		fullname = mk_full_filename(path_prefix, f->filename);
-		valid = cmdline_option_quick ? verify_file_lazy(fullname) : verify_file(f, fullname);
-		free_string(&fullname);
-		if (valid) {
-			f->do_not_update = 1;
+	valid = calloc(len, sizeof(bool));
+	ON_NULL_ABORT(valid);
+
+	verify_files_parallel(to_check, valid, count);
+
+	for (i = 0; i < count; i++) {
+		if (valid[i]) {
+			to_check[i]->do_not_update = 1;
 		} else {
 			ret = 0;
 		}
-	progress:
-		progress_report(complete, total);
 	}
 
+	free(valid);
+	free(to_check);
 	return ret;
 }
 
@@ -237,7 +332,7 @@ static int get_required_files(struct manifest *official_manifest, struct list *s
 
 	progress_set_next_step("download_fullfiles");
 	print("\n");
-	ret = download_fullfiles(official_manifest->files, NULL);
+	ret = download_fullfiles(official_manifest->files, NULL, false);
 	if (ret) {
 		error("Unable to download necessary files for this OS release\n");
 	}
@@ -254,6 +349,7 @@ static void check_warn_freespace(const struct file *file)
 {
 	long fs_free;
 	char *original = NULL;
+	char hash[SWUPD_HASH_LEN];
 	static bool no_freespace_flag = false;
 	struct stat st;
 
@@ -268,8 +364,9 @@ static void check_warn_freespace(const struct file *file)
 		goto out;
 	}
 
-	string_or_die(&original, "%s/staged/%s", state_dir, file->hash);
-	fs_free = get_available_space(path_prefix);
+	hash_to_hex(&file->hash, hash);
+	string_or_die(&original, "%s/staged/%s", state_dir, hash);
+	fs_free = get_fs_available_space(path_prefix);
 	if (fs_free < 0 || stat(original, &st) != 0) {
 		warn("Unable to determine free space on filesystem.\n");
 		goto out;
@@ -321,7 +418,7 @@ static void add_missing_files(struct manifest *official_manifest, bool repair)
 		}
 
 		/* compare the hash and report mismatch */
-		if (hash_is_zeros(local.hash)) {
+		if (hash_is_zeros(&local.hash)) {
 			counts.missing++;
 			if (!repair || (repair && cmdline_option_install == false)) {
 				/* Log to stdout, so we can post-process */
@@ -349,7 +446,7 @@ static void add_missing_files(struct manifest *official_manifest, bool repair)
 		} else {
 			ret = compute_hash(&local, fullname);
 		}
-		if ((ret != 0) || hash_needs_work(file, local.hash)) {
+		if ((ret != 0) || hash_needs_work(file, &local.hash)) {
 			counts.not_replaced++;
 			print(" -> not fixed\n");
 
@@ -369,21 +466,17 @@ static void add_missing_files(struct manifest *official_manifest, bool repair)
 	}
 }
 
-static void check_and_fix_one(struct file *file, struct manifest *official_manifest, bool repair)
+static void check_and_fix_one(struct file *file, struct manifest *official_manifest, bool repair, bool valid)
 {
 	char *fullname;
 	int ret;
 
-	// Note: boot files not marked as deleted are candidates for verify/fix
-	if (file->is_deleted || ignore(file) || file->do_not_update) {
+	/* compare the hash and report mismatch */
+	if (valid) {
 		return;
 	}
 
-	/* compare the hash and report mismatch */
 	fullname = mk_full_filename(path_prefix, file->filename);
-	if (verify_file(file, fullname)) {
-		goto end;
-	}
 	// do not account for missing files at this point, they are
 	// accounted for in a different stage, only account for mismatch
 	if (access(fullname, F_OK) == 0) {
@@ -418,23 +511,43 @@ end:
 static void deal_with_hash_mismatches(struct manifest *official_manifest, bool repair)
 {
 	struct list *iter;
-	int complete = 0;
-	int list_length;
+	struct file **to_check;
+	bool *valid;
+	size_t len = list_len(official_manifest->files);
+	size_t count = 0, i;
+
+	if (len == 0) {
+		return;
+	}
+
+	to_check = malloc(len * sizeof(struct file *));
+	ON_NULL_ABORT(to_check);
 
 	/* for each expected and present file which hash-mismatches vs
 	 * the manifest, replace the file */
-	iter = list_head(official_manifest->files);
-	list_length = list_len(iter);
+	for (iter = list_head(official_manifest->files); iter; iter = iter->next) {
+		struct file *file = iter->data;
 
-	while (iter) {
-		struct file *file;
-		file = iter->data;
-		iter = iter->next;
-		complete++;
+		// Note: boot files not marked as deleted are candidates for verify/fix
+		if (file->is_deleted || ignore(file) || file->do_not_update) {
+			continue;
+		}
+		to_check[count++] = file;
+	}
 
-		check_and_fix_one(file, official_manifest, repair);
-		progress_report(complete, list_length);
+	valid = calloc(len, sizeof(bool));
+	ON_NULL_ABORT(valid);
+
+	/* hash all candidates in parallel, then report and fix mismatches
+	 * sequentially in manifest order */
+	verify_files_parallel(to_check, valid, count);
+
+	for (i = 0; i < count; i++) {
+		check_and_fix_one(to_check[i], official_manifest, repair, valid[i]);
 	}
+
+	free(valid);
+	free(to_check);
 }
 
 static void remove_orphaned_files(struct manifest *official_manifest, bool repair)
@@ -865,8 +978,7 @@ enum swupd_code verify_main(int argc, char **argv)
 
 	timelist_timer_start(global_times, "Consolidate files from bundles");
 	progress_set_step(4, "consolidate_files");
-	official_manifest->files = files_from_bundles(official_manifest->submanifests);
-	official_manifest->files = consolidate_files(official_manifest->files);
+	official_manifest->files = consolidate_bundle_files(official_manifest->submanifests);
 	progress_complete_step();
 	timelist_timer_stop(global_times);
 
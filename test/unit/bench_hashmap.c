@@ -0,0 +1,144 @@
+/*
+ * Microbenchmark of the hashmap, not run by 'make check'. Build it with
+ * 'make bench' and run it with no arguments to run all cases, or with the
+ * number of elements and the capacity passed to hashmap_new() to run one.
+ *
+ * It only uses the hashmap API available since the first hashmap, so it can
+ * be built with an older hashmap to compare implementations:
+ *   mkdir old
+ *   git show <commit>:src/lib/hashmap.h > old/hashmap.h
+ *   git show <commit>:src/lib/hashmap.c > old/hashmap.c
+ *   gcc -O2 -Iold -Isrc/lib test/unit/bench_hashmap.c old/hashmap.c \
+ *       src/lib/list.c src/lib/log.c src/lib/strings.c -o bench_hashmap_old
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Found in the include path, so an older hashmap can be used
+#include "hashmap.h"
+
+// Lookups are repeated to get stable times
+#define GET_ROUNDS 4
+
+struct element {
+	size_t hash_key;
+	char *path;
+};
+
+static bool element_equal(const void *a, const void *b)
+{
+	return strcmp(((const struct element *)a)->path, ((const struct element *)b)->path) == 0;
+}
+
+static size_t element_hash(const void *data)
+{
+	return ((const struct element *)data)->hash_key;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Time per operation, in nanoseconds
+static double ns(double start, double end, size_t ops)
+{
+	return (end - start) * 1e9 / ops;
+}
+
+static void bench(size_t len, size_t capacity)
+{
+	struct element *elements, *missing;
+	struct hashmap *hashmap;
+	double t0, t1, t2, t3, t4, t5;
+	size_t found = 0;
+	size_t i;
+	int r;
+
+	elements = malloc(len * sizeof(struct element));
+	missing = malloc(len * sizeof(struct element));
+	if (!elements || !missing) {
+		abort();
+	}
+
+	// Paths about 50 bytes long, like the ones in manifests
+	for (i = 0; i < len; i++) {
+		if (asprintf(&elements[i].path, "/usr/lib/python3.7/site-packages/pkg%zu/module_%zu.py", i % 977, i) < 0 ||
+		    asprintf(&missing[i].path, "/usr/share/doc/none/%zu", i) < 0) {
+			abort();
+		}
+	}
+
+	t0 = now();
+	for (i = 0; i < len; i++) {
+		elements[i].hash_key = hashmap_hash_from_string(elements[i].path);
+		missing[i].hash_key = hashmap_hash_from_string(missing[i].path);
+	}
+
+	t1 = now();
+	hashmap = hashmap_new(capacity, element_equal, element_hash);
+	for (i = 0; i < len; i++) {
+		hashmap_put(hashmap, &elements[i]);
+	}
+
+	t2 = now();
+	for (r = 0; r < GET_ROUNDS; r++) {
+		for (i = 0; i < len; i++) {
+			found += hashmap_get(hashmap, &elements[i]) != NULL;
+		}
+	}
+
+	t3 = now();
+	for (r = 0; r < GET_ROUNDS; r++) {
+		for (i = 0; i < len; i++) {
+			found += hashmap_get(hashmap, &missing[i]) != NULL;
+		}
+	}
+
+	t4 = now();
+	for (i = 0; i < len; i++) {
+		found += hashmap_pop(hashmap, &elements[i]) != NULL;
+	}
+	t5 = now();
+
+	printf("%zu elements, capacity %zu: hash %.0fns, put %.0fns, get %.0fns, miss %.0fns, pop %.0fns\n",
+	       len, capacity, ns(t0, t1, 2 * len), ns(t1, t2, len),
+	       ns(t2, t3, GET_ROUNDS * len), ns(t3, t4, GET_ROUNDS * len),
+	       ns(t4, t5, len));
+
+	// Every element must be found once per round and popped once
+	if (found != (GET_ROUNDS + 1) * len) {
+		printf("Unexpected number of elements found: %zu\n", found);
+		exit(EXIT_FAILURE);
+	}
+
+	hashmap_free(hashmap);
+	for (i = 0; i < len; i++) {
+		free(elements[i].path);
+		free(missing[i].path);
+	}
+	free(elements);
+	free(missing);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3) {
+		bench(strtoul(argv[1], NULL, 10), strtoul(argv[2], NULL, 10));
+		return 0;
+	}
+
+	// Cases reported when the hashmap was replaced
+	bench(200000, 256);
+	bench(200000, 200000);
+	bench(1000000, 1000000);
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../src/lib/congestion.h"
+#include "test_helper.h"
+
+// Latencies are averages of the window, so compare with a margin
+#define latency_equals(_a, _b) ((_a) > (_b) - 1e-9 && (_a) < (_b) + 1e-9)
+
+// Complete a window of transfers with the same results
+static enum congestion_decision add_window(struct congestion_control *cc, size_t errors, double latency)
+{
+	enum congestion_decision decision = CONGESTION_KEEP;
+	size_t i, limit = cc->limit ? cc->limit : 1;
+
+	for (i = 0; i < limit; i++) {
+		check(decision == CONGESTION_KEEP);
+		decision = congestion_add_transfer(cc, i < errors, 1000, 0.5, latency);
+	}
+
+	check(cc->last.transfers == limit);
+	check(cc->last.errors == errors);
+	return decision;
+}
+
+static void test_errors(void)
+{
+	struct congestion_control cc;
+
+	congestion_init(&cc, 2, 10);
+	check(cc.limit == 10);
+
+	// Already at the ceiling
+	check(add_window(&cc, 0, 0.01) == CONGESTION_KEEP);
+	check(cc.limit == 10);
+	check(congestion_window_throughput(&cc.last) == 2000);
+
+	// Errors halve the limit, down to the floor
+	check(add_window(&cc, 1, 0.01) == CONGESTION_DECREASE);
+	check(cc.limit == 5);
+	check(add_window(&cc, 5, 0.01) == CONGESTION_DECREASE);
+	check(cc.limit == 2);
+	check(congestion_window_throughput(&cc.last) == 0);
+	check(add_window(&cc, 2, 0.01) == CONGESTION_KEEP);
+	check(cc.limit == 2);
+
+	// And the limit grows again, one at a time
+	check(add_window(&cc, 0, 0.01) == CONGESTION_INCREASE);
+	check(cc.limit == 3);
+	check(add_window(&cc, 0, 0.01) == CONGESTION_INCREASE);
+	check(cc.limit == 4);
+
+	check(congestion_backoff(&cc) == CONGESTION_DECREASE);
+	check(cc.limit == 2);
+	check(congestion_backoff(&cc) == CONGESTION_KEEP);
+}
+
+static void test_latency(void)
+{
+	struct congestion_control cc;
+
+	congestion_init(&cc, 1, 8);
+	check(add_window(&cc, 0, 0.2) == CONGESTION_KEEP);
+	check(latency_equals(cc.base_latency, 0.2));
+
+	// Small changes in latency are ignored
+	check(add_window(&cc, 0, 0.25) == CONGESTION_KEEP);
+	check(add_window(&cc, 0, 0.1) == CONGESTION_KEEP);
+	check(latency_equals(cc.base_latency, 0.1));
+	check(add_window(&cc, 0, 0.15) == CONGESTION_KEEP);
+
+	check(add_window(&cc, 0, 0.3) == CONGESTION_DECREASE);
+	check(cc.limit == 4);
+	check(add_window(&cc, 0, 0.3) == CONGESTION_DECREASE);
+	check(add_window(&cc, 0, 0.3) == CONGESTION_DECREASE);
+	check(cc.limit == 1);
+
+	// At the floor higher latencies are accepted
+	check(add_window(&cc, 0, 0.3) == CONGESTION_INCREASE);
+	check(latency_equals(cc.base_latency, 0.3));
+	check(cc.limit == 2);
+}
+
+static void test_limits(void)
+{
+	struct congestion_control cc;
+
+	// Floor can't be larger than the ceiling
+	congestion_init(&cc, 10, 4);
+	check(cc.floor == 4 && cc.limit == 4);
+	check(add_window(&cc, 4, 0) == CONGESTION_KEEP);
+	check(cc.limit == 4);
+
+	// Synchronous transfers
+	congestion_init(&cc, 1, 0);
+	check(add_window(&cc, 0, 0) == CONGESTION_KEEP);
+	check(add_window(&cc, 1, 0) == CONGESTION_KEEP);
+	check(cc.limit == 0);
+}
+
+int main()
+{
+	test_errors();
+	test_latency();
+	test_limits();
+
+	return 0;
+}
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../src/hash_cache.h"
+#include "../../src/swupd.h"
+#include "test_helper.h"
+
+static char dir[] = "/tmp/test_hash_cache.XXXXXX";
+
+static char *test_file(const char *name)
+{
+	char *filename = NULL;
+
+	string_or_die(&filename, "%s/%s", dir, name);
+	return filename;
+}
+
+static void write_file(const char *name, const char *content)
+{
+	char *filename = test_file(name);
+	FILE *f;
+
+	f = fopen(filename, "w");
+	check(f != NULL);
+	fputs(content, f);
+	check(fclose(f) == 0);
+	free_string(&filename);
+}
+
+static bool lookup(const char *name, union swupd_hash *hash)
+{
+	char *filename = test_file(name);
+	struct stat st;
+	bool found;
+
+	found = hash_cache_lookup(filename, true, &st, hash);
+	free_string(&filename);
+
+	return found;
+}
+
+// Look up a file, storing 'value' as its hash if not found
+static bool lookup_and_store(const char *name, unsigned char value)
+{
+	char *filename = test_file(name);
+	union swupd_hash hash;
+	struct stat st;
+	bool found;
+
+	found = hash_cache_lookup(filename, true, &st, &hash);
+	if (found) {
+		check(hash.bytes[0] == value);
+	} else {
+		memset(&hash, value, sizeof(hash));
+		hash_cache_store(filename, true, &st, &hash);
+	}
+	free_string(&filename);
+
+	return found;
+}
+
+static uint32_t cache_count(void)
+{
+	char *filename = test_file(HASH_CACHE_FILENAME);
+	char header[16];
+	uint32_t count;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	check(f != NULL);
+	check(fread(header, sizeof(header), 1, f) == 1);
+	fclose(f);
+	free_string(&filename);
+
+	memcpy(&count, header + 12, sizeof(count));
+	return count;
+}
+
+static void truncate_cache(off_t len)
+{
+	char *filename = test_file(HASH_CACHE_FILENAME);
+	struct stat st;
+
+	check(stat(filename, &st) == 0);
+	check(truncate(filename, len < 0 ? st.st_size + len : len) == 0);
+	free_string(&filename);
+}
+
+static void test_hash_cache(void)
+{
+	union swupd_hash hash;
+	char *filename;
+
+	check(mkdtemp(dir) != NULL);
+	state_dir = dir;
+
+	write_file("a", "a");
+	write_file("b", "b");
+	write_file("c", "c");
+	write_file("d", "d");
+	write_file("e", "e");
+
+	// Files changed in the last 2 seconds are not cached
+	check(!lookup_and_store("a", 1));
+	check(!lookup_and_store("a", 1));
+
+	sleep(3);
+	check(!lookup_and_store("a", 1));
+	check(lookup_and_store("a", 1));
+	check(!lookup_and_store("b", 2));
+	check(!lookup_and_store("c", 3));
+	check(!lookup_and_store("d", 4));
+	check(!lookup_and_store("e", 5));
+	hash_cache_deinit();
+	check(cache_count() == 5);
+
+	// Loaded from the state dir
+	check(lookup_and_store("a", 1));
+	check(lookup_and_store("b", 2));
+
+	// Changes in ctime, mtime, size or removed files
+	filename = test_file("b");
+	check(chmod(filename, 0600) == 0);
+	free_string(&filename);
+	write_file("c", "x");
+	write_file("d", "dd");
+	filename = test_file("e");
+	check(unlink(filename) == 0);
+	free_string(&filename);
+
+	check(!lookup("b", &hash));
+	check(!lookup("c", &hash));
+	check(!lookup("d", &hash));
+	check(!lookup("e", &hash));
+	check(lookup("a", &hash) && hash.bytes[0] == 1);
+	hash_cache_deinit();
+
+	// Entries that can't match anymore are removed
+	check(cache_count() == 1);
+
+	// Truncated records are ignored
+	truncate_cache(-1);
+	check(!lookup("a", &hash));
+	hash_cache_deinit();
+
+	check(!lookup_and_store("a", 1));
+	hash_cache_deinit();
+	check(cache_count() == 1);
+
+	// Truncated header
+	truncate_cache(10);
+	check(!lookup("a", &hash));
+	hash_cache_deinit();
+
+	string_or_die(&filename, "rm -rf %s", dir);
+	check(system(filename) == 0);
+	free_string(&filename);
+	state_dir = NULL;
+}
+
+int main()
+{
+	test_hash_cache();
+
+	return 0;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../src/lib/hashmap.h"
+#include "test_helper.h"
+
+#define NUM_ELEMENTS 10000
+
+static bool int_equal(const void *a, const void *b)
+{
+	return *(const int *)a == *(const int *)b;
+}
+
+static size_t int_hash(const void *data)
+{
+	return *(const int *)data;
+}
+
+// All values collide, so elements are found by probing
+static size_t bad_hash(const void *data)
+{
+	(void)data;
+	return 42;
+}
+
+static bool str_equal(const void *a, const void *b)
+{
+	return strcmp(a, b) == 0;
+}
+
+static size_t str_hash(const void *data)
+{
+	return hashmap_hash_from_string(data);
+}
+
+static void check_elements(struct hashmap *hashmap, int *values, int from, int to)
+{
+	int i;
+
+	for (i = 0; i < NUM_ELEMENTS; i++) {
+		int key = i;
+
+		if (i >= from && i < to) {
+			check(hashmap_get(hashmap, &key) == &values[i]);
+			check(hashmap_contains(hashmap, &key));
+		} else {
+			check(hashmap_get(hashmap, &key) == NULL);
+			check(!hashmap_contains(hashmap, &key));
+		}
+	}
+}
+
+static void test_hashmap_int(hash_fn_t hash, int count)
+{
+	struct hashmap *hashmap;
+	int *values;
+	int *data;
+	size_t i, found = 0;
+	int key;
+
+	values = malloc(NUM_ELEMENTS * sizeof(int));
+	check(values != NULL);
+	for (key = 0; key < NUM_ELEMENTS; key++) {
+		values[key] = key;
+	}
+
+	// Start small, so the hashmap has to grow
+	hashmap = hashmap_new(1, int_equal, hash);
+	check(hashmap != NULL);
+	for (key = 0; key < count; key++) {
+		check(hashmap_put(hashmap, &values[key]));
+	}
+	check(hashmap_len(hashmap) == (size_t)count);
+
+	// Duplicated elements are not added
+	key = 0;
+	check(!hashmap_put(hashmap, &key));
+	check(hashmap_len(hashmap) == (size_t)count);
+	check(!hashmap_put(hashmap, NULL));
+
+	check_elements(hashmap, values, 0, count);
+
+	HASHMAP_FOREACH(hashmap, i, data)
+	{
+		check(*data >= 0 && *data < count);
+		found++;
+	}
+	check(found == (size_t)count);
+
+	// Remove the first half and check the other elements are still there
+	for (key = 0; key < count / 2; key++) {
+		int k = key;
+
+		check(hashmap_pop(hashmap, &k) == &values[key]);
+		check(hashmap_pop(hashmap, &k) == NULL);
+	}
+	check(hashmap_len(hashmap) == (size_t)(count - count / 2));
+	check_elements(hashmap, values, count / 2, count);
+
+	// Elements can be added again after being removed
+	for (key = 0; key < count / 2; key++) {
+		check(hashmap_put(hashmap, &values[key]));
+	}
+	check_elements(hashmap, values, 0, count);
+
+	hashmap_free(hashmap);
+	free(values);
+}
+
+static void free_str(void *data)
+{
+	free(data);
+}
+
+static void test_hashmap_strings()
+{
+	struct hashmap *hashmap;
+	char buf[64];
+	int i;
+
+	check(hashmap_hash_from_string("abc") == hashmap_hash_from_string("abc"));
+	check(hashmap_hash_from_string("abc") != hashmap_hash_from_string("abd"));
+	check(hashmap_hash_from_string("") != hashmap_hash_from_string("a"));
+	check(hashmap_hash_from_string("/usr/bin/aaaaaaa1") != hashmap_hash_from_string("/usr/bin/aaaaaaa2"));
+
+	hashmap = hashmap_new(16, str_equal, str_hash);
+	for (i = 0; i < NUM_ELEMENTS; i++) {
+		snprintf(buf, sizeof(buf), "/usr/share/file-%d", i);
+		check(hashmap_put(hashmap, strdup(buf)));
+	}
+	check(hashmap_len(hashmap) == NUM_ELEMENTS);
+
+	for (i = 0; i < NUM_ELEMENTS; i++) {
+		char *data;
+
+		snprintf(buf, sizeof(buf), "/usr/share/file-%d", i);
+		data = hashmap_get(hashmap, buf);
+		check(data != NULL && strcmp(data, buf) == 0);
+	}
+	check(!hashmap_contains(hashmap, "/usr/share/file-"));
+
+	hashmap_free_hash_and_data(hashmap, free_str);
+}
+
+int main()
+{
+	test_hashmap_int(int_hash, NUM_ELEMENTS);
+	test_hashmap_int(bad_hash, 500);
+	test_hashmap_strings();
+
+	return 0;
+}
@@ -1,7 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../../src/manifest.h"
+#include "../../src/manifest_cache.h"
 #include "../../src/swupd.h"
 #include "test_helper.h"
 
@@ -9,12 +12,14 @@ static void validate_file(struct list *files, const char *filename, int version,
 {
 	struct list *list;
 	char hash_str[SWUPD_HASH_LEN];
+	char file_hash[SWUPD_HASH_LEN];
 	snprintf(hash_str, SWUPD_HASH_LEN, "%064d", hash);
 
 	for (list = files; list; list = list->next) {
 		struct file *file = list->data;
 		if (strcmp(filename, file->filename) == 0) {
-			check(strcmp(file->hash, hash_str) == 0);
+			hash_to_hex(&file->hash, file_hash);
+			check(strcmp(file_hash, hash_str) == 0);
 			check(file->is_dir == is_dir);
 			check(file->is_file == is_file);
 			check(file->is_link == is_link);
@@ -93,8 +98,219 @@ static void test_manifest_parse()
 	check(manifest == NULL);
 }
 
+static void check_same_file_list(struct list *list1, struct list *list2)
+{
+	for (; list1 && list2; list1 = list1->next, list2 = list2->next) {
+		struct file *file1 = list1->data;
+		struct file *file2 = list2->data;
+
+		check(strcmp(file1->filename, file2->filename) == 0);
+		check(hash_equal(&file1->hash, &file2->hash));
+		check(file1->last_change == file2->last_change);
+		check(file1->is_dir == file2->is_dir);
+		check(file1->is_file == file2->is_file);
+		check(file1->is_link == file2->is_link);
+		check(file1->is_deleted == file2->is_deleted);
+		check(file1->is_ghosted == file2->is_ghosted);
+		check(file1->is_manifest == file2->is_manifest);
+		check(file1->is_config == file2->is_config);
+		check(file1->is_state == file2->is_state);
+		check(file1->is_boot == file2->is_boot);
+		check(file1->is_experimental == file2->is_experimental);
+		check(file1->is_mix == file2->is_mix);
+		check(file1->is_tracked == file2->is_tracked);
+	}
+	check(list1 == NULL && list2 == NULL);
+}
+
+static void check_equal_manifests(struct manifest *manifest1, struct manifest *manifest2)
+{
+	struct list *list1, *list2;
+
+	if (!manifest1 || !manifest2) {
+		check(manifest1 == NULL && manifest2 == NULL);
+		return;
+	}
+
+	check(manifest1->manifest_version == manifest2->manifest_version);
+	check(manifest1->version == manifest2->version);
+	check(manifest1->filecount == manifest2->filecount);
+	check(manifest1->contentsize == manifest2->contentsize);
+	check(manifest1->is_mix == manifest2->is_mix);
+	check(strcmp(manifest1->component, manifest2->component) == 0);
+
+	for (list1 = manifest1->includes, list2 = manifest2->includes; list1 && list2; list1 = list1->next, list2 = list2->next) {
+		check(strcmp(list1->data, list2->data) == 0);
+	}
+	check(list1 == NULL && list2 == NULL);
+
+	check_same_file_list(manifest1->files, manifest2->files);
+	check_same_file_list(manifest1->manifests, manifest2->manifests);
+	check(manifest1->files_by_name_len == manifest2->files_by_name_len);
+}
+
+// The mmap parser must return the same as the stdio parser
+static void check_same_manifest(const char *filename, bool header_only)
+{
+	struct manifest *manifest1, *manifest2;
+
+	manifest1 = manifest_parse("test", filename, header_only);
+	manifest2 = manifest_parse_stdio("test", filename, header_only);
+	check_equal_manifests(manifest1, manifest2);
+
+	free_manifest(manifest1);
+	free_manifest(manifest2);
+}
+
+static void test_manifest_parse_stdio()
+{
+	const char *files[] = {
+		"test/unit/missing",
+		"test/unit/data/mom1",
+		"test/unit/data/mom2",
+		"test/unit/data/mom3",
+		"test/unit/data/mom_invalid1",
+		"test/unit/data/mom_invalid2",
+		"test/unit/data/mom_invalid3",
+	};
+	struct manifest *manifest;
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		check_same_manifest(files[i], true);
+		check_same_manifest(files[i], false);
+	}
+
+	// Includes, ignored entries and uncommon filenames
+	manifest = manifest_parse("test", "test/unit/data/mom3", false);
+	check(manifest != NULL);
+	check(manifest->version == 40);
+	check(list_len(manifest->includes) == 2);
+	check(list_len(manifest->files) == 7);
+	check(list_len(manifest->manifests) == 1);
+	check(manifest->is_mix == 1);
+
+	validate_file(manifest->files, "/usr/bin/with space", 40, 2, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	validate_file(manifest->files, "/usr/bin/with\ttab", 40, 3, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	validate_file(manifest->files, "/usr/bin/deleted", 40, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0);
+	validate_file(manifest->files, "/usr/lib/kernel/default", 20, 5, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0);
+	validate_file(manifest->files, "/etc/mixed", 40, 6, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1);
+
+	free_manifest(manifest);
+
+	// Last entry without a line break
+	manifest = manifest_parse("test", "test/unit/data/mom_invalid3", false);
+	check(manifest == NULL);
+}
+
+// A manifest loaded from the cache must be the same as the parsed one
+static void check_cached_manifest(const char *filename, const char *cache)
+{
+	struct manifest *manifest, *cached;
+
+	manifest = manifest_parse("test", filename, false);
+	check(manifest != NULL);
+	manifest_cache_store(manifest, cache);
+
+	cached = manifest_cache_load("test", cache, false);
+	check_equal_manifests(manifest, cached);
+	free_manifest(cached);
+
+	cached = manifest_cache_load("test", cache, true);
+	check(cached != NULL);
+	check(cached->files == NULL && cached->manifests == NULL);
+	check(cached->version == manifest->version);
+	check(list_len(cached->includes) == list_len(manifest->includes));
+	free_manifest(cached);
+
+	free_manifest(manifest);
+}
+
+static void test_manifest_cache()
+{
+	char cache[] = "/tmp/test_manifest_cache.XXXXXX";
+	int fd;
+
+	fd = mkstemp(cache);
+	check(fd >= 0);
+	close(fd);
+
+	check_cached_manifest("test/unit/data/mom2", cache);
+	check_cached_manifest("test/unit/data/mom3", cache);
+
+	// Invalid caches are ignored
+	check(manifest_cache_load("test", "test/unit/missing", false) == NULL);
+	check(manifest_cache_load("test", "test/unit/data/mom2", false) == NULL);
+
+	check(truncate(cache, 100) == 0);
+	check(manifest_cache_load("test", cache, false) == NULL);
+
+	unlink(cache);
+}
+
+// Check that the files in the list are sorted and unique
+static void check_sorted_files(struct list *files)
+{
+	struct list *list;
+
+	for (list = files; list && list->next; list = list->next) {
+		check(strcmp(((struct file *)list->data)->filename, ((struct file *)list->next->data)->filename) < 0);
+	}
+}
+
+static void test_consolidate_bundle_files()
+{
+	struct manifest *bundle1, *bundle2;
+	struct list *bundles = NULL;
+	struct list *files, *expected, *l1, *l2;
+
+	bundle1 = manifest_parse("bundle1", "test/unit/data/bundle1", false);
+	bundle2 = manifest_parse("bundle2", "test/unit/data/bundle2", false);
+	check(bundle1 != NULL && bundle2 != NULL);
+	bundles = list_prepend_data(bundles, bundle2);
+	bundles = list_prepend_data(bundles, bundle1);
+
+	files = consolidate_bundle_files(bundles);
+	check(list_len(files) == 6);
+	check_sorted_files(files);
+	validate_file(files, "/a", 10, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	validate_file(files, "/b", 20, 2, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	validate_file(files, "/c", 40, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0);
+	validate_file(files, "/d", 5, 4, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	validate_file(files, "/only-1", 10, 6, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	validate_file(files, "/only-2", 10, 7, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	// Same result as sorting all files and consolidating them
+	expected = list_head(consolidate_files(files_from_bundles(bundles)));
+	check(list_len(expected) == list_len(files));
+	for (l1 = files, l2 = expected; l1 && l2; l1 = l1->next, l2 = l2->next) {
+		check(l1->data == l2->data);
+	}
+	list_free_list(expected);
+	list_free_list(files);
+
+	// Prefer tracked files, also when the file list isn't indexed by name
+	((struct file *)bundle1->files->data)->is_tracked = 0;
+	free(bundle2->files_by_name);
+	bundle2->files_by_name = NULL;
+	bundle2->files_by_name_len = 0;
+	bundle2->files = list_sort(bundle2->files, file_sort_filename_reverse);
+
+	files = consolidate_bundle_files(bundles);
+	check(list_len(files) == 6);
+	check_sorted_files(files);
+	validate_file(files, "/a", 20, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	list_free_list(files);
+
+	list_free_list(bundles);
+	free_manifest(bundle1);
+	free_manifest(bundle2);
+}
+
 int main() {
 	test_manifest_parse();
+	test_manifest_parse_stdio();
+	test_manifest_cache();
+	test_consolidate_bundle_files();
 
 	return 0;
 }
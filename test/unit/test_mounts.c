@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+#include "../../src/lib/mounts.h"
+#include "test_helper.h"
+
+static void check_containing(struct mount_table *table, const char *path, const char *expected)
+{
+	const struct mount_entry *mount;
+
+	mount = mount_table_find_containing(table, path);
+	check(mount != NULL);
+	check(strcmp(mount->path, expected) == 0);
+}
+
+static void test_mount_table(void)
+{
+	struct mount_table *table;
+	const struct mount_entry *mount;
+	size_t i;
+
+	table = mount_table_load("test/unit/data/mountinfo");
+	check(table != NULL);
+
+	// Stacked mounts on /mnt/a are only listed once
+	check(table->len == 10);
+	for (i = 1; i < table->len; i++) {
+		check(strcmp(table->entries[i - 1].path, table->entries[i].path) != 0);
+	}
+
+	mount = mount_table_find(table, "/boot");
+	check(mount != NULL);
+	check(mount->id == 25 && mount->parent_id == 22);
+	check(mount->dev == makedev(8, 2));
+
+	// The last mount is the one visible
+	mount = mount_table_find(table, "/mnt/a");
+	check(mount != NULL && mount->id == 31);
+
+	check(mount_table_find(table, "/home/user/my files") != NULL);
+	check(mount_table_find(table, "/etc/hosts") != NULL);
+	check(mount_table_find(table, "/etc") == NULL);
+	check(mount_table_find(table, "/boot/") == NULL);
+	check(mount_table_find(table, "/mnt") == NULL);
+
+	check_containing(table, "/", "/");
+	check_containing(table, "/usr/bin/ls", "/");
+	check_containing(table, "/boot", "/boot");
+	check_containing(table, "/boot/EFI/file", "/boot");
+	check_containing(table, "/bootx", "/");
+	check_containing(table, "/home/user/my files/a", "/home/user/my files");
+	check_containing(table, "/home/user/my", "/home");
+	check_containing(table, "/mnt/a/b/c", "/mnt/a/b");
+	check_containing(table, "/mnt/a/c", "/mnt/a");
+	check_containing(table, "/mnt/a-b/c", "/mnt/a-b");
+	check_containing(table, "/mnt/a-c", "/");
+	check_containing(table, "/mnt/a.b", "/");
+	check_containing(table, "/zzz", "/");
+
+	mount_table_free(table);
+
+	check(mount_table_load("test/unit/data/no_such_file") == NULL);
+	check(mount_table_find(NULL, "/") == NULL);
+	check(mount_table_find_containing(NULL, "/") == NULL);
+}
+
+int main()
+{
+	test_mount_table();
+
+	return 0;
+}
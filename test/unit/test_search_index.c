@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../src/lib/list.h"
+#include "../../src/lib/strings.h"
+#include "../../src/search_index.h"
+#include "test_helper.h"
+
+#define NUM_FILES 1000
+
+struct match {
+	char *filename;
+	uint32_t bundles[2];
+	uint32_t bundles_len;
+};
+
+struct results {
+	struct match matches[NUM_FILES + 10];
+	int len;
+};
+
+static void add_match(const char *filename, const uint32_t *bundles, uint32_t bundles_len, void *data)
+{
+	struct results *results = data;
+	struct match *m = &results->matches[results->len++];
+
+	check(bundles_len > 0 && bundles_len <= 2);
+	m->filename = strdup(filename);
+	memcpy(m->bundles, bundles, bundles_len * sizeof(uint32_t));
+	m->bundles_len = bundles_len;
+}
+
+static void results_free(struct results *results)
+{
+	int i;
+
+	for (i = 0; i < results->len; i++) {
+		free(results->matches[i].filename);
+	}
+	results->len = 0;
+}
+
+static void query(struct search_index *index, const char *str, struct results *results)
+{
+	struct list *literals = NULL;
+
+	results_free(results);
+	if (str) {
+		literals = list_prepend_data(NULL, strdup(str));
+	}
+	search_index_query(index, literals, add_match, results);
+	list_free_list_and_data(literals, free);
+}
+
+// Results are a superset of the files that contain the string, sorted by name
+static void check_results(struct results *results, const char *str)
+{
+	int i, found = 0;
+
+	for (i = 0; i < results->len; i++) {
+		if (i > 0) {
+			check(strcmp(results->matches[i - 1].filename, results->matches[i].filename) < 0);
+		}
+		if (strcasestr(results->matches[i].filename, str)) {
+			found++;
+		}
+	}
+	check(found == results->len);
+}
+
+static void test_search_index(void)
+{
+	char filename[] = "/tmp/test_search_index.XXXXXX";
+	struct search_index_builder *builder;
+	struct search_index *index;
+	struct results *results;
+	uint32_t bin, lib, doc;
+	char buf[64];
+	int fd, i;
+
+	fd = mkstemp(filename);
+	check(fd >= 0);
+	close(fd);
+
+	builder = search_index_builder_new();
+	// Bundles ids are changed to the order of names in the index
+	doc = search_index_builder_add_bundle(builder, "doc");
+	bin = search_index_builder_add_bundle(builder, "bin");
+	lib = search_index_builder_add_bundle(builder, "lib");
+	for (i = 0; i < NUM_FILES; i++) {
+		snprintf(buf, sizeof(buf), "/usr/share/doc/file%d", i);
+		search_index_builder_add_file(builder, doc, buf);
+	}
+	search_index_builder_add_file(builder, bin, "/usr/bin/SWUPD");
+	search_index_builder_add_file(builder, bin, "/usr/bin/ls");
+	search_index_builder_add_file(builder, lib, "/usr/lib64/libswupd.so");
+	search_index_builder_add_file(builder, lib, "/usr/bin/ls");
+	search_index_builder_add_file(builder, lib, "/usr/bin/ls");
+	check(search_index_builder_write(builder, filename, 10, 1234));
+	search_index_builder_free(builder);
+
+	// Version or fingerprint doesn't match
+	check(search_index_load(filename, 20, 1234) == NULL);
+	check(search_index_load(filename, 10, 1) == NULL);
+
+	index = search_index_load(filename, 10, 1234);
+	check(index != NULL);
+	check(search_index_bundles_len(index) == 3);
+	check(search_index_bundle_id(index, "bin") == 0);
+	check(search_index_bundle_id(index, "doc") == 1);
+	check(search_index_bundle_id(index, "lib") == 2);
+	check(search_index_bundle_id(index, "none") == -1);
+
+	results = calloc(1, sizeof(struct results));
+	check(results != NULL);
+
+	query(index, "swupd", results);
+	check(results->len == 2);
+	check_results(results, "swupd");
+	check(strcmp(results->matches[0].filename, "/usr/bin/SWUPD") == 0);
+	check(results->matches[0].bundles_len == 1 && results->matches[0].bundles[0] == 0);
+	check(strcmp(results->matches[1].filename, "/usr/lib64/libswupd.so") == 0);
+	check(results->matches[1].bundles_len == 1 && results->matches[1].bundles[0] == 2);
+
+	// Files in more than one bundle are reported once
+	query(index, "/usr/bin/ls", results);
+	check(results->len == 1);
+	check(results->matches[0].bundles_len == 2);
+	check(results->matches[0].bundles[0] == 0 && results->matches[0].bundles[1] == 2);
+
+	query(index, "file99", results);
+	check(results->len == 11);
+	check_results(results, "file99");
+
+	query(index, "not_found", results);
+	check(results->len == 0);
+
+	// Short strings can't be used to filter
+	query(index, "ls", results);
+	check(results->len == NUM_FILES + 3);
+	query(index, NULL, results);
+	check(results->len == NUM_FILES + 3);
+
+	results_free(results);
+	free(results);
+	search_index_free(index);
+
+	// Invalid indexes are ignored
+	check(truncate(filename, 100) == 0);
+	check(search_index_load(filename, 10, 1234) == NULL);
+	unlink(filename);
+	check(search_index_load(filename, 10, 1234) == NULL);
+}
+
+static void check_literals(const char *regex, const char *expected[])
+{
+	struct list *literals, *l;
+	int i = 0;
+
+	literals = search_index_regex_literals(regex);
+	for (l = list_head(literals); l; l = l->next) {
+		check(expected[i] != NULL);
+		check(list_search(literals, expected[i], list_strcmp) != NULL);
+		i++;
+	}
+	check(expected[i] == NULL);
+	list_free_list_and_data(literals, free);
+}
+
+static void test_regex_literals(void)
+{
+	const char *none[] = { NULL };
+	const char *plain[] = { "libswupd", NULL };
+	const char *anchors[] = { "/usr/bin/", NULL };
+	const char *parts[] = { "libcurl", ".so", NULL };
+	const char *optional[] = { "swup", "ent", NULL };
+
+	check_literals("", none);
+	check_literals("libswupd", plain);
+	check_literals("^/usr/bin/$", anchors);
+	check_literals("libcurl.*\\.so", parts);
+	check_literals("swupd?[a-z]+(client)*ent", optional);
+	check_literals("libswupd|curl", none);
+	check_literals("ab\\wcd", none);
+	check_literals("a{2,3}bc", none);
+}
+
+int main()
+{
+	test_search_index();
+	test_regex_literals();
+
+	return 0;
+}
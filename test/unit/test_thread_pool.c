@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../src/lib/thread_pool.h"
+#include "test_helper.h"
+
+#define NUM_TASKS 100000
+#define NUM_CHILDREN 100
+
+static unsigned long counter;
+
+static void increment(void *data)
+{
+	(void)data;
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
+
+struct parent {
+	struct tp *tp;
+	unsigned long children;
+};
+
+static void child_run(void *data)
+{
+	struct parent *parent = data;
+
+	__atomic_add_fetch(&parent->children, 1, __ATOMIC_RELAXED);
+}
+
+// Schedule tasks from a task and wait for them
+static void parent_run(void *data)
+{
+	struct parent *parent = data;
+	struct tp_group *group;
+	int i;
+
+	group = tp_group_new(parent->tp);
+	for (i = 0; i < NUM_CHILDREN; i++) {
+		check(tp_group_task_schedule(group, child_run, parent) == 0);
+	}
+	tp_group_wait(group);
+	check(__atomic_load_n(&parent->children, __ATOMIC_RELAXED) == NUM_CHILDREN);
+	tp_group_free(group);
+
+	increment(NULL);
+}
+
+static void test_tasks(int num_threads)
+{
+	struct tp *tp;
+	int i;
+
+	tp = tp_start(num_threads);
+	check(tp != NULL);
+	check(tp_get_num_threads(tp) == num_threads);
+
+	// The pool can be used again after tp_wait()
+	counter = 0;
+	for (i = 0; i < NUM_TASKS; i++) {
+		check(tp_task_schedule(tp, increment, NULL) == 0);
+	}
+	tp_wait(tp);
+	check(counter == NUM_TASKS);
+
+	for (i = 0; i < NUM_TASKS; i++) {
+		check(tp_task_schedule(tp, increment, NULL) == 0);
+	}
+	tp_complete(tp);
+	check(counter == 2 * NUM_TASKS);
+}
+
+static void test_groups(int num_threads)
+{
+	struct parent parents[NUM_CHILDREN];
+	struct tp_group *group1, *group2;
+	struct tp *tp;
+	int i;
+
+	tp = tp_start(num_threads);
+	check(tp != NULL);
+
+	counter = 0;
+	group1 = tp_group_new(tp);
+	group2 = tp_group_new(tp);
+	for (i = 0; i < NUM_CHILDREN; i++) {
+		parents[i].tp = tp;
+		parents[i].children = 0;
+		check(tp_group_task_schedule(i % 2 ? group1 : group2, parent_run, &parents[i]) == 0);
+	}
+
+	tp_group_wait(group1);
+	for (i = 1; i < NUM_CHILDREN; i += 2) {
+		check(parents[i].children == NUM_CHILDREN);
+	}
+
+	tp_group_free(group2);
+	tp_group_free(group1);
+	check(counter == NUM_CHILDREN);
+
+	tp_complete(tp);
+}
+
+int main()
+{
+	test_tasks(0);
+	test_tasks(1);
+	test_tasks(4);
+	test_groups(0);
+	test_groups(1);
+	test_groups(4);
+
+	return 0;
+}